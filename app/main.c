@@ -7,11 +7,22 @@
  * command loop, and command execution. Key features include:
  *
  * - Version printing with '-v' or '-V' flags
- * - Custom prompt management
+ * - Batch mode for '-c' strings, script files and piped stdin
+ * - Compiled script images cached on disk
+ * - Custom prompt management with escapes and an asynchronous VCS segment
  * - Command parsing and execution
- * - Built-in command handling (cd, exit, history)
+ * - Built-in commands dispatched through a constant-time table
+ * - In-process echo, printf, test/[, true, false, pwd and kill
+ * - Bounded parallel runner (parallel builtin)
+ * - Per job CPU, memory and wall clock accounting (jobs -l, time builtin)
+ * - Latency histograms for each stage of a command line (stats builtin)
  * - Background process management
- * - Command history using GNU Readline
+ * - Selectable posix_spawn or fork launch backend (launch builtin)
+ * - Hashed command paths (hash builtin)
+ * - Pipelines with pipefail and pipe size options (set builtin)
+ * - Command history using GNU Readline, kept in a shared history file
+ * - Indexed history search (history -s, C-r)
+ * - Inline autosuggestions ranked by frecency
  * - Signal handling and terminal control
  *
  * @author nolanstetz
@@ -70,179 +81,278 @@ void init_shell() {
     }
 }
 
-int execute_command(char **args) {
-    pid_t pid = fork();
-
-    if (pid == -1) {
-        perror("fork failed");
+int execute_command(struct shell *sh, char **args) {
+    struct pipeline pl;
+    if (pipeline_parse(args, &pl) != 0) {
         return -1;
-    } else if (pid == 0) {
-        // Child process
-        pid_t child = getpid();
-        setpgid(child, child);
-        tcsetpgrp(shell_terminal, child);
-        
-        // Reset signal handlers
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTSTP, SIG_DFL);
-        signal(SIGTTIN, SIG_DFL);
-        signal(SIGTTOU, SIG_DFL);
-
-        if (execvp(args[0], args) == -1) {
-            perror("execvp failed");
-            exit(EXIT_FAILURE);
+    }
+
+    // All stages share one process group that owns the terminal
+    int status = -1;
+    if (launch_pipeline(sh, &pl, true) != -1) {
+        status = wait_pipeline(sh, &pl);
+    }
+    pipeline_free(&pl);
+
+    // Put shell back in foreground
+    if (sh->shell_is_interactive) {
+        uint64_t t0 = stat_now();
+        tcsetpgrp(shell_terminal, shell_pgid);
+        stat_record(sh, STAT_HANDOFF, stat_now() - t0);
+    }
+
+    return status;
+}
+
+/**
+ * @brief Run one parsed command: builtins first, then a pipeline in the
+ * foreground or a background job.
+ *
+ * @return int 1 when the shell should exit, 0 otherwise
+ */
+static int run_args(struct shell *sh, char **args, bool run_in_background,
+                    char *full_command) {
+    // A background builtin runs in a child like any other job
+    if (!run_in_background && do_builtin(sh, args)) {
+        return sh->exit_requested;
+    }
+
+    if (run_in_background) {
+        // start_background_process copies the command out of the arena
+        if (full_command == NULL ||
+            start_background_process(sh, args, full_command) != 0) {
+            fprintf(stderr, "Failed to start background process\n");
         }
     } else {
-        // Parent process
-        int status;
-        setpgid(pid, pid);
-        tcsetpgrp(shell_terminal, pid);
-
-        if (waitpid(pid, &status, WUNTRACED) == -1) {
-            perror("waitpid failed");
-            return -1;
+        // Execute the command
+        sh->last_status = execute_command(sh, args);
+        if (sh->last_status != 0) {
+            fprintf(stderr, "Command execution failed\n");
         }
+        if (sh->last_status < 0) {
+            sh->last_status = 127;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Run one trimmed command line, which runs as a background job when
+ * it ends in '&'.
+ *
+ * @return int 1 when the shell should exit, 0 otherwise
+ */
+static int run_line(struct shell *sh, char *line) {
+    if (*line == '\0') {
+        return 0;
+    }
+
+    // Check if the command should run in the background
+    bool run_in_background = false;
+    size_t len = strlen(line);
+    if (line[len - 1] == '&') {
+        run_in_background = true;
+        line[len - 1] = '\0';  // Remove the '&'
+        line = trim_white(line);  // Trim any spaces before '&'
+    }
+
+    // Parsing writes into the line, keep a copy for the job table
+    char *full_command = NULL;
+    if (run_in_background) {
+        full_command = arena_strdup(&sh->arena, line);
+    }
+
+    uint64_t t0 = stat_now();
+    char **args = cmd_parse_arena(&sh->arena, line);
+    stat_record(sh, STAT_PARSE, stat_now() - t0);
+    if (args == NULL || args[0] == NULL) {
+        return 0;
+    }
+    return run_args(sh, args, run_in_background, full_command);
+}
 
-        // Put shell back in foreground
+static void run_interactive(struct shell *sh) {
+    char *line;
+    const char *prompt;
+    using_history();
+    history_open(NULL, HISTORY_LOAD_RECENT);
+    history_bind_search();
+    suggest_bind();
+    // Slow prompt segments are filled in by a worker thread
+    prompt_async_init(sh);
+
+    while (1) {
+        // Everything allocated for the previous line is released at once
+        arena_reset(&sh->arena);
+        // Ensure the shell is in the foreground
         tcsetpgrp(shell_terminal, shell_pgid);
+        // Check for finished background processes
+        check_background_processes(sh);
+
+        // Rendered once and cached until the prompt changes
+        uint64_t t0 = stat_now();
+        prompt = sh_prompt(sh);
+        uint64_t t1 = stat_now();
+        stat_record(sh, STAT_PROMPT, t1 - t0);
+
+        char *input = sh_readline(sh, prompt);
+        stat_record(sh, STAT_READLINE, stat_now() - t1);
+
+        if (input == NULL) {
+            // EOF (Ctrl-D) detected
+            printf("\n");
+            break;
+        }
+
+        if (*input != '\0') {
+            history_append(input);
+        }
+        // Move the line into the arena so it shares the lifetime of the parse
+        line = arena_strdup(&sh->arena, input);
+        free(input);
+        if (line == NULL) {
+            continue;
+        }
 
-        return WEXITSTATUS(status);
+        t0 = stat_now();
+        line = trim_white(line);
+        stat_record(sh, STAT_TRIM, stat_now() - t0);
+        if (run_line(sh, line)) {
+            break;
+        }
     }
-    return 0;
+    //clean up and exit
+    printf("Exiting shell\n");
+    history_close();
+    rl_clear_history();
 }
 
-int main(int argc, char *argv[]) {
+/**
+ * @brief Run a script from its compiled image, so a script that is already
+ * in the cache is never lexed again.
+ *
+ * @return int The status of the last command, 127 if the script can't be read
+ */
+static int run_script(struct shell *sh, const char *script) {
+    struct script_image img;
+    if (script_image_open(&img, script) != 0) {
+        perror(script);
+        return 127;
+    }
 
-    int opt;
-    // Initialize shell
-    init_shell();
-    struct shell sh = {0};
-    sh_init(&sh);
+    char **args;
+    bool run_in_background;
+    char *full_command;
+    while (1) {
+        arena_reset(&sh->arena);
+        check_background_processes(sh);
 
-    // Get custom prompt from environment variable
-    char *custom_prompt = getenv("MY_PROMPT");
-    if (custom_prompt != NULL) {
-        int prompt_result = set_prompt(custom_prompt);
-        if (prompt_result != PROMPT_OK) {
-            fprintf(stderr, "Warning: Failed to set custom prompt from environment variable\n");
+        args = script_image_next(&img, &sh->arena, &run_in_background, &full_command);
+        if (args == NULL || run_args(sh, args, run_in_background, full_command)) {
+            break;
         }
+    }
+    script_image_close(&img);
+    return sh->last_status;
+}
+
+/**
+ * @brief Run commands from a -c string or stdin. Lines are split in place
+ * in a mapped or chunked buffer, and there is no prompt, history or
+ * terminal handoff per line.
+ *
+ * @return int The status of the last command, 127 if the input can't be read
+ */
+static int run_batch(struct shell *sh, const char *command) {
+    struct line_reader lr;
+    int rc;
+    if (command != NULL) {
+        rc = line_reader_open_string(&lr, command);
     } else {
-        // Use default prompt if MY_PROMPT is not set
-        if (setenv("MY_PROMPT", "shell$ ", 1) != 0) {
-            perror("Failed to set default prompt");
+        rc = line_reader_open_fd(&lr, STDIN_FILENO);
+    }
+    if (rc != 0) {
+        perror("Failed to read input");
+        return 127;
+    }
+
+    char *line;
+    while ((line = line_reader_next(&lr)) != NULL) {
+        arena_reset(&sh->arena);
+        check_background_processes(sh);
+
+        uint64_t t0 = stat_now();
+        line = trim_white(line);
+        stat_record(sh, STAT_TRIM, stat_now() - t0);
+        // Skip comments, which includes the #! line of a script
+        if (*line == '#') {
+            continue;
+        }
+        if (run_line(sh, line)) {
+            break;
         }
     }
+    line_reader_close(&lr);
+    return sh->last_status;
+}
 
-    // Process other command-line options
-    while ((opt = getopt(argc, argv, "vV")) != -1) {
+int main(int argc, char *argv[]) {
+
+    int opt;
+    const char *command = NULL;
+
+    // Process command-line options before touching the terminal
+    while ((opt = getopt(argc, argv, "vVc:")) != -1) {
         switch (opt) {
             case 'V':
             case 'v':
                 printf("Version %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
                 exit(0);
+            case 'c':
+                command = optarg;
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-v|-V]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-v|-V] [-c command | script]\n", argv[0]);
                 exit(1);
         }
     }
+    const char *script = optind < argc ? argv[optind] : NULL;
 
+    // Initialize shell
+    struct shell sh = SHELL_INITIALIZER;
+    sh.batch = command != NULL || script != NULL || !isatty(STDIN_FILENO);
+    if (!sh.batch) {
+        init_shell();
+    }
+    sh_init(&sh);
 
-    char *line;
-    char **args;
-    char *prompt;
     int status = 0;
-    using_history();
-
-   while (1) {
-        // Ensure the shell is in the foreground
-        tcsetpgrp(shell_terminal, shell_pgid);
-        // Check for finished background processes
-        check_background_processes(&sh);
-
-        prompt = get_prompt("MY_PROMPT");
-        if (prompt == NULL) {
-            fprintf(stderr, "Failed to get prompt, using default\n");
-            prompt = strdup("shell$ ");
-            if (prompt == NULL) {
-                fprintf(stderr, "Memory allocation failed\n");
-                status = 1;
-                break;
-            }
+    if (sh.batch) {
+        if (command == NULL && script != NULL) {
+            status = run_script(&sh, script);
+        } else {
+            status = run_batch(&sh, command);
         }
+        history_close();
+        sh_destroy(&sh);
+        return status;
+    }
 
-        line = readline(prompt);
-        free(prompt);
-
-        if (line == NULL) {
-            // EOF (Ctrl-D) detected
-            printf("\n");
-            break;
+    // Get custom prompt from environment variable
+    char *custom_prompt = getenv("MY_PROMPT");
+    if (custom_prompt != NULL) {
+        int prompt_result = set_prompt(custom_prompt);
+        if (prompt_result != PROMPT_OK) {
+            fprintf(stderr, "Warning: Failed to set custom prompt from environment variable\n");
         }
-
-        if (strlen(line) > 0) {
-            add_history(line);
-            char *trimmed_line = trim_white(line);
-            
-            // Check if the command should run in the background
-            int run_in_background = 0;
-            size_t len = strlen(trimmed_line);
-            if (len > 0 && trimmed_line[len - 1] == '&') {
-                run_in_background = 1;
-                trimmed_line[len - 1] = '\0';  // Remove the '&'
-                trimmed_line = trim_white(trimmed_line);  // Trim any spaces before '&'
-            }
-
-            args = cmd_parse(trimmed_line);
-
-            if (args != NULL) {
-                if (strcmp(args[0], "cd") == 0) {
-                    if (change_dir(args[1] ? &args[1] : NULL) != 0) {
-                        fprintf(stderr, "Failed to change directory\n");
-                    }
-                } else if (strcmp(args[0], "exit") == 0) {
-                    cmd_free(args);
-                    free(line);
-                    break;
-                } else if (strcmp(args[0], "history") == 0) {
-                    int limit = 0;
-                    if (args[1] != NULL) {
-                        limit = atoi(args[1]);
-                    }
-                    if (print_history(limit) != 0) {
-                        fprintf(stderr, "Failed to print history\n");
-                    }
-                } else if (strncmp(args[0], "MY_PROMPT=", 10) == 0) {
-                    char *new_prompt = args[0] + 10;  // Skip "MY_PROMPT="
-                    int prompt_result = set_prompt(new_prompt);
-                    if (prompt_result != PROMPT_OK) {
-                        // Error message is already printed in set_prompt
-                        continue;  // Continue the shell loop
-                    }
-                    printf("Prompt updated successfully.\n");
-                }   else if (strcmp(args[0], "jobs") == 0) {
-                    print_jobs(&sh);
-                }
-                 else {
-                    if (run_in_background) {
-                        if (start_background_process(&sh, args, trimmed_line) != 0) {
-                            fprintf(stderr, "Failed to start background process\n");
-                        }
-                    } else {
-                        // Execute the command
-                        if (execute_command(args) != 0) {
-                            fprintf(stderr, "Command execution failed\n");
-                        }
-                    }
-                }
-                cmd_free(args);
-            }
+    } else {
+        // Use default prompt if MY_PROMPT is not set
+        if (setenv("MY_PROMPT", "shell$ ", 1) != 0) {
+            perror("Failed to set default prompt");
         }
-        free(line);
     }
-    //clean up and exit
-    printf("Exiting shell\n");
-    rl_clear_history();
+
+    run_interactive(&sh);
     sh_destroy(&sh);
     return status;
-}
\ No newline at end of file
+}
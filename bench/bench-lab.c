@@ -0,0 +1,267 @@
+/**
+ * @file bench-lab.c
+ * @brief Microbenchmarks for the shell's per command hot paths
+ *
+ * Each benchmark runs its operation in a loop. The loop count is doubled
+ * until one sample takes at least the target time, then a number of
+ * samples are taken and reported as nanoseconds per operation: mean,
+ * standard deviation, minimum, median and maximum. With -j every result
+ * is one JSON object per line so runs from different releases can be
+ * compared with any tool that reads JSON.
+ *
+ * Built by `make bench` with optimization and without sanitizers.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include "../src/lab.h"
+
+#define BENCH_MAX_SAMPLES 1000
+#define BENCH_LONG_LINE (64 * 1024)
+
+typedef void (*bench_fn)(void *ctx, uint64_t iters);
+
+struct bench {
+    const char *name;
+    bench_fn fn;
+    void *ctx;
+};
+
+struct bench_result {
+    uint64_t iters;
+    int samples;
+    double mean;
+    double stddev;
+    double min;
+    double median;
+    double max;
+};
+
+//results go somewhere the optimizer can't see through
+static volatile uintptr_t bench_sink;
+
+static void bench_parse(void *ctx, uint64_t iters) {
+    const char *line = ctx;
+    for (uint64_t i = 0; i < iters; i++) {
+        char **argv = cmd_parse(line);
+        bench_sink += (uintptr_t)argv;
+        cmd_free(argv);
+    }
+}
+
+//the way the shell parses a line: in place, from the per line arena
+static void bench_parse_arena(void *ctx, uint64_t iters) {
+    const char *line = ctx;
+    size_t len = strlen(line) + 1;
+    struct arena a;
+    arena_init(&a);
+    for (uint64_t i = 0; i < iters; i++) {
+        arena_reset(&a);
+        char *copy = arena_alloc(&a, len);
+        memcpy(copy, line, len);
+        char **argv = cmd_parse_arena(&a, copy);
+        bench_sink += (uintptr_t)argv;
+    }
+    arena_destroy(&a);
+}
+
+struct trim_ctx {
+    char *line;
+    size_t cut;
+};
+
+static void bench_trim(void *ctx, uint64_t iters) {
+    struct trim_ctx *t = ctx;
+    for (uint64_t i = 0; i < iters; i++) {
+        bench_sink += (uintptr_t)trim_white(t->line);
+        //put back the whitespace the NUL replaced
+        t->line[t->cut] = ' ';
+    }
+}
+
+static void bench_get_prompt(void *ctx, uint64_t iters) {
+    UNUSED(ctx)
+    for (uint64_t i = 0; i < iters; i++) {
+        char *prompt = get_prompt("MY_PROMPT");
+        bench_sink += (uintptr_t)prompt;
+        free(prompt);
+    }
+}
+
+static void bench_sh_prompt(void *ctx, uint64_t iters) {
+    struct shell *sh = ctx;
+    for (uint64_t i = 0; i < iters; i++) {
+        bench_sink += (uintptr_t)sh_prompt(sh);
+    }
+}
+
+//from the call that starts /bin/true to having reaped it
+static void bench_launch(void *ctx, uint64_t iters) {
+    struct shell *sh = ctx;
+    char *argv[] = {"/bin/true", NULL};
+    for (uint64_t i = 0; i < iters; i++) {
+        pid_t pid = launch_process(sh, argv, false);
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_run(const struct bench *b, int samples, uint64_t target_ns,
+                      struct bench_result *r) {
+    //warm up and find a loop count that makes one sample long enough
+    uint64_t iters = 1;
+    for (;;) {
+        uint64_t t0 = stat_now();
+        b->fn(b->ctx, iters);
+        uint64_t elapsed = stat_now() - t0;
+        if (elapsed >= target_ns || iters >= (UINT64_C(1) << 40)) break;
+        //jump most of the way when the estimate is good enough to trust
+        if (elapsed > target_ns / 16) {
+            iters = iters * target_ns / elapsed + 1;
+        } else {
+            iters *= 2;
+        }
+    }
+
+    double ns[BENCH_MAX_SAMPLES];
+    double sum = 0;
+    for (int i = 0; i < samples; i++) {
+        uint64_t t0 = stat_now();
+        b->fn(b->ctx, iters);
+        ns[i] = (double)(stat_now() - t0) / (double)iters;
+        sum += ns[i];
+    }
+    r->iters = iters;
+    r->samples = samples;
+    r->mean = sum / samples;
+    double sq = 0;
+    for (int i = 0; i < samples; i++) {
+        sq += (ns[i] - r->mean) * (ns[i] - r->mean);
+    }
+    r->stddev = samples > 1 ? sqrt(sq / (samples - 1)) : 0;
+    qsort(ns, samples, sizeof(double), double_cmp);
+    r->min = ns[0];
+    r->max = ns[samples - 1];
+    r->median = samples % 2 ? ns[samples / 2] : (ns[samples / 2 - 1] + ns[samples / 2]) / 2;
+}
+
+static void bench_print(const char *name, const struct bench_result *r, bool json) {
+    if (json) {
+        printf("{\"bench\":\"%s\",\"version\":\"%d.%d\",\"iters\":%llu,\"samples\":%d,"
+               "\"mean_ns\":%.2f,\"stddev_ns\":%.2f,\"min_ns\":%.2f,"
+               "\"median_ns\":%.2f,\"max_ns\":%.2f}\n",
+               name, lab_VERSION_MAJOR, lab_VERSION_MINOR, (unsigned long long)r->iters,
+               r->samples, r->mean, r->stddev, r->min, r->median, r->max);
+    } else {
+        printf("%-26s %12.1f %8.1f%% %12.1f %12.1f %12.1f\n", name, r->mean,
+               r->mean > 0 ? 100 * r->stddev / r->mean : 0, r->min, r->median, r->max);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "USAGE: %s [-j] [-n SAMPLES] [-t MS] [-f FILTER]\n"
+                    "  -j  print one JSON object per benchmark\n"
+                    "  -n  samples per benchmark (default 10)\n"
+                    "  -t  minimum milliseconds per sample (default 20)\n"
+                    "  -f  only run benchmarks whose name contains FILTER\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    bool json = false;
+    int samples = 10;
+    uint64_t target_ns = 20 * 1000000ull;
+    const char *filter = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "jn:t:f:h")) != -1) {
+        switch (c) {
+        case 'j': json = true; break;
+        case 'n': samples = atoi(optarg); break;
+        case 't': target_ns = strtoull(optarg, NULL, 10) * 1000000ull; break;
+        case 'f': filter = optarg; break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (samples < 1 || samples > BENCH_MAX_SAMPLES || target_ns == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    //one word repeated to fill a line, for the pathological cases
+    static char many_tokens[BENCH_LONG_LINE];
+    static char one_token[BENCH_LONG_LINE];
+    static char padded[BENCH_LONG_LINE];
+    static char blank[BENCH_LONG_LINE];
+    for (size_t i = 0; i < BENCH_LONG_LINE - 1; i++) {
+        many_tokens[i] = i % 2 ? ' ' : 'x';
+        one_token[i] = 'x';
+        //a long command with a page of whitespace on each side
+        padded[i] = i < 4096 || i >= BENCH_LONG_LINE - 4097 ? ' ' : 'x';
+        blank[i] = ' ';
+    }
+    struct trim_ctx trim_padded = { padded, BENCH_LONG_LINE - 4097 };
+    struct trim_ctx trim_blank = { blank, 0 };
+
+    //a shell that never owns a terminal, as in the tests
+    struct shell sh_prompt_shell = SHELL_INITIALIZER;
+    struct shell sh_fork = SHELL_INITIALIZER;
+    struct shell sh_spawn = SHELL_INITIALIZER;
+    set_launch_backend(&sh_fork, "fork");
+    set_launch_backend(&sh_spawn, "spawn");
+
+    const struct bench benches[] = {
+        {"parse/simple", bench_parse, "ls -la /tmp"},
+        {"parse/compile",
+         bench_parse,
+         "gcc -Wall -Wextra -O2 -g -MMD -MP -I include -DNDEBUG -c src/lab.c -o build/lab.o"},
+        {"parse/pipeline", bench_parse, "cat access.log | grep GET | sort | uniq -c > counts.txt"},
+        {"parse/many-tokens", bench_parse, many_tokens},
+        {"parse/one-token", bench_parse, one_token},
+        {"parse/blank", bench_parse, blank},
+        {"parse-arena/simple", bench_parse_arena, "ls -la /tmp"},
+        {"parse-arena/pipeline", bench_parse_arena,
+         "cat access.log | grep GET | sort | uniq -c > counts.txt"},
+        {"parse-arena/many-tokens", bench_parse_arena, many_tokens},
+        {"trim/padded-64k", bench_trim, &trim_padded},
+        {"trim/blank-64k", bench_trim, &trim_blank},
+        {"get_prompt/default", bench_get_prompt, NULL},
+        {"sh_prompt/cached", bench_sh_prompt, &sh_prompt_shell},
+        {"launch/fork", bench_launch, &sh_fork},
+        {"launch/spawn", bench_launch, &sh_spawn},
+    };
+
+    if (!json) {
+        printf("%-26s %12s %9s %12s %12s %12s\n", "benchmark (ns/op)", "mean", "stddev",
+               "min", "median", "max");
+    }
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (filter != NULL && strstr(benches[i].name, filter) == NULL) {
+            continue;
+        }
+        //the prompt benchmarks measure the default prompt
+        unsetenv("MY_PROMPT");
+        struct bench_result r;
+        bench_run(&benches[i], samples, target_ns, &r);
+        bench_print(benches[i].name, &r, json);
+    }
+
+    sh_destroy(&sh_prompt_shell);
+    sh_destroy(&sh_fork);
+    sh_destroy(&sh_spawn);
+    return 0;
+}
@@ -0,0 +1,528 @@
+/**
+ * @file pty-bench.c
+ * @brief End to end latency of the interactive shell on a pseudo-terminal
+ *
+ * The shell is started on a new pseudo-terminal the way a terminal emulator
+ * would start it, with a launcher process as the session leader in place
+ * of the user's login shell, so init_shell, tcsetpgrp and readline all run
+ * for real. A scripted session is then typed into it a number of times and
+ * two things are timed for every command:
+ *
+ * - key: from writing the first character of the command to the first byte
+ *   readline echoes back
+ * - enter: from writing Enter to the next prompt appearing, which covers
+ *   parsing, running the command, the terminal handoff back and the prompt
+ *
+ * The prompt is set to a marker that commands never print, and the rest of
+ * each line is typed and allowed to settle before Enter so the typing is not
+ * part of the enter time. History lives in memory only.
+ *
+ * Results are percentiles per command. With -o they are also written as
+ * JSON lines, and with -b such a file is read back as a baseline: a command
+ * whose median got slower by more than the threshold (and by more than a
+ * small absolute floor, so microsecond noise is ignored) is reported as a
+ * regression and the exit status is 1.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define PTY_MARKER "ptybench> "
+#define PTY_BUF_SIZE (1024 * 1024)
+#define PTY_MAX_COMMANDS 64
+#define PTY_QUIET_MS 10
+#define PTY_FLOOR_US 50.0
+
+enum pty_metric { METRIC_KEY, METRIC_ENTER, METRIC_COUNT };
+
+static const char *const metric_names[METRIC_COUNT] = { "key", "enter" };
+
+struct pty_session {
+    int master;
+    pid_t pid;
+    int timeout_ms;
+    size_t len;
+    char buf[PTY_BUF_SIZE];
+};
+
+struct pty_command {
+    char *text;
+    double *samples[METRIC_COUNT];
+    int nsamples;
+};
+
+struct pty_summary {
+    int n;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+//the builtins, external commands and job control an operator uses most
+static const char *const default_session[] = {
+    "true",
+    "echo hello",
+    "pwd",
+    "/bin/true",
+    "ls /",
+    "sleep 0.05 &",
+    "jobs",
+    "history",
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Start the shell on a new pseudo-terminal. The child becomes the
+ * session leader and runs the shell as its own child, since the shell
+ * wants to move into a process group of its own and a session leader can't.
+ */
+static int pty_start(struct pty_session *s, const char *shell) {
+    s->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (s->master < 0 || grantpt(s->master) != 0 || unlockpt(s->master) != 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+    const char *slave_name = ptsname(s->master);
+    struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+    ioctl(s->master, TIOCSWINSZ, &ws);
+
+    s->pid = fork();
+    if (s->pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (s->pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave < 0 || ioctl(slave, TIOCSCTTY, 0) != 0) {
+            _exit(127);
+        }
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        if (slave > STDERR_FILENO) close(slave);
+
+        setenv("MY_PROMPT", PTY_MARKER, 1);
+        setenv("MY_HISTFILE", "", 1);
+        setenv("TERM", "xterm", 1);
+        pid_t sh = fork();
+        if (sh == 0) {
+            execl(shell, shell, (char *)NULL);
+            perror(shell);
+            _exit(127);
+        }
+        //stay out of the shell's way and report how it ended
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        int status = 0;
+        while (sh > 0 && waitpid(sh, &status, 0) == -1 && errno == EINTR) {}
+        _exit(sh > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : 127);
+    }
+    s->len = 0;
+    return 0;
+}
+
+//read what is available, waiting at most timeout_ms; 0 on timeout
+static int pty_read(struct pty_session *s, int timeout_ms) {
+    struct pollfd pfd = { .fd = s->master, .events = POLLIN };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (s->len == sizeof(s->buf)) {
+        //only the tail can hold the start of a marker
+        size_t keep = sizeof(PTY_MARKER);
+        memmove(s->buf, s->buf + s->len - keep, keep);
+        s->len = keep;
+    }
+    ssize_t n = read(s->master, s->buf + s->len, sizeof(s->buf) - s->len);
+    if (n <= 0) {
+        return -1;
+    }
+    s->len += n;
+    return 1;
+}
+
+static int pty_wait_marker(struct pty_session *s) {
+    uint64_t deadline = now_ns() + (uint64_t)s->timeout_ms * 1000000u;
+    while (memmem(s->buf, s->len, PTY_MARKER, strlen(PTY_MARKER)) == NULL) {
+        int left = (int)((int64_t)(deadline - now_ns()) / 1000000);
+        if (left <= 0 || pty_read(s, left) <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int pty_wait_output(struct pty_session *s) {
+    size_t before = s->len;
+    while (s->len == before) {
+        if (pty_read(s, s->timeout_ms) <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//read until the terminal has been quiet for quiet_ms
+static void pty_settle(struct pty_session *s, int quiet_ms) {
+    while (pty_read(s, quiet_ms) > 0) {}
+}
+
+static int pty_write(struct pty_session *s, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(s->master, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pty_stop(struct pty_session *s) {
+    pty_write(s, "exit\r", 5);
+    int status = -1;
+    uint64_t deadline = now_ns() + (uint64_t)s->timeout_ms * 1000000u;
+    while (now_ns() < deadline) {
+        if (waitpid(s->pid, &status, WNOHANG) == s->pid) {
+            close(s->master);
+            return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        }
+        //once the terminal is hung up poll returns at once, so sleep instead
+        if (pty_read(s, 10) < 0) {
+            usleep(1000);
+        }
+    }
+    kill(s->pid, SIGKILL);
+    waitpid(s->pid, &status, 0);
+    close(s->master);
+    return -1;
+}
+
+//type one command and time it, samples in microseconds
+static int pty_run_command(struct pty_session *s, const char *cmd, double *key, double *enter) {
+    s->len = 0;
+    uint64_t t0 = now_ns();
+    if (pty_write(s, cmd, 1) != 0 || pty_wait_output(s) != 0) {
+        return -1;
+    }
+    *key = (now_ns() - t0) / 1e3;
+
+    if (pty_write(s, cmd + 1, strlen(cmd + 1)) != 0) {
+        return -1;
+    }
+    pty_settle(s, PTY_QUIET_MS);
+
+    s->len = 0;
+    t0 = now_ns();
+    if (pty_write(s, "\r", 1) != 0 || pty_wait_marker(s) != 0) {
+        return -1;
+    }
+    *enter = (now_ns() - t0) / 1e3;
+    //let anything printed after the prompt (job reports, redisplay) pass
+    pty_settle(s, PTY_QUIET_MS);
+    return 0;
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//nearest rank percentiles of samples, which are sorted in place
+static void summarize(double *samples, int n, struct pty_summary *out) {
+    memset(out, 0, sizeof(*out));
+    out->n = n;
+    if (n == 0) {
+        return;
+    }
+    qsort(samples, n, sizeof(double), double_cmp);
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += samples[i];
+    out->mean = sum / n;
+    int rank50 = (n * 50 + 99) / 100, rank90 = (n * 90 + 99) / 100, rank99 = (n * 99 + 99) / 100;
+    out->p50 = samples[rank50 > 0 ? rank50 - 1 : 0];
+    out->p90 = samples[rank90 > 0 ? rank90 - 1 : 0];
+    out->p99 = samples[rank99 > 0 ? rank99 - 1 : 0];
+    out->max = samples[n - 1];
+}
+
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void json_line(FILE *f, const char *cmd, const char *metric, const struct pty_summary *r) {
+    fputs("{\"cmd\":", f);
+    json_string(f, cmd);
+    fprintf(f, ",\"metric\":\"%s\",\"n\":%d,\"mean_us\":%.1f,\"p50_us\":%.1f,"
+               "\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            metric, r->n, r->mean, r->p50, r->p90, r->p99, r->max);
+}
+
+//the string value of key in a JSON line written by json_line
+static bool json_get_string(const char *line, const char *key, char *out, size_t size) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":\"", key);
+    const char *p = strstr(line, pat);
+    if (p == NULL) {
+        return false;
+    }
+    p += strlen(pat);
+    size_t n = 0;
+    for (; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1]) p++;
+        if (n + 1 < size) out[n++] = *p;
+    }
+    out[n] = '\0';
+    return *p == '"';
+}
+
+static bool json_get_number(const char *line, const char *key, double *out) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = strstr(line, pat);
+    return p != NULL && sscanf(p + strlen(pat), "%lf", out) == 1;
+}
+
+/**
+ * @brief Compare the medians with a baseline file written by -o, printing
+ * a line to report for every command and metric found in both.
+ *
+ * @return int The number of regressions, -1 if the file can't be read
+ */
+static int compare_baseline(FILE *report, const char *path, struct pty_command *cmds, int ncmds,
+                            struct pty_summary (*sum)[METRIC_COUNT], double threshold) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(report, "\n%-16s %-6s %12s %12s %9s\n", "vs baseline", "metric", "base p50", "p50", "change");
+    int regressions = 0;
+    char line[4096], cmd[2048], metric[16];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        double base;
+        if (!json_get_string(line, "cmd", cmd, sizeof(cmd)) ||
+            !json_get_string(line, "metric", metric, sizeof(metric)) ||
+            !json_get_number(line, "p50_us", &base)) {
+            continue;
+        }
+        for (int i = 0; i < ncmds; i++) {
+            for (int m = 0; m < METRIC_COUNT; m++) {
+                if (strcmp(cmds[i].text, cmd) != 0 || strcmp(metric_names[m], metric) != 0) {
+                    continue;
+                }
+                double now = sum[i][m].p50;
+                double change = base > 0 ? (now - base) / base : 0;
+                bool slower = change > threshold && now - base > PTY_FLOOR_US;
+                fprintf(report, "%-16.16s %-6s %10.1fus %10.1fus %+8.1f%%%s\n", cmd, metric, base, now,
+                       100 * change, slower ? "  REGRESSION" : "");
+                regressions += slower;
+            }
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+static int load_session(const char *path, struct pty_command *cmds) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    int n = 0;
+    char line[4096];
+    while (n < PTY_MAX_COMMANDS && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        cmds[n++].text = strdup(line);
+    }
+    fclose(f);
+    return n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "USAGE: %s [-p SHELL] [-s SESSION] [-n ROUNDS] [-w WARMUP] [-j]\n"
+                    "          [-o OUT] [-b BASELINE] [-r PERCENT] [-t MS]\n"
+                    "  -p  shell to run (default ./myprogram)\n"
+                    "  -s  file with one command per line (default: built in session)\n"
+                    "  -n  timed rounds of the session (default 50)\n"
+                    "  -w  untimed rounds first (default 3)\n"
+                    "  -j  print JSON lines instead of a table\n"
+                    "  -o  also write the results as JSON lines to OUT\n"
+                    "  -b  compare medians with a file written by -o\n"
+                    "  -r  slowdown that counts as a regression (default 25)\n"
+                    "  -t  give up waiting for the shell after MS (default 5000)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *shell = "./myprogram";
+    const char *session = NULL;
+    const char *out_path = NULL;
+    const char *baseline = NULL;
+    int rounds = 50, warmup = 3, timeout_ms = 5000;
+    double threshold = 0.25;
+    bool json = false;
+    int c;
+    while ((c = getopt(argc, argv, "p:s:n:w:jo:b:r:t:h")) != -1) {
+        switch (c) {
+        case 'p': shell = optarg; break;
+        case 's': session = optarg; break;
+        case 'n': rounds = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'j': json = true; break;
+        case 'o': out_path = optarg; break;
+        case 'b': baseline = optarg; break;
+        case 'r': threshold = atof(optarg) / 100; break;
+        case 't': timeout_ms = atoi(optarg); break;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    if (rounds < 1 || warmup < 0 || timeout_ms < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    static struct pty_command cmds[PTY_MAX_COMMANDS];
+    int ncmds = 0;
+    if (session != NULL) {
+        ncmds = load_session(session, cmds);
+        if (ncmds <= 0) {
+            fprintf(stderr, "%s: no commands\n", session);
+            return 2;
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(default_session) / sizeof(default_session[0]); i++) {
+            cmds[ncmds++].text = strdup(default_session[i]);
+        }
+    }
+    for (int i = 0; i < ncmds; i++) {
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            cmds[i].samples[m] = calloc(rounds, sizeof(double));
+            if (cmds[i].samples[m] == NULL) {
+                perror("calloc");
+                return 2;
+            }
+        }
+    }
+
+    static struct pty_session s;
+    s.timeout_ms = timeout_ms;
+    signal(SIGPIPE, SIG_IGN);
+    if (pty_start(&s, shell) != 0) {
+        return 2;
+    }
+    if (pty_wait_marker(&s) != 0) {
+        fprintf(stderr, "%s: no prompt within %dms\n", shell, timeout_ms);
+        pty_stop(&s);
+        return 2;
+    }
+    pty_settle(&s, PTY_QUIET_MS);
+
+    for (int round = 0; round < warmup + rounds; round++) {
+        for (int i = 0; i < ncmds; i++) {
+            double key, enter;
+            if (pty_run_command(&s, cmds[i].text, &key, &enter) != 0) {
+                fprintf(stderr, "%s: timed out running '%s'\n", shell, cmds[i].text);
+                pty_stop(&s);
+                return 2;
+            }
+            if (round >= warmup) {
+                cmds[i].samples[METRIC_KEY][cmds[i].nsamples] = key;
+                cmds[i].samples[METRIC_ENTER][cmds[i].nsamples] = enter;
+                cmds[i].nsamples++;
+            }
+        }
+    }
+    int shell_status = pty_stop(&s);
+
+    struct pty_summary (*sum)[METRIC_COUNT] = calloc(ncmds, sizeof(*sum));
+    FILE *out = out_path != NULL ? fopen(out_path, "w") : NULL;
+    if (sum == NULL || (out_path != NULL && out == NULL)) {
+        perror(out_path != NULL ? out_path : "calloc");
+        return 2;
+    }
+    if (!json) {
+        printf("%-16s %-6s %6s %10s %10s %10s %10s %10s\n", "command", "metric", "n",
+               "mean", "p50", "p90", "p99", "max");
+    }
+    for (int i = 0; i < ncmds; i++) {
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            summarize(cmds[i].samples[m], cmds[i].nsamples, &sum[i][m]);
+            const struct pty_summary *r = &sum[i][m];
+            if (json) {
+                json_line(stdout, cmds[i].text, metric_names[m], r);
+            } else {
+                printf("%-16.16s %-6s %6d %8.1fus %8.1fus %8.1fus %8.1fus %8.1fus\n",
+                       cmds[i].text, metric_names[m], r->n, r->mean, r->p50, r->p90,
+                       r->p99, r->max);
+            }
+            if (out != NULL) {
+                json_line(out, cmds[i].text, metric_names[m], r);
+            }
+        }
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    if (shell_status != 0) {
+        fprintf(stderr, "%s: exited with status %d\n", shell, shell_status);
+    }
+
+    int regressions = 0;
+    if (baseline != NULL) {
+        //the JSON on stdout stays machine readable
+        FILE *report = json ? stderr : stdout;
+        regressions = compare_baseline(report, baseline, cmds, ncmds, sum, threshold);
+        if (regressions < 0) {
+            return 2;
+        }
+        if (regressions > 0) {
+            fprintf(report, "%d regression%s over %.0f%%\n", regressions, regressions == 1 ? "" : "s",
+                   threshold * 100);
+        }
+    }
+
+    for (int i = 0; i < ncmds; i++) {
+        free(cmds[i].text);
+        for (int m = 0; m < METRIC_COUNT; m++) free(cmds[i].samples[m]);
+    }
+    free(sum);
+    return regressions > 0 ? 1 : 0;
+}
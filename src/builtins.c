@@ -0,0 +1,1087 @@
+/**
+ * @file builtins.c
+ * @brief Builtin commands and their dispatch table
+ *
+ * Every builtin is a function taking the shell and its argv and returning
+ * an exit status. They live in one table, and a name is resolved with a
+ * switch on its length and first character that the compiler turns into a
+ * jump table, followed by a single string compare. The cost of a lookup
+ * stays the same however many builtins the table holds.
+ *
+ * Assignments such as MY_PROMPT=value are keyed on the text up to and
+ * including the '=', so they go through the same table.
+ *
+ * Small utilities that scripts call in loops (echo, printf, test, true,
+ * false, pwd and kill) are builtins too, so they cost no fork and exec.
+ * Each one collects its output in an outbuf and writes it once at the end.
+ * Redirections are applied to the shell's own descriptors for the length
+ * of the builtin. A builtin in a pipeline or in the background runs in a
+ * forked copy of the shell like any other stage.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define PROMPT_OK 0
+
+//the case label for a name of len bytes that starts with c
+#define BUILTIN_KEY(len, c) ((len) << 8 | (unsigned char)(c))
+
+static int builtin_cd(struct shell *sh, char **argv) {
+    int rc = 0;
+    if (change_dir(argv[1] ? &argv[1] : NULL) != 0) {
+        fprintf(stderr, "Failed to change directory\n");
+        rc = 1;
+    }
+    // The prompt may show the directory
+    sh_prompt_invalidate(sh);
+    return rc;
+}
+
+static int builtin_exit(struct shell *sh, char **argv) {
+    sh->exit_requested = true;
+    return argv[1] != NULL ? atoi(argv[1]) : sh->last_status;
+}
+
+static int builtin_history(struct shell *sh, char **argv) {
+    // Batch mode only opens the history file when it is asked for
+    if (sh->batch) {
+        history_open(NULL, 0);
+    }
+    if (argv[1] != NULL && strcmp(argv[1], "-s") == 0) {
+        // The pattern is the rest of the line, spaces included
+        size_t plen = 0;
+        for (int i = 2; argv[i] != NULL; i++) plen += strlen(argv[i]) + 1;
+        char *pattern = argv[2] != NULL ? arena_alloc(&sh->arena, plen) : NULL;
+        if (pattern == NULL) {
+            fprintf(stderr, "USAGE: history -s PATTERN\n");
+            return 2;
+        }
+        pattern[0] = '\0';
+        for (int i = 2; argv[i] != NULL; i++) {
+            if (i > 2) strcat(pattern, " ");
+            strcat(pattern, argv[i]);
+        }
+        if (history_find(pattern) != 0) {
+            fprintf(stderr, "history: no history file to search\n");
+            return 1;
+        }
+        return 0;
+    }
+    int limit = 0;
+    if (argv[1] != NULL) {
+        limit = atoi(argv[1]);
+    }
+    if (print_history(limit) != 0) {
+        fprintf(stderr, "Failed to print history\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_my_prompt(struct shell *sh, char **argv) {
+    char *new_prompt = argv[0] + strlen("MY_PROMPT=");
+    // Error message is already printed in set_prompt
+    if (set_prompt(new_prompt) != PROMPT_OK) {
+        return 1;
+    }
+    sh_prompt_invalidate(sh);
+    printf("Prompt updated successfully.\n");
+    return 0;
+}
+
+static int builtin_jobs(struct shell *sh, char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-l") == 0) {
+        print_jobs_long(sh);
+    } else if (argv[1] != NULL) {
+        fprintf(stderr, "USAGE: jobs [-l]\n");
+        return 2;
+    } else {
+        print_jobs(sh);
+    }
+    return 0;
+}
+
+static int builtin_stats(struct shell *sh, char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0) {
+        stat_reset(sh);
+    } else if (argv[1] != NULL) {
+        fprintf(stderr, "USAGE: stats [-r]\n");
+        return 2;
+    } else {
+        print_stats(sh);
+    }
+    return 0;
+}
+
+static int builtin_hash(struct shell *sh, char **argv) {
+    if (argv[1] == NULL) {
+        cmd_hash_print(sh);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        cmd_hash_clear(sh);
+        return 0;
+    }
+    if (strcmp(argv[1], "-p") == 0) {
+        if (argv[2] == NULL || argv[3] == NULL) {
+            fprintf(stderr, "USAGE: hash -p path name\n");
+            return 2;
+        }
+        return cmd_hash_pin(sh, argv[3], argv[2]) == 0 ? 0 : 1;
+    }
+    int rc = 0;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (cmd_hash_lookup(sh, argv[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+static int builtin_set(struct shell *sh, char **argv) {
+    if (argv[1] == NULL || argv[2] == NULL) {
+        print_shell_options(sh);
+        return 0;
+    }
+    if ((strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0) ||
+        set_shell_option(sh, argv[2], argv[1][0] == '-') != 0) {
+        fprintf(stderr, "USAGE: set [-o|+o] pipefail|pipesize=BYTES\n");
+        return 2;
+    }
+    return 0;
+}
+
+static int builtin_launch(struct shell *sh, char **argv) {
+    if (argv[1] == NULL) {
+        printf("%s\n", get_launch_backend(sh));
+        return 0;
+    }
+    if (set_launch_backend(sh, argv[1]) != 0) {
+        fprintf(stderr, "USAGE: launch [spawn|fork]\n");
+        return 2;
+    }
+    return 0;
+}
+
+static int builtin_true(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    UNUSED(argv)
+    return 0;
+}
+
+static int builtin_false(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    UNUSED(argv)
+    return 1;
+}
+
+//expand the escape that follows a backslash, returning how many bytes of s
+//it used. Octal is \0NNN for echo and %b, \NNN in a printf format.
+static size_t escape_char(const char *s, bool zero_octal, char *c, bool *stop) {
+    static const char plain[] = "a\ab\be\033f\fn\nr\rt\tv\v\\\\\"\"";
+    const char *p = s;
+    if (*p == 'c') {
+        *stop = true;
+        return 1;
+    }
+    for (size_t i = 0; *p != '\0' && plain[i] != '\0'; i += 2) {
+        if (plain[i] == *p) {
+            *c = plain[i + 1];
+            return 1;
+        }
+    }
+    if (*p == 'x' && isxdigit((unsigned char)p[1])) {
+        int v = 0;
+        for (p++; p - s <= 2 && isxdigit((unsigned char)*p); p++) {
+            v = v * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+        }
+        *c = (char)v;
+        return p - s;
+    }
+    if (zero_octal ? *p == '0' : (*p >= '0' && *p <= '7')) {
+        if (zero_octal) p++;
+        const char *start = p;
+        int v = 0;
+        for (; p - start < 3 && *p >= '0' && *p <= '7'; p++) {
+            v = v * 8 + (*p - '0');
+        }
+        *c = (char)v;
+        return p - s;
+    }
+    //not an escape, the backslash stands for itself
+    *c = '\\';
+    return 0;
+}
+
+//expand every escape in s into out, which needs strlen(s) + 1 bytes since
+//escapes only ever shrink. Returns the length, *stop is set by \c.
+static size_t unescape(const char *s, char *out, bool zero_octal, bool *stop) {
+    size_t n = 0;
+    while (*s != '\0') {
+        if (*s != '\\') {
+            out[n++] = *s++;
+            continue;
+        }
+        char c;
+        size_t used = escape_char(s + 1, zero_octal, &c, stop);
+        if (*stop) break;
+        out[n++] = c;
+        s += 1 + used;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static int builtin_echo(struct shell *sh, char **argv) {
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+    //a word is only options when every letter in it is one
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char *p = argv[i] + 1; *p; p++) {
+            if (*p == 'n') {
+                newline = false;
+            } else {
+                escapes = *p == 'e';
+            }
+        }
+    }
+
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    bool stop = false;
+    for (int first = i; argv[i] != NULL && !stop; i++) {
+        if (i > first) outbuf_write(&ob, " ", 1);
+        if (!escapes) {
+            outbuf_write(&ob, argv[i], strlen(argv[i]));
+            continue;
+        }
+        char *text = arena_alloc(&sh->arena, strlen(argv[i]) + 1);
+        if (text == NULL) {
+            return 1;
+        }
+        outbuf_write(&ob, text, unescape(argv[i], text, true, &stop));
+    }
+    if (newline && !stop) {
+        outbuf_write(&ob, "\n", 1);
+    }
+    return outbuf_flush(&ob) == 0 ? 0 : 1;
+}
+
+//a printf number: C constants in any base, or 'c for the code of c
+static bool printf_number(const char *arg, bool is_signed, intmax_t *v, int *rc) {
+    if (arg == NULL) {
+        *v = 0;
+        return true;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *v = (unsigned char)arg[1];
+        return true;
+    }
+    char *end;
+    errno = 0;
+    *v = is_signed ? strtoimax(arg, &end, 0) : (intmax_t)strtoumax(arg, &end, 0);
+    if (end == arg || *end != '\0') {
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+        *rc = 1;
+    } else if (errno == ERANGE) {
+        fprintf(stderr, "printf: '%s': %s\n", arg, strerror(errno));
+        *rc = 1;
+    }
+    return true;
+}
+
+static long double printf_float(const char *arg, int *rc) {
+    if (arg == NULL) {
+        return 0;
+    }
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    long double v = strtold(arg, &end);
+    if (end == arg || *end != '\0') {
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+        *rc = 1;
+    }
+    return v;
+}
+
+//run the format once, taking arguments from *args. Returns false when \c
+//or an error means nothing more may be printed.
+static bool printf_once(struct shell *sh, struct outbuf *ob, const char *fmt,
+                        char ***args, int *rc) {
+    const char *p = fmt;
+    while (*p != '\0') {
+        if (*p == '\\') {
+            char c;
+            bool stop = false;
+            size_t used = escape_char(p + 1, false, &c, &stop);
+            if (stop) return false;
+            outbuf_write(ob, &c, 1);
+            p += 1 + used;
+            continue;
+        }
+        if (*p != '%') {
+            size_t n = strcspn(p, "\\%");
+            outbuf_write(ob, p, n);
+            p += n;
+            continue;
+        }
+        if (p[1] == '%') {
+            outbuf_write(ob, "%", 1);
+            p += 2;
+            continue;
+        }
+
+        //rebuild the directive with the widths filled in and our own length
+        char spec[64];
+        size_t n = 0;
+        const char *start = p++;
+        spec[n++] = '%';
+        while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+            if (n < 8) spec[n++] = *p;
+            p++;
+        }
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*p != '.') break;
+                spec[n++] = *p++;
+            }
+            if (*p == '*') {
+                intmax_t v;
+                printf_number(**args, true, &v, rc);
+                if (**args != NULL) (*args)++;
+                n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)v);
+                p++;
+            } else {
+                while (isdigit((unsigned char)*p)) {
+                    if (n < 40) spec[n++] = *p;
+                    p++;
+                }
+            }
+        }
+        while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) p++;
+
+        char conv = *p;
+        const char *arg = **args;
+        if (conv != '\0' && strchr("diouxXcsbeEfFgGaA", conv) != NULL && arg != NULL) {
+            (*args)++;
+        }
+        switch (conv) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X': {
+            intmax_t v;
+            printf_number(arg, conv == 'd' || conv == 'i', &v, rc);
+            spec[n++] = 'j';
+            spec[n++] = conv;
+            spec[n] = '\0';
+            outbuf_printf(ob, spec, v);
+            break;
+        }
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec[n++] = 'L';
+            spec[n++] = conv;
+            spec[n] = '\0';
+            outbuf_printf(ob, spec, printf_float(arg, rc));
+            break;
+        case 'c':
+            spec[n++] = 'c';
+            spec[n] = '\0';
+            outbuf_printf(ob, spec, arg != NULL ? arg[0] : '\0');
+            break;
+        case 's':
+            spec[n++] = 's';
+            spec[n] = '\0';
+            outbuf_printf(ob, spec, arg != NULL ? arg : "");
+            break;
+        case 'b': {
+            bool stop = false;
+            char *text = arena_alloc(&sh->arena, arg != NULL ? strlen(arg) + 1 : 1);
+            if (text == NULL) return false;
+            unescape(arg != NULL ? arg : "", text, true, &stop);
+            spec[n++] = 's';
+            spec[n] = '\0';
+            outbuf_printf(ob, spec, text);
+            if (stop) return false;
+            break;
+        }
+        default:
+            fprintf(stderr, "printf: %.*s: invalid conversion specification\n",
+                    (int)(p - start + (conv != '\0')), start);
+            *rc = 1;
+            return false;
+        }
+        p++;
+    }
+    return true;
+}
+
+static int builtin_printf(struct shell *sh, char **argv) {
+    int i = 1;
+    if (argv[i] != NULL && strcmp(argv[i], "--") == 0) i++;
+    if (argv[i] == NULL) {
+        fprintf(stderr, "USAGE: printf FORMAT [ARGUMENT]...\n");
+        return 2;
+    }
+    const char *fmt = argv[i];
+    char **args = &argv[i + 1];
+
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    int rc = 0;
+    //the format is used again until every argument has been taken
+    for (;;) {
+        char **before = args;
+        if (!printf_once(sh, &ob, fmt, &args, &rc) || *args == NULL || args == before) {
+            break;
+        }
+    }
+    if (outbuf_flush(&ob) != 0) {
+        rc = 1;
+    }
+    return rc;
+}
+
+//test(1) evaluation state, args[pos..end) are still to be read
+struct test_state {
+    char **args;
+    int pos;
+    int end;
+    bool error;
+};
+
+static bool test_integer(struct test_state *t, const char *s, intmax_t *v) {
+    char *end;
+    errno = 0;
+    *v = strtoimax(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == s || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        t->error = true;
+        return false;
+    }
+    return true;
+}
+
+static bool test_is_unary(const char *op) {
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' &&
+           strchr("bcdefghkLnprsStuwxzOG", op[1]) != NULL;
+}
+
+static bool test_is_binary(const char *op) {
+    static const char *const ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL
+    };
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+static bool test_unary(struct test_state *t, const char *op, const char *arg) {
+    struct stat st;
+    intmax_t fd;
+    switch (op[1]) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    case 't':
+        return test_integer(t, arg, &fd) && fd >= 0 && fd <= INT_MAX && isatty((int)fd);
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op[1]) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 's': return st.st_size > 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    default: return true;
+    }
+}
+
+static bool test_binary(struct test_state *t, const char *a, const char *op, const char *b) {
+    if (op[0] != '-') {
+        int cmp = strcmp(a, b);
+        if (op[0] == '!') return cmp != 0;
+        if (op[0] == '<') return cmp < 0;
+        if (op[0] == '>') return cmp > 0;
+        return cmp == 0;
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        //-nt, -ot and -ef compare the files themselves
+        struct stat sa, sb;
+        bool ha = stat(a, &sa) == 0;
+        bool hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') {
+            return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        }
+        if (!ha || !hb) {
+            return op[1] == 'n' ? ha : hb;
+        }
+        struct timespec ta = op[1] == 'n' ? sa.st_mtim : sb.st_mtim;
+        struct timespec tb = op[1] == 'n' ? sb.st_mtim : sa.st_mtim;
+        return ta.tv_sec > tb.tv_sec || (ta.tv_sec == tb.tv_sec && ta.tv_nsec > tb.tv_nsec);
+    }
+
+    intmax_t x, y;
+    if (!test_integer(t, a, &x) || !test_integer(t, b, &y)) {
+        return false;
+    }
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static bool test_or(struct test_state *t);
+
+static const char *test_next(struct test_state *t) {
+    if (t->pos >= t->end) {
+        fprintf(stderr, "test: argument expected\n");
+        t->error = true;
+        return "";
+    }
+    return t->args[t->pos++];
+}
+
+static bool test_primary(struct test_state *t) {
+    int left = t->end - t->pos;
+    const char *a = test_next(t);
+    if (t->error) return false;
+    if (strcmp(a, "(") == 0 && left > 1) {
+        bool v = test_or(t);
+        if (t->pos >= t->end || strcmp(t->args[t->pos], ")") != 0) {
+            fprintf(stderr, "test: ')' expected\n");
+            t->error = true;
+            return false;
+        }
+        t->pos++;
+        return v;
+    }
+    //a binary operator after the word wins over reading the word as unary
+    if (left >= 3 && test_is_binary(t->args[t->pos])) {
+        const char *op = test_next(t);
+        return test_binary(t, a, op, test_next(t));
+    }
+    if (left >= 2 && test_is_unary(a)) {
+        return test_unary(t, a, test_next(t));
+    }
+    return a[0] != '\0';
+}
+
+static bool test_not(struct test_state *t) {
+    if (t->pos < t->end - 1 && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static bool test_and(struct test_state *t) {
+    bool v = test_not(t);
+    while (!t->error && t->pos < t->end && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        //both sides are always parsed so errors are found either way
+        bool rhs = test_not(t);
+        v = v && rhs;
+    }
+    return v;
+}
+
+static bool test_or(struct test_state *t) {
+    bool v = test_and(t);
+    while (!t->error && t->pos < t->end && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        bool rhs = test_and(t);
+        v = v || rhs;
+    }
+    return v;
+}
+
+//evaluate n arguments, 0 for true, 1 for false and 2 for an error
+static int test_eval(char **args, int n) {
+    struct test_state t = { .args = args, .pos = 0, .end = n, .error = false };
+    bool v;
+    //POSIX fixes the meaning of up to four arguments by their count alone
+    if (n == 0) {
+        return 1;
+    } else if (n == 1) {
+        v = args[0][0] != '\0';
+    } else if (n == 2 && strcmp(args[0], "!") == 0) {
+        v = args[1][0] == '\0';
+    } else if (n == 3 && test_is_binary(args[1])) {
+        v = test_binary(&t, args[0], args[1], args[2]);
+    } else if (n == 3 && strcmp(args[0], "!") == 0) {
+        int r = test_eval(args + 1, 2);
+        return r == 2 ? 2 : !r;
+    } else if (n == 3 && strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0) {
+        v = args[1][0] != '\0';
+    } else if (n == 4 && strcmp(args[0], "!") == 0) {
+        int r = test_eval(args + 1, 3);
+        return r == 2 ? 2 : !r;
+    } else if (n == 4 && strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0) {
+        return test_eval(args + 1, 2);
+    } else {
+        v = test_or(&t);
+        if (!t.error && t.pos < t.end) {
+            fprintf(stderr, "test: %s: unexpected argument\n", args[t.pos]);
+            t.error = true;
+        }
+    }
+    return t.error ? 2 : !v;
+}
+
+static int builtin_test(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    int n = 0;
+    while (argv[n + 1] != NULL) n++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (n == 0 || strcmp(argv[n], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        n--;
+    }
+    return test_eval(argv + 1, n);
+}
+
+//true when a path has no . or .. component
+static bool path_is_canonical(const char *path) {
+    for (const char *p = path; (p = strchr(p, '/')) != NULL; p++) {
+        size_t dots = strspn(p + 1, ".");
+        if ((dots == 1 || dots == 2) && (p[1 + dots] == '/' || p[1 + dots] == '\0')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int builtin_pwd(struct shell *sh, char **argv) {
+    UNUSED(sh)
+    bool physical = false;
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-P") == 0) {
+            physical = true;
+        } else if (strcmp(argv[i], "-L") == 0) {
+            physical = false;
+        } else {
+            fprintf(stderr, "USAGE: pwd [-L|-P]\n");
+            return 2;
+        }
+    }
+
+    const char *dir = NULL;
+    if (!physical) {
+        //$PWD keeps the links the user went through, as long as it is still here
+        const char *pwd = getenv("PWD");
+        struct stat a, b;
+        if (pwd != NULL && pwd[0] == '/' && path_is_canonical(pwd) &&
+            stat(pwd, &a) == 0 && stat(".", &b) == 0 &&
+            a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+            dir = pwd;
+        }
+    }
+    char cwd[PATH_MAX];
+    if (dir == NULL) {
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            perror("pwd");
+            return 1;
+        }
+        dir = cwd;
+    }
+
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    outbuf_printf(&ob, "%s\n", dir);
+    return outbuf_flush(&ob) == 0 ? 0 : 1;
+}
+
+//a signal by number or by name, with or without the SIG prefix
+static int signal_number(const char *name) {
+    char *end;
+    long n = strtol(name, &end, 10);
+    if (end != name && *end == '\0') {
+        return n >= 0 && n < NSIG ? (int)n : -1;
+    }
+    if (strncasecmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (int sig = 1; sig < NSIG; sig++) {
+        const char *abbrev = sigabbrev_np(sig);
+        if (abbrev != NULL && strcasecmp(abbrev, name) == 0) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+static int kill_list(char **argv) {
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    int rc = 0;
+    if (argv[0] == NULL) {
+        //eight names a row, separated but not followed by a space
+        int col = 0;
+        for (int sig = 1; sig < NSIG; sig++) {
+            const char *abbrev = sigabbrev_np(sig);
+            if (abbrev == NULL) continue;
+            outbuf_printf(&ob, "%s%s", col > 0 ? " " : "", abbrev);
+            if (++col == 8) {
+                outbuf_write(&ob, "\n", 1);
+                col = 0;
+            }
+        }
+        if (col > 0) {
+            outbuf_write(&ob, "\n", 1);
+        }
+    }
+    for (int i = 0; argv[i] != NULL; i++) {
+        //an exit status of a killed command names the signal that killed it
+        char *end;
+        long n = strtol(argv[i], &end, 10);
+        int sig = signal_number(argv[i]);
+        const char *abbrev = end != argv[i] && *end == '\0' ? sigabbrev_np(n > 128 ? n - 128 : n)
+                                                             : NULL;
+        if (abbrev != NULL) {
+            outbuf_printf(&ob, "%s\n", abbrev);
+        } else if (end == argv[i] && sig > 0) {
+            outbuf_printf(&ob, "%d\n", sig);
+        } else {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", argv[i]);
+            rc = 1;
+        }
+    }
+    if (outbuf_flush(&ob) != 0) {
+        rc = 1;
+    }
+    return rc;
+}
+
+static int builtin_kill(struct shell *sh, char **argv) {
+    int sig = SIGTERM;
+    int i = 1;
+    if (argv[i] != NULL && strcmp(argv[i], "-l") == 0) {
+        return kill_list(&argv[i + 1]);
+    }
+    if (argv[i] != NULL && (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-n") == 0)) {
+        if (argv[i + 1] == NULL || (sig = signal_number(argv[i + 1])) < 0) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n",
+                    argv[i + 1] ? argv[i + 1] : "");
+            return 2;
+        }
+        i += 2;
+    } else if (argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0' &&
+               strcmp(argv[i], "--") != 0) {
+        if ((sig = signal_number(argv[i] + 1)) < 0) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", argv[i] + 1);
+            return 2;
+        }
+        i++;
+    }
+    if (argv[i] != NULL && strcmp(argv[i], "--") == 0) i++;
+    if (argv[i] == NULL) {
+        fprintf(stderr, "USAGE: kill [-s SIGNAL | -SIGNAL] pid | %%job ...\n");
+        return 2;
+    }
+
+    int rc = 0;
+    for (; argv[i] != NULL; i++) {
+        char *end;
+        pid_t pid;
+        if (argv[i][0] == '%') {
+            //a job is signalled as a whole process group
+            long id = strtol(argv[i] + 1, &end, 10);
+            struct bg_job *job = end != argv[i] + 1 && *end == '\0' ? find_job_by_id(sh, (int)id)
+                                                                     : NULL;
+            if (job == NULL) {
+                fprintf(stderr, "kill: %s: no such job\n", argv[i]);
+                rc = 1;
+                continue;
+            }
+            pid = -job->pid;
+        } else {
+            long n = strtol(argv[i], &end, 10);
+            if (end == argv[i] || *end != '\0') {
+                fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", argv[i]);
+                rc = 1;
+                continue;
+            }
+            pid = (pid_t)n;
+        }
+        if (kill(pid, sig) != 0) {
+            fprintf(stderr, "kill: (%s) - %s\n", argv[i], strerror(errno));
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+//one line of the report in the form bash's time uses, 0m1.003s
+static void time_line(struct outbuf *ob, const char *label, double seconds) {
+    long minutes = (long)(seconds / 60);
+    outbuf_printf(ob, "%s\t%ldm%.3fs\n", label, minutes, seconds - minutes * 60.0);
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return (double)tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+//add what a builtin used between two getrusage samples
+static void time_add_delta(struct job_acct *acct, const struct rusage *before,
+                           const struct rusage *after) {
+    struct timeval d;
+    timersub(&after->ru_utime, &before->ru_utime, &d);
+    timeradd(&acct->utime, &d, &acct->utime);
+    timersub(&after->ru_stime, &before->ru_stime, &d);
+    timeradd(&acct->stime, &d, &acct->stime);
+    if (after->ru_maxrss > acct->maxrss_kb) {
+        acct->maxrss_kb = after->ru_maxrss;
+    }
+}
+
+static int builtin_time(struct shell *sh, char **argv) {
+    char **cmd = &argv[1];
+    bool piped = false;
+    for (int i = 0; cmd[i] != NULL; i++) {
+        if (strcmp(cmd[i], "|") == 0) piped = true;
+    }
+
+    struct job_acct acct;
+    int rc = 0;
+    if (cmd[0] == NULL || (!piped && builtin_lookup(cmd[0]) != NULL)) {
+        //a builtin runs in the shell, it costs what the shell and its children used meanwhile
+        struct rusage self[2], kids[2];
+        getrusage(RUSAGE_SELF, &self[0]);
+        getrusage(RUSAGE_CHILDREN, &kids[0]);
+        job_acct_start(&acct);
+        if (cmd[0] != NULL) {
+            do_builtin(sh, cmd);
+            rc = sh->last_status;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &acct.end);
+        getrusage(RUSAGE_SELF, &self[1]);
+        getrusage(RUSAGE_CHILDREN, &kids[1]);
+        time_add_delta(&acct, &self[0], &self[1]);
+        time_add_delta(&acct, &kids[0], &kids[1]);
+    } else {
+        struct pipeline pl;
+        if (pipeline_parse(cmd, &pl) != 0) {
+            return 2;
+        }
+        //the command only gets the terminal when the shell has it to give
+        bool foreground = sh->shell_is_interactive &&
+                          tcgetpgrp(sh->shell_terminal) == getpgrp();
+        rc = 127;
+        if (launch_pipeline(sh, &pl, foreground) != -1) {
+            rc = wait_pipeline(sh, &pl);
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &pl.acct.end);
+        }
+        acct = pl.acct;
+        pipeline_free(&pl);
+        if (foreground) {
+            tcsetpgrp(sh->shell_terminal, getpgrp());
+        }
+        if (rc < 0) {
+            rc = 127;
+        }
+    }
+
+    struct outbuf ob;
+    outbuf_init(&ob, STDERR_FILENO);
+    outbuf_write(&ob, "\n", 1);
+    time_line(&ob, "real", timespec_seconds(&acct.start, &acct.end));
+    time_line(&ob, "user", timeval_seconds(&acct.utime));
+    time_line(&ob, "sys", timeval_seconds(&acct.stime));
+    outbuf_printf(&ob, "maxrss\t%ldk\n", acct.maxrss_kb);
+    outbuf_flush(&ob);
+    return rc;
+}
+
+enum builtin_id {
+    BUILTIN_BRACKET,
+    BUILTIN_CD,
+    BUILTIN_ECHO,
+    BUILTIN_EXIT,
+    BUILTIN_FALSE,
+    BUILTIN_HASH,
+    BUILTIN_HISTORY,
+    BUILTIN_JOBS,
+    BUILTIN_KILL,
+    BUILTIN_LAUNCH,
+    BUILTIN_MY_PROMPT,
+    BUILTIN_PARALLEL,
+    BUILTIN_PRINTF,
+    BUILTIN_PWD,
+    BUILTIN_SET,
+    BUILTIN_STATS,
+    BUILTIN_TEST,
+    BUILTIN_TIME,
+    BUILTIN_TRUE,
+    BUILTIN_COUNT
+};
+
+static const struct builtin builtin_table[BUILTIN_COUNT] = {
+    [BUILTIN_BRACKET] = {"[", builtin_test},
+    [BUILTIN_CD] = {"cd", builtin_cd},
+    [BUILTIN_ECHO] = {"echo", builtin_echo},
+    [BUILTIN_EXIT] = {"exit", builtin_exit},
+    [BUILTIN_FALSE] = {"false", builtin_false},
+    [BUILTIN_HASH] = {"hash", builtin_hash},
+    [BUILTIN_HISTORY] = {"history", builtin_history},
+    [BUILTIN_JOBS] = {"jobs", builtin_jobs},
+    [BUILTIN_KILL] = {"kill", builtin_kill},
+    [BUILTIN_LAUNCH] = {"launch", builtin_launch},
+    [BUILTIN_MY_PROMPT] = {"MY_PROMPT=", builtin_my_prompt},
+    [BUILTIN_PARALLEL] = {"parallel", builtin_parallel},
+    [BUILTIN_PRINTF] = {"printf", builtin_printf},
+    [BUILTIN_PWD] = {"pwd", builtin_pwd},
+    [BUILTIN_SET] = {"set", builtin_set},
+    [BUILTIN_STATS] = {"stats", builtin_stats},
+    [BUILTIN_TEST] = {"test", builtin_test},
+    [BUILTIN_TIME] = {"time", builtin_time, true},
+    [BUILTIN_TRUE] = {"true", builtin_true},
+};
+
+const struct builtin *builtin_lookup(const char *name) {
+    //an assignment is looked up by its name and the '='
+    size_t len = strcspn(name, "=");
+    if (name[len] == '=') {
+        len++;
+    }
+
+    //every entry in the table needs a case here, the tests check that.
+    //Names that share a length and first letter are told apart by the second.
+    const struct builtin *b;
+    switch (BUILTIN_KEY(len, name[0])) {
+    case BUILTIN_KEY(1, '['): b = &builtin_table[BUILTIN_BRACKET]; break;
+    case BUILTIN_KEY(2, 'c'): b = &builtin_table[BUILTIN_CD]; break;
+    case BUILTIN_KEY(3, 'p'): b = &builtin_table[BUILTIN_PWD]; break;
+    case BUILTIN_KEY(3, 's'): b = &builtin_table[BUILTIN_SET]; break;
+    case BUILTIN_KEY(4, 'e'):
+        b = &builtin_table[name[1] == 'x' ? BUILTIN_EXIT : BUILTIN_ECHO];
+        break;
+    case BUILTIN_KEY(4, 'h'): b = &builtin_table[BUILTIN_HASH]; break;
+    case BUILTIN_KEY(4, 'j'): b = &builtin_table[BUILTIN_JOBS]; break;
+    case BUILTIN_KEY(4, 'k'): b = &builtin_table[BUILTIN_KILL]; break;
+    case BUILTIN_KEY(4, 't'):
+        b = &builtin_table[name[1] == 'e' ? BUILTIN_TEST :
+                           name[1] == 'i' ? BUILTIN_TIME : BUILTIN_TRUE];
+        break;
+    case BUILTIN_KEY(5, 'f'): b = &builtin_table[BUILTIN_FALSE]; break;
+    case BUILTIN_KEY(5, 's'): b = &builtin_table[BUILTIN_STATS]; break;
+    case BUILTIN_KEY(6, 'l'): b = &builtin_table[BUILTIN_LAUNCH]; break;
+    case BUILTIN_KEY(6, 'p'): b = &builtin_table[BUILTIN_PRINTF]; break;
+    case BUILTIN_KEY(7, 'h'): b = &builtin_table[BUILTIN_HISTORY]; break;
+    case BUILTIN_KEY(8, 'p'): b = &builtin_table[BUILTIN_PARALLEL]; break;
+    case BUILTIN_KEY(10, 'M'): b = &builtin_table[BUILTIN_MY_PROMPT]; break;
+    default: return NULL;
+    }
+    return strncmp(b->name, name, len) == 0 ? b : NULL;
+}
+
+const struct builtin *builtin_list(size_t *count) {
+    *count = BUILTIN_COUNT;
+    return builtin_table;
+}
+
+bool do_builtin(struct shell *sh, char **argv) {
+    if (argv == NULL || argv[0] == NULL) {
+        return false;
+    }
+    //dispatch is everything up to the builtin itself, external commands included
+    uint64_t t0 = stat_now();
+    const struct builtin *b = builtin_lookup(argv[0]);
+    if (b == NULL) {
+        stat_record(sh, STAT_BUILTIN, stat_now() - t0);
+        return false;
+    }
+    //time and its kind hand the whole line on to the command they run
+    if (b->prefix) {
+        stat_record(sh, STAT_BUILTIN, stat_now() - t0);
+        sh->last_status = b->fn(sh, argv);
+        return true;
+    }
+    //in a pipeline every stage runs in its own process, builtins too
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "|") == 0) {
+            stat_record(sh, STAT_BUILTIN, stat_now() - t0);
+            return false;
+        }
+    }
+
+    struct pipeline pl;
+    if (pipeline_parse(argv, &pl) != 0) {
+        sh->last_status = 2;
+        return true;
+    }
+    if (pl.nredirs == 0) {
+        stat_record(sh, STAT_BUILTIN, stat_now() - t0);
+        sh->last_status = b->fn(sh, pl.stages[0]);
+        pipeline_free(&pl);
+        return true;
+    }
+
+    //the redirections apply to the shell itself until the builtin returns
+    int inline_saved[PIPELINE_INLINE_REDIRS];
+    int *saved = pl.nredirs > PIPELINE_INLINE_REDIRS ? malloc(pl.nredirs * sizeof(int))
+                                                     : inline_saved;
+    if (saved == NULL) {
+        perror("malloc failed");
+        sh->last_status = 1;
+    } else if (redirect_push(sh, pl.redirs, pl.nredirs, saved) != 0) {
+        sh->last_status = 1;
+    } else {
+        stat_record(sh, STAT_BUILTIN, stat_now() - t0);
+        sh->last_status = b->fn(sh, pl.stages[0]);
+        redirect_pop(pl.redirs, pl.nredirs, saved);
+    }
+    if (saved != inline_saved) free(saved);
+    pipeline_free(&pl);
+    return true;
+}
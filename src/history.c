@@ -0,0 +1,534 @@
+/**
+ * @file history.c
+ * @brief Persistent command history
+ *
+ * History is one line per command in a plain file shared by every shell.
+ * Each command is added with a single O_APPEND write, so concurrent shells
+ * interleave whole lines and never tear one. Reading goes through a
+ * read-only mapping of the file: startup only walks back from the end for
+ * the entries handed to readline, and line numbers are counted lazily the
+ * first time they are needed and then kept up to date as the file grows.
+ *
+ * Substring search goes through a trigram index built on the first search
+ * and extended with new entries on every search after that. Each trigram
+ * has a delta and varint encoded list of the entries that contain it, so a
+ * query only verifies the entries on the shortest list of its trigrams.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+
+struct trigram_postings {
+    uint32_t tri;
+    uint32_t count;
+    uint32_t last;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *data;
+};
+
+struct history_index {
+    size_t *entries;
+    size_t nentries;
+    size_t entries_cap;
+    size_t indexed_end;
+    struct trigram_postings *table;
+    size_t table_cap;
+    size_t table_used;
+};
+
+struct history_store {
+    int fd;
+    const char *map;
+    size_t map_size;
+    size_t counted_end;
+    size_t counted_lines;
+    struct history_index index;
+};
+
+static struct history_store store = { .fd = -1 };
+
+//state of the C-r search between key presses
+static char *search_pattern;
+static char *search_match;
+static long search_id = -1;
+
+static size_t history_line_len(size_t pos);
+static int history_refresh(void);
+
+static void history_index_free(struct history_index *ix) {
+    for (size_t i = 0; i < ix->table_cap; i++) {
+        free(ix->table[i].data);
+    }
+    free(ix->table);
+    free(ix->entries);
+    memset(ix, 0, sizeof(*ix));
+}
+
+static size_t trigram_home(uint32_t tri, size_t cap) {
+    return (size_t)(tri * 2654435761u) & (cap - 1);
+}
+
+//find the postings of a trigram, adding an empty list when create is set
+static struct trigram_postings *trigram_find(struct history_index *ix, uint32_t tri,
+                                             bool create) {
+    if (create && (ix->table_used + 1) * 2 > ix->table_cap) {
+        size_t cap = ix->table_cap ? ix->table_cap * 2 : 4096;
+        struct trigram_postings *table = calloc(cap, sizeof(*table));
+        if (table == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < ix->table_cap; i++) {
+            if (ix->table[i].tri == 0) continue;
+            size_t j = trigram_home(ix->table[i].tri, cap);
+            while (table[j].tri != 0) j = (j + 1) & (cap - 1);
+            table[j] = ix->table[i];
+        }
+        free(ix->table);
+        ix->table = table;
+        ix->table_cap = cap;
+    }
+    if (ix->table_cap == 0) {
+        return NULL;
+    }
+
+    //entries never contain a NUL, so a zero trigram marks an empty slot
+    size_t i = trigram_home(tri, ix->table_cap);
+    while (ix->table[i].tri != 0) {
+        if (ix->table[i].tri == tri) return &ix->table[i];
+        i = (i + 1) & (ix->table_cap - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+    ix->table[i].tri = tri;
+    ix->table_used++;
+    return &ix->table[i];
+}
+
+static int trigram_add(struct history_index *ix, uint32_t tri, uint32_t id) {
+    struct trigram_postings *tp = trigram_find(ix, tri, true);
+    if (tp == NULL) {
+        return -1;
+    }
+    if (tp->count > 0 && tp->last == id) {
+        //the trigram shows up more than once in this entry
+        return 0;
+    }
+    if (tp->len + 5 > tp->cap) {
+        uint32_t cap = tp->cap ? tp->cap * 2 : 8;
+        uint8_t *data = realloc(tp->data, cap);
+        if (data == NULL) {
+            return -1;
+        }
+        tp->data = data;
+        tp->cap = cap;
+    }
+    uint32_t delta = id - (tp->count > 0 ? tp->last : 0);
+    while (delta >= 0x80) {
+        tp->data[tp->len++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    tp->data[tp->len++] = (uint8_t)delta;
+    tp->last = id;
+    tp->count++;
+    return 0;
+}
+
+//index every complete entry the index has not seen yet
+static int history_index_update(void) {
+    struct history_index *ix = &store.index;
+    while (ix->indexed_end < store.map_size) {
+        const char *line = store.map + ix->indexed_end;
+        const char *nl = memchr(line, '\n', store.map_size - ix->indexed_end);
+        if (nl == NULL) break;
+        if (ix->nentries == ix->entries_cap) {
+            size_t cap = ix->entries_cap ? ix->entries_cap * 2 : 1024;
+            size_t *entries = realloc(ix->entries, cap * sizeof(*entries));
+            if (entries == NULL) {
+                return -1;
+            }
+            ix->entries = entries;
+            ix->entries_cap = cap;
+        }
+
+        uint32_t id = ix->nentries;
+        size_t len = nl - line;
+        for (size_t i = 0; i + 3 <= len; i++) {
+            uint32_t tri = (uint32_t)(unsigned char)line[i] << 16 |
+                           (uint32_t)(unsigned char)line[i + 1] << 8 |
+                           (unsigned char)line[i + 2];
+            if (trigram_add(ix, tri, id) != 0) {
+                return -1;
+            }
+        }
+        ix->entries[ix->nentries++] = ix->indexed_end;
+        ix->indexed_end = nl - store.map + 1;
+    }
+    return 0;
+}
+
+//call fn for every entry containing pattern, oldest first
+static int history_each_match(const char *pattern,
+                              void (*fn)(size_t id, const char *line, size_t len, void *ctx),
+                              void *ctx) {
+    if (store.fd == -1 || history_refresh() != 0 || history_index_update() != 0) {
+        return -1;
+    }
+    struct history_index *ix = &store.index;
+    size_t plen = strlen(pattern);
+
+    //the rarest trigram of the pattern bounds the candidates
+    struct trigram_postings *best = NULL;
+    for (size_t i = 0; i + 3 <= plen; i++) {
+        uint32_t tri = (uint32_t)(unsigned char)pattern[i] << 16 |
+                       (uint32_t)(unsigned char)pattern[i + 1] << 8 |
+                       (unsigned char)pattern[i + 2];
+        struct trigram_postings *tp = trigram_find(ix, tri, false);
+        if (tp == NULL) {
+            return 0;
+        }
+        if (best == NULL || tp->count < best->count) {
+            best = tp;
+        }
+    }
+
+    size_t id = 0;
+    size_t at = 0;
+    size_t n = best != NULL ? best->count : ix->nentries;
+    for (size_t k = 0; k < n; k++) {
+        if (best != NULL) {
+            //decode the next entry id from the postings
+            uint32_t delta = 0;
+            int shift = 0;
+            uint8_t b;
+            do {
+                b = best->data[at++];
+                delta |= (uint32_t)(b & 0x7f) << shift;
+                shift += 7;
+            } while (b & 0x80);
+            id = (k == 0 ? 0 : id) + delta;
+        } else {
+            //patterns shorter than a trigram scan every entry
+            id = k;
+        }
+
+        const char *line = store.map + ix->entries[id];
+        size_t len = history_line_len(ix->entries[id]);
+        if (memmem(line, len, pattern, plen) != NULL) {
+            fn(id, line, len, ctx);
+        }
+    }
+    return 0;
+}
+
+//remap the file when another shell (or this one) has appended to it
+static int history_refresh(void) {
+    struct stat st;
+    if (fstat(store.fd, &st) == -1) {
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == store.map_size) {
+        return 0;
+    }
+
+    if (store.map != NULL) {
+        munmap((void *)store.map, store.map_size);
+        store.map = NULL;
+    }
+    if (size < store.map_size) {
+        //the file was truncated, nothing counted so far can be trusted
+        store.counted_end = 0;
+        store.counted_lines = 0;
+        history_index_free(&store.index);
+    }
+    store.map_size = 0;
+    if (size == 0) {
+        return 0;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, store.fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    store.map = map;
+    store.map_size = size;
+    return 0;
+}
+
+//total entries, counting only the part of the file not seen before
+static size_t history_count(void) {
+    while (store.counted_end < store.map_size) {
+        const char *nl = memchr(store.map + store.counted_end, '\n',
+                                store.map_size - store.counted_end);
+        if (nl == NULL) break;
+        store.counted_lines++;
+        store.counted_end = nl - store.map + 1;
+    }
+    //a last line without its newline still counts
+    return store.counted_lines + (store.counted_end < store.map_size ? 1 : 0);
+}
+
+//offset of the first of the last n entries, found by walking back from the end
+static size_t history_tail(size_t n) {
+    size_t search = store.map_size;
+    if (search > 0 && store.map[search - 1] == '\n') search--;
+    size_t pos = store.map_size;
+    for (size_t k = 0; k < n && pos > 0; k++) {
+        const char *nl = memrchr(store.map, '\n', search);
+        pos = nl != NULL ? (size_t)(nl - store.map) + 1 : 0;
+        search = pos > 0 ? pos - 1 : 0;
+    }
+    return pos;
+}
+
+//length of the entry starting at pos, without its newline
+static size_t history_line_len(size_t pos) {
+    const char *nl = memchr(store.map + pos, '\n', store.map_size - pos);
+    return nl != NULL ? (size_t)(nl - (store.map + pos)) : store.map_size - pos;
+}
+
+int history_open(const char *path, int recent) {
+    char *fallback = NULL;
+    if (path == NULL) {
+        path = getenv("MY_HISTFILE");
+        if (path == NULL) {
+            const char *home = getenv("HOME");
+            if (home == NULL || asprintf(&fallback, "%s/.myprogram_history", home) == -1) {
+                return -1;
+            }
+            path = fallback;
+        }
+    }
+    if (*path == '\0') {
+        //an empty MY_HISTFILE keeps history in memory only
+        return -1;
+    }
+
+    history_close();
+    store.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    free(fallback);
+    if (store.fd == -1) {
+        return -1;
+    }
+    if (history_refresh() != 0) {
+        history_close();
+        return -1;
+    }
+
+    //hand only the most recent entries to readline for line editing
+    if (recent > 0 && store.map_size > 0) {
+        size_t pos = history_tail(recent);
+        while (pos < store.map_size) {
+            size_t len = history_line_len(pos);
+            char *line = strndup(store.map + pos, len);
+            if (line == NULL) break;
+            add_history(line);
+            free(line);
+            pos += len + 1;
+        }
+    }
+    return 0;
+}
+
+int history_append(const char *line) {
+    add_history(line);
+    suggest_add(line);
+    if (store.fd == -1) {
+        return 0;
+    }
+
+    //one write per entry so concurrent shells never split a line
+    struct iovec iov[2] = {
+        { .iov_base = (void *)line, .iov_len = strlen(line) },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    ssize_t want = iov[0].iov_len + 1;
+    ssize_t n;
+    do {
+        n = writev(store.fd, iov, 2);
+    } while (n == -1 && errno == EINTR);
+    return n == want ? 0 : -1;
+}
+
+void history_close(void) {
+    history_index_free(&store.index);
+    suggest_clear();
+    if (store.map != NULL) {
+        munmap((void *)store.map, store.map_size);
+    }
+    if (store.fd != -1) {
+        close(store.fd);
+    }
+    store = (struct history_store){ .fd = -1 };
+
+    free(search_pattern);
+    free(search_match);
+    search_pattern = NULL;
+    search_match = NULL;
+    search_id = -1;
+}
+
+int print_history(int limit) {
+    if (store.fd == -1) {
+        //no history file, fall back to readline's list
+        HIST_ENTRY **hist_list;
+        int hist_length, i, start;
+
+        hist_list = history_list();
+        if (hist_list == NULL) {
+            fprintf(stderr, "Failed to retrieve history\n");
+            return -1;
+        }
+
+        hist_length = history_length;
+
+        if (limit <= 0 || limit > hist_length) {
+            start = 0;
+        } else {
+            start = hist_length - limit;
+        }
+
+        struct outbuf ob;
+        outbuf_init(&ob, STDOUT_FILENO);
+        for (i = start; i < hist_length; i++) {
+            outbuf_printf(&ob, "%d: %s\n", i + 1, hist_list[i]->line);
+        }
+        outbuf_flush(&ob);
+
+        return 0;
+    }
+
+    if (history_refresh() != 0) {
+        return -1;
+    }
+    size_t total = history_count();
+    size_t pos = 0;
+    size_t num = 1;
+    if (limit > 0 && (size_t)limit < total) {
+        pos = history_tail(limit);
+        num = total - limit + 1;
+    }
+
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    while (pos < store.map_size && ob.error == 0) {
+        size_t len = history_line_len(pos);
+        outbuf_printf(&ob, "%zu: ", num++);
+        outbuf_write(&ob, store.map + pos, len);
+        outbuf_write(&ob, "\n", 1);
+        pos += len + 1;
+    }
+    outbuf_flush(&ob);
+    return 0;
+}
+
+int history_each_entry(void (*fn)(const char *line, size_t len, void *ctx), void *ctx) {
+    if (store.fd == -1) {
+        HIST_ENTRY **hist_list = history_list();
+        for (int i = 0; hist_list != NULL && i < history_length; i++) {
+            fn(hist_list[i]->line, strlen(hist_list[i]->line), ctx);
+        }
+        return 0;
+    }
+
+    if (history_refresh() != 0) {
+        return -1;
+    }
+    size_t pos = 0;
+    while (pos < store.map_size) {
+        size_t len = history_line_len(pos);
+        fn(store.map + pos, len, ctx);
+        pos += len + 1;
+    }
+    return 0;
+}
+
+static void print_match(size_t id, const char *line, size_t len, void *ctx) {
+    struct outbuf *ob = ctx;
+    outbuf_printf(ob, "%zu: ", id + 1);
+    outbuf_write(ob, line, len);
+    outbuf_write(ob, "\n", 1);
+}
+
+int history_find(const char *pattern) {
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    int rc = history_each_match(pattern, print_match, &ob);
+    outbuf_flush(&ob);
+    return rc;
+}
+
+struct prev_match {
+    size_t before;
+    long id;
+};
+
+static void keep_prev_match(size_t id, const char *line, size_t len, void *ctx) {
+    UNUSED(line)
+    UNUSED(len)
+    struct prev_match *m = ctx;
+    if (id < m->before) {
+        m->id = id;
+    }
+}
+
+long history_find_prev(const char *pattern, size_t before) {
+    struct prev_match m = { .before = before, .id = -1 };
+    if (history_each_match(pattern, keep_prev_match, &m) != 0) {
+        return -1;
+    }
+    return m.id;
+}
+
+//C-r: replace the line with the newest entry containing what was typed,
+//pressing it again steps to older matches
+static int history_search_key(int count, int key) {
+    if (store.fd == -1 || rl_line_buffer[0] == '\0') {
+        return rl_reverse_search_history(count, key);
+    }
+
+    //a new search starts unless the line still shows the last match
+    if (search_match == NULL || strcmp(rl_line_buffer, search_match) != 0) {
+        free(search_pattern);
+        search_pattern = strdup(rl_line_buffer);
+        search_id = -1;
+        if (search_pattern == NULL) {
+            return 1;
+        }
+    }
+
+    long id = history_find_prev(search_pattern, search_id < 0 ? SIZE_MAX : (size_t)search_id);
+    if (id < 0) {
+        rl_ding();
+        return 0;
+    }
+    size_t off = store.index.entries[id];
+    char *line = strndup(store.map + off, history_line_len(off));
+    if (line == NULL) {
+        return 1;
+    }
+    free(search_match);
+    search_match = line;
+    search_id = id;
+    rl_replace_line(line, 0);
+    rl_point = rl_end;
+    return 0;
+}
+
+void history_bind_search(void) {
+    rl_bind_key(CTRL('r'), history_search_key);
+}
@@ -5,20 +5,31 @@
  * This file contains the implementation of various utility functions
  * used by the custom shell. Key functions include:
  *
+ * - Per line arena allocation (arena_alloc, arena_reset)
+ * - Buffered builtin output (outbuf_printf, outbuf_flush)
  * - Prompt management (get_prompt, set_prompt)
  * - Directory changing (change_dir)
- * - Command parsing (cmd_parse, cmd_free)
+ * - Command parsing (cmd_parse, cmd_parse_inplace, cmd_free, argv_builder_*)
  * - String manipulation (trim_white)
- * - Command history management (print_history)
+ * - Process launching with posix_spawn or fork (launch_process)
+ * - Pipelines in one process group (pipeline_parse, launch_pipeline, wait_pipeline)
+ * - Redirections applied in the child before exec
+ * - Command path cache in front of exec (cmd_hash_lookup, cmd_hash_pin)
  * - Background process handling (start_background_process, check_background_processes)
+ * - Job events from pidfds or a SIGCHLD signalfd in one epoll set (job_events_init, wait_for_jobs)
+ * - Reading input while reaping jobs (sh_readline)
+ * - Buffered or mapped batch input (line_reader_open_fd, line_reader_next)
  * - Shell initialization and cleanup (sh_init, sh_destroy)
- * - Job control (print_jobs)
+ * - Job control and per job resource accounting (print_jobs, print_jobs_long)
  *
  * These functions provide core functionality for the shell implemented in main.c.
  *
  * @author nolanstetz
  * @date 25th of September 2024
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "lab.h"
 #include <stdio.h>
 #include <string.h>
@@ -28,33 +39,199 @@
 #include <errno.h>
 #include <pwd.h>
 #include <linux/limits.h>
-#include <readline/history.h>
 #include <sys/wait.h>
 #include <bits/waitflags.h>
 #include <termios.h>
 #include <signal.h>
+#include <stddef.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <readline/readline.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
 
 #define PROMPT_OK 0
 #define PROMPT_MISSING_END_QUOTE 1
 #define PROMPT_MISSING_START_QUOTE 2
 #define PROMPT_OTHER_ERROR 3
 
-char *get_prompt(const char *env) {
+void arena_init(struct arena *a) {
+    a->head = NULL;
+    a->current = NULL;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    //keep every allocation aligned for any type
+    const size_t align = _Alignof(max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+
+    struct arena_block *b = a->current;
+    while (b != NULL && b->used + size > b->size) {
+        //move on to a block kept from an earlier line if there is one
+        b = b->next;
+    }
+    if (b == NULL) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(struct arena_block) + block_size);
+        if (b == NULL) {
+            perror("malloc failed");
+            return NULL;
+        }
+        b->size = block_size;
+        b->used = 0;
+        //append after the current block so reset walks blocks in order
+        if (a->current == NULL) {
+            b->next = a->head;
+            a->head = b;
+        } else {
+            b->next = a->current->next;
+            a->current->next = b;
+        }
+    }
+    a->current = b;
+    void *ptr = b->data + b->used;
+    b->used += size;
+    return ptr;
+}
+
+char *arena_strdup(struct arena *a, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(a, len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+void arena_reset(struct arena *a) {
+    for (struct arena_block *b = a->head; b != NULL; b = b->next) {
+        b->used = 0;
+    }
+    a->current = a->head;
+}
+
+void arena_destroy(struct arena *a) {
+    struct arena_block *b = a->head;
+    while (b != NULL) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    arena_init(a);
+}
+
+void outbuf_init(struct outbuf *ob, int fd) {
+    //anything stdio still holds has to come out first
+    fflush(stdout);
+    ob->fd = fd;
+    ob->len = 0;
+    ob->error = 0;
+}
+
+int outbuf_flush(struct outbuf *ob) {
+    size_t off = 0;
+    while (off < ob->len && ob->error == 0) {
+        ssize_t n = write(ob->fd, ob->buf + off, ob->len - off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            //a reader that went away (history | head) just ends the output
+            ob->error = errno;
+            break;
+        }
+        off += n;
+    }
+    ob->len = 0;
+    return ob->error == 0 ? 0 : -1;
+}
+
+void outbuf_write(struct outbuf *ob, const char *data, size_t len) {
+    if (len > OUTBUF_CHUNK - ob->len) {
+        outbuf_flush(ob);
+    }
+    if (len >= OUTBUF_CHUNK) {
+        //too big to be worth copying, send it as is
+        while (len > 0 && ob->error == 0) {
+            ssize_t n = write(ob->fd, data, len);
+            if (n == -1) {
+                if (errno != EINTR) ob->error = errno;
+                continue;
+            }
+            data += n;
+            len -= n;
+        }
+        return;
+    }
+    memcpy(ob->buf + ob->len, data, len);
+    ob->len += len;
+}
+
+void outbuf_printf(struct outbuf *ob, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(ob->buf + ob->len, OUTBUF_CHUNK - ob->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t)n < OUTBUF_CHUNK - ob->len) {
+        ob->len += n;
+        return;
+    }
+
+    //it did not fit, drop the partial copy and format it again
+    outbuf_flush(ob);
+    char *big = NULL;
+    va_start(ap, fmt);
+    n = vasprintf(&big, fmt, ap);
+    va_end(ap);
+    if (n >= 0) {
+        outbuf_write(ob, big, n);
+        free(big);
+    }
+}
+
+static const char *prompt_value(const char *env) {
     //get the prompt value from the env variable
     const char *prompt_value = getenv(env);
     const char *default_prompt = "shell$ ";
     //use default prompt if nothing given
-    if (prompt_value == NULL || strlen(prompt_value) == 0) {
+    if (prompt_value == NULL || *prompt_value == '\0') {
         prompt_value = default_prompt;
     }
+    return prompt_value;
+}
+
+char *get_prompt(const char *env) {
+    const char *value = prompt_value(env);
     //allocate memory for prompt
-    char *prompt = malloc(strlen(prompt_value) + 1);
+    char *prompt = malloc(strlen(value) + 1);
     if (prompt == NULL) {
         fprintf(stderr, "Memory allocation failed\n");
         return NULL;
     }
     
-    strcpy(prompt, prompt_value);
+    strcpy(prompt, value);
+    return prompt;
+}
+
+char *get_prompt_arena(struct arena *a, const char *env) {
+    char *prompt = arena_strdup(a, prompt_value(env));
+    if (prompt == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
     return prompt;
 }
 
@@ -99,7 +276,6 @@ int set_prompt(const char *new_prompt) {
     return PROMPT_OK;
 }
 
-
 int change_dir(char **dir) {
     const char *new_dir;
     
@@ -135,44 +311,241 @@ int change_dir(char **dir) {
     return 0;
 }
 
-char **cmd_parse(char const *line) {
-    //get max num of arguments allowed and allocate memory for args array
+int argv_builder_init(struct argv_builder *ab) {
+    ab->argc = 0;
+    ab->cap = ARGV_BUILDER_INITIAL_CAP;
+    ab->bytes = 0;
+    ab->arena = NULL;
+    //ARG_MAX limits the total size of argv, not the number of entries
     long arg_max = sysconf(_SC_ARG_MAX);
-    char **args = malloc((arg_max + 1) * sizeof(char *));
-    if (args == NULL) {
+    ab->byte_limit = (arg_max > 0) ? (size_t)arg_max : ARGV_BUILDER_FALLBACK_LIMIT;
+    ab->argv = malloc(ab->cap * sizeof(char *));
+    if (ab->argv == NULL) {
         perror("malloc failed");
+        return -1;
+    }
+    ab->argv[0] = NULL;
+    return 0;
+}
+
+int argv_builder_init_arena(struct argv_builder *ab, struct arena *a) {
+    ab->argc = 0;
+    ab->cap = ARGV_BUILDER_INITIAL_CAP;
+    ab->bytes = 0;
+    ab->arena = a;
+    long arg_max = sysconf(_SC_ARG_MAX);
+    ab->byte_limit = (arg_max > 0) ? (size_t)arg_max : ARGV_BUILDER_FALLBACK_LIMIT;
+    ab->argv = arena_alloc(a, ab->cap * sizeof(char *));
+    if (ab->argv == NULL) {
+        return -1;
+    }
+    ab->argv[0] = NULL;
+    return 0;
+}
+
+int argv_builder_push(struct argv_builder *ab, char *arg) {
+    //account for the string, its terminator and the pointer slot
+    size_t cost = strlen(arg) + 1 + sizeof(char *);
+    if (ab->bytes + cost > ab->byte_limit) {
+        errno = E2BIG;
+        return -1;
+    }
+    //keep one slot free for the NULL terminator
+    if (ab->argc + 1 >= ab->cap) {
+        size_t new_cap = ab->cap * 2;
+        char **tmp;
+        if (ab->arena != NULL) {
+            //the old array is reclaimed when the arena is reset
+            tmp = arena_alloc(ab->arena, new_cap * sizeof(char *));
+            if (tmp != NULL) {
+                memcpy(tmp, ab->argv, ab->cap * sizeof(char *));
+            }
+        } else {
+            tmp = realloc(ab->argv, new_cap * sizeof(char *));
+            if (tmp == NULL) {
+                perror("realloc failed");
+            }
+        }
+        if (tmp == NULL) {
+            return -1;
+        }
+        ab->argv = tmp;
+        ab->cap = new_cap;
+    }
+    ab->argv[ab->argc++] = arg;
+    ab->argv[ab->argc] = NULL;
+    ab->bytes += cost;
+    return 0;
+}
+
+char **argv_builder_finish(struct argv_builder *ab) {
+    char **argv = ab->argv;
+    ab->argv = NULL;
+    ab->argc = ab->cap = ab->bytes = 0;
+    return argv;
+}
+
+void argv_builder_destroy(struct argv_builder *ab) {
+    if (ab->arena == NULL) {
+        free(ab->argv);
+    }
+    ab->argv = NULL;
+    ab->argc = ab->cap = ab->bytes = 0;
+}
+
+static bool is_token_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static int tokenize_push(struct argv_builder *ab, char *token) {
+    if (argv_builder_push(ab, token) != 0) {
+        if (errno == E2BIG) {
+            fprintf(stderr, "Argument list too long\n");
+        }
+        argv_builder_destroy(ab);
+        return -1;
+    }
+    return 0;
+}
+
+#define REDIR_TOKENS(d) { d "<", d ">", d ">>", d ">&" }
+static const char *const redir_tokens[11][4] = {
+    REDIR_TOKENS(""), REDIR_TOKENS("0"), REDIR_TOKENS("1"), REDIR_TOKENS("2"),
+    REDIR_TOKENS("3"), REDIR_TOKENS("4"), REDIR_TOKENS("5"), REDIR_TOKENS("6"),
+    REDIR_TOKENS("7"), REDIR_TOKENS("8"), REDIR_TOKENS("9")
+};
+
+static bool is_token_break(char c) {
+    return c == '\0' || is_token_space(c) || c == '|' || c == '<' || c == '>';
+}
+
+static const char *scan_redirect(char **pp) {
+    //[n]< [n]> [n]>> [n]>& with an optional single digit descriptor
+    char *p = *pp;
+    int row = 0;
+    if (*p >= '0' && *p <= '9') {
+        row = *p - '0' + 1;
+        p++;
+    }
+    int col;
+    if (*p == '<') {
+        col = 0;
+        p++;
+    } else if (p[1] == '>') {
+        col = 2;
+        p += 2;
+    } else if (p[1] == '&') {
+        col = 3;
+        p += 2;
+    } else {
+        col = 1;
+        p++;
+    }
+    *pp = p;
+    return redir_tokens[row][col];
+}
+
+static bool starts_redirect(const char *p) {
+    return *p == '<' || *p == '>' || (*p >= '0' && *p <= '9' && (p[1] == '<' || p[1] == '>'));
+}
+
+static const char *take_operator(char **pp) {
+    char *start = *pp;
+    const char *op;
+    if (*start == '|') {
+        op = "|";
+        *pp = start + 1;
+    } else {
+        op = scan_redirect(pp);
+    }
+    //the operator characters become terminators for the word before them
+    memset(start, '\0', (size_t)(*pp - start));
+    return op;
+}
+
+static char **tokenize(struct argv_builder *ab, char *line) {
+    //split the line by writing terminators into it, the args point at it
+    char *p = line;
+    while (1) {
+        while (is_token_space(*p)) p++;
+        if (*p == '\0') break;
+
+        //operators are tokens even without spaces around them
+        if (*p == '|' || starts_redirect(p)) {
+            if (tokenize_push(ab, (char *)take_operator(&p)) != 0) return NULL;
+            continue;
+        }
+
+        char *word = p;
+        while (!is_token_break(*p)) p++;
+        const char *op = NULL;
+        if (is_token_space(*p)) {
+            *p++ = '\0';
+        } else if (*p != '\0') {
+            op = take_operator(&p);
+        }
+        if (tokenize_push(ab, word) != 0) return NULL;
+        if (op != NULL && tokenize_push(ab, (char *)op) != 0) return NULL;
+    }
+
+    return argv_builder_finish(ab);
+}
+
+char **cmd_parse_inplace(char *line) {
+    struct argv_builder ab;
+    if (argv_builder_init(&ab) != 0) {
+        return NULL;
+    }
+    return tokenize(&ab, line);
+}
+
+char **cmd_parse_arena(struct arena *a, char *line) {
+    struct argv_builder ab;
+    if (argv_builder_init_arena(&ab, a) != 0) {
         return NULL;
     }
+    return tokenize(&ab, line);
+}
 
-    char *token;
+void cmd_free_inplace(char **argv) {
+    //the tokens belong to the line that was parsed
+    free(argv);
+}
+
+char **cmd_parse(char const *line) {
     char *line_copy = strdup(line);
-    int i = 0;
-    //tokenize the line and store each token in the args array
-    token = strtok(line_copy, " \t\n");
-    while (token != NULL && i < arg_max) {
-        args[i] = strdup(token);
-        if (args[i] == NULL) {
-            perror("strdup failed");
-            cmd_free(args);
-            free(line_copy);
-            return NULL;
-        }
-        i++;
-        token = strtok(NULL, " \t\n");
+    if (line_copy == NULL) {
+        perror("strdup failed");
+        return NULL;
+    }
+
+    char **args = cmd_parse_inplace(line_copy);
+    if (args == NULL) {
+        free(line_copy);
+        return NULL;
     }
-    args[i] = NULL;
 
-    free(line_copy);
-    return args;
+    //stash the copy behind the NULL terminator so cmd_free can release it
+    size_t argc = 0;
+    while (args[argc] != NULL) argc++;
+    char **tmp = realloc(args, (argc + 2) * sizeof(char *));
+    if (tmp == NULL) {
+        perror("realloc failed");
+        cmd_free_inplace(args);
+        free(line_copy);
+        return NULL;
+    }
+    tmp[argc + 1] = line_copy;
+    return tmp;
 }
 
 void cmd_free(char **line) {
     if (line == NULL) return;
-    //free each argument string
-    for (int i = 0; line[i] != NULL; i++) {
-        free(line[i]);
-    }
-    free(line);
+    //the strings live in the copy stored after the NULL terminator
+    int i = 0;
+    while (line[i] != NULL) i++;
+    free(line[i + 1]);
+    cmd_free_inplace(line);
 }
 
 char *trim_white(char *line) {
@@ -191,129 +564,1740 @@ char *trim_white(char *line) {
     return line;
 }
 
-int print_history(int limit) {
-    //get the history list
-    HIST_ENTRY **hist_list;
-    int hist_length, i, start;
-
-    hist_list = history_list();
-    if (hist_list == NULL) {
-        fprintf(stderr, "Failed to retrieve history\n");
+int set_launch_backend(struct shell *sh, const char *name) {
+    if (name == NULL) return -1;
+    if (strcmp(name, "spawn") == 0) {
+        sh->launch_backend = LAUNCH_SPAWN;
+    } else if (strcmp(name, "fork") == 0) {
+        sh->launch_backend = LAUNCH_FORK;
+    } else {
         return -1;
     }
+    return 0;
+}
 
-    hist_length = history_length;
-    
-    if (limit <= 0 || limit > hist_length) {
-        start = 0;
-    } else {
-        start = hist_length - limit;
+const char *get_launch_backend(struct shell *sh) {
+    return sh->launch_backend == LAUNCH_FORK ? "fork" : "spawn";
+}
+
+static uint64_t cmd_hash_fn(const char *name) {
+    //FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
     }
+    return h;
+}
 
-    for (i = start; i < hist_length; i++) {
-        printf("%d: %s\n", i + 1, hist_list[i]->line);
+static struct cmd_hash_entry **cmd_hash_slot(struct cmd_hash *ht, const char *name) {
+    struct cmd_hash_entry **slot = &ht->buckets[cmd_hash_fn(name) & (ht->nbuckets - 1)];
+    while (*slot != NULL && strcmp((*slot)->name, name) != 0) {
+        slot = &(*slot)->next;
     }
+    return slot;
+}
 
-    return 0;
+static void cmd_hash_drop(struct cmd_hash *ht, bool keep_pinned) {
+    for (size_t i = 0; i < ht->nbuckets; i++) {
+        struct cmd_hash_entry **slot = &ht->buckets[i];
+        while (*slot != NULL) {
+            struct cmd_hash_entry *e = *slot;
+            if (keep_pinned && e->pinned) {
+                slot = &e->next;
+                continue;
+            }
+            *slot = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            ht->count--;
+        }
+    }
 }
 
-int start_background_process(struct shell *sh, char **args, char *full_command) {
-    if (sh->bg_job_count >= MAX_BG_JOBS) {
-        fprintf(stderr, "Maximum number of background jobs reached\n");
-        return -1;
+static int cmd_hash_insert(struct cmd_hash *ht, const char *name, const char *path, bool pinned) {
+    if (ht->buckets == NULL) {
+        ht->buckets = calloc(CMD_HASH_INITIAL_BUCKETS, sizeof(struct cmd_hash_entry *));
+        if (ht->buckets == NULL) {
+            perror("calloc failed");
+            return -1;
+        }
+        ht->nbuckets = CMD_HASH_INITIAL_BUCKETS;
     }
 
-    pid_t pid = fork();
+    struct cmd_hash_entry **slot = cmd_hash_slot(ht, name);
+    struct cmd_hash_entry *e = *slot;
+    if (e != NULL) {
+        //replace the path of an existing entry
+        char *copy = strdup(path);
+        if (copy == NULL) {
+            perror("strdup failed");
+            return -1;
+        }
+        free(e->path);
+        e->path = copy;
+        e->pinned = pinned;
+        return 0;
+    }
 
-    if (pid == -1) {
-        perror("fork failed");
+    //double the table once it averages more than one entry per bucket
+    if (ht->count >= ht->nbuckets) {
+        size_t new_n = ht->nbuckets * 2;
+        struct cmd_hash_entry **nb = calloc(new_n, sizeof(struct cmd_hash_entry *));
+        if (nb != NULL) {
+            for (size_t i = 0; i < ht->nbuckets; i++) {
+                struct cmd_hash_entry *cur = ht->buckets[i];
+                while (cur != NULL) {
+                    struct cmd_hash_entry *next = cur->next;
+                    size_t idx = cmd_hash_fn(cur->name) & (new_n - 1);
+                    cur->next = nb[idx];
+                    nb[idx] = cur;
+                    cur = next;
+                }
+            }
+            free(ht->buckets);
+            ht->buckets = nb;
+            ht->nbuckets = new_n;
+            slot = cmd_hash_slot(ht, name);
+        }
+    }
+
+    e = malloc(sizeof(struct cmd_hash_entry));
+    if (e == NULL) {
+        perror("malloc failed");
         return -1;
-    } else if (pid == 0) {
-        // Child process
-        setpgid(0, 0);
-        if (execvp(args[0], args) == -1) {
-            perror("execvp failed");
-            exit(EXIT_FAILURE);
+    }
+    e->name = strdup(name);
+    e->path = strdup(path);
+    if (e->name == NULL || e->path == NULL) {
+        perror("strdup failed");
+        free(e->name);
+        free(e->path);
+        free(e);
+        return -1;
+    }
+    e->hits = 0;
+    e->pinned = pinned;
+    e->next = NULL;
+    *slot = e;
+    ht->count++;
+    return 0;
+}
+
+//the search path, with the system default execvp uses when PATH is unset
+static const char *cmd_search_path(void) {
+    static char default_path[256];
+    const char *path = getenv("PATH");
+    if (path != NULL) {
+        return path;
+    }
+    if (default_path[0] == '\0') {
+        size_t n = confstr(_CS_PATH, default_path, sizeof(default_path));
+        if (n == 0 || n > sizeof(default_path)) {
+            strcpy(default_path, "/bin:/usr/bin");
         }
-    } else {
-        // Parent process
-        int job_id = sh->next_job_id++;
-        sh->bg_jobs[sh->bg_job_count].job_id = job_id;
-        sh->bg_jobs[sh->bg_job_count].pid = pid;
-        sh->bg_jobs[sh->bg_job_count].command = strdup(full_command);
-        sh->bg_jobs[sh->bg_job_count].status = 0; // 0 for Running
-        sh->bg_job_count++;
+    }
+    return default_path;
+}
 
-        printf("[%d] %d\n", job_id, pid);
+static void cmd_hash_check_path(struct cmd_hash *ht) {
+    //a new PATH invalidates everything that was found by searching it
+    const char *path = cmd_search_path();
+    if (ht->path_env != NULL && strcmp(ht->path_env, path) == 0) {
+        return;
+    }
+    if (ht->buckets != NULL) {
+        cmd_hash_drop(ht, true);
     }
+    free(ht->path_env);
+    ht->path_env = strdup(path);
+}
 
-    return 0;
+static bool is_executable_file(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
 }
 
-void check_background_processes(struct shell *sh) {
-    for (int i = 0; i < sh->bg_job_count; i++) {
-        int status;
-        pid_t result = waitpid(sh->bg_jobs[i].pid, &status, WNOHANG);
+static struct cmd_hash_entry *cmd_hash_resolve(struct cmd_hash *ht, const char *name) {
+    cmd_hash_check_path(ht);
+    if (ht->buckets != NULL) {
+        struct cmd_hash_entry *e = *cmd_hash_slot(ht, name);
+        if (e != NULL) return e;
+    }
 
-        if (result > 0) {
-            // Process has finished
-            sh->bg_jobs[i].status = 1; // 1 for Done
+    //walk PATH once, the way execvp would
+    const char *dirs = ht->path_env ? ht->path_env : "";
+    size_t name_len = strlen(name);
+    char candidate[PATH_MAX];
+    while (1) {
+        const char *end = strchrnul(dirs, ':');
+        size_t dir_len = (size_t)(end - dirs);
+        if (dir_len + name_len + 2 <= sizeof(candidate)) {
+            //an empty entry means the current directory
+            if (dir_len == 0) {
+                candidate[0] = '.';
+                dir_len = 1;
+            } else {
+                memcpy(candidate, dirs, dir_len);
+            }
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+            if (is_executable_file(candidate)) {
+                if (cmd_hash_insert(ht, name, candidate, false) != 0) {
+                    return NULL;
+                }
+                return *cmd_hash_slot(ht, name);
+            }
         }
+        if (*end == '\0') break;
+        dirs = end + 1;
     }
+    return NULL;
 }
 
-void sh_init(struct shell *sh) {
-    sh->shell_terminal = STDIN_FILENO;
-    sh->shell_is_interactive = isatty(sh->shell_terminal);
+const char *cmd_hash_lookup(struct shell *sh, const char *name) {
+    struct cmd_hash_entry *e = cmd_hash_resolve(&sh->cmd_hash, name);
+    return e ? e->path : NULL;
+}
 
-    if (sh->shell_is_interactive) {
-        // Loop until we are in the foreground
-        while (tcgetpgrp(sh->shell_terminal) != (sh->shell_pgid = getpgrp()))
-            kill(-sh->shell_pgid, SIGTTIN);
+int cmd_hash_pin(struct shell *sh, const char *name, const char *path) {
+    cmd_hash_check_path(&sh->cmd_hash);
+    return cmd_hash_insert(&sh->cmd_hash, name, path, true);
+}
 
-        // Ignore interactive and job-control signals
-        signal(SIGINT, SIG_IGN);
-        signal(SIGQUIT, SIG_IGN);
-        signal(SIGTSTP, SIG_IGN);
-        signal(SIGTTIN, SIG_IGN);
-        signal(SIGTTOU, SIG_IGN);
+void cmd_hash_forget(struct shell *sh, const char *name) {
+    struct cmd_hash *ht = &sh->cmd_hash;
+    if (ht->buckets == NULL) return;
+    struct cmd_hash_entry **slot = cmd_hash_slot(ht, name);
+    struct cmd_hash_entry *e = *slot;
+    if (e == NULL) return;
+    *slot = e->next;
+    free(e->name);
+    free(e->path);
+    free(e);
+    ht->count--;
+}
 
-        // Put ourselves in our own process group
-        sh->shell_pgid = getpid();
-        if (setpgid(sh->shell_pgid, sh->shell_pgid) < 0) {
-            perror("Couldn't put the shell in its own process group");
-            exit(1);
+void cmd_hash_clear(struct shell *sh) {
+    if (sh->cmd_hash.buckets != NULL) {
+        cmd_hash_drop(&sh->cmd_hash, false);
+    }
+}
+
+void cmd_hash_print(struct shell *sh) {
+    struct cmd_hash *ht = &sh->cmd_hash;
+    if (ht->count == 0) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    outbuf_printf(&ob, "hits\tcommand\n");
+    for (size_t i = 0; i < ht->nbuckets; i++) {
+        for (struct cmd_hash_entry *e = ht->buckets[i]; e != NULL; e = e->next) {
+            outbuf_printf(&ob, "%4u\t%s\n", e->hits, e->path);
         }
+    }
+    outbuf_flush(&ob);
+}
 
-        // Grab control of the terminal
-        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+void cmd_hash_destroy(struct shell *sh) {
+    cmd_hash_clear(sh);
+    free(sh->cmd_hash.buckets);
+    free(sh->cmd_hash.path_env);
+    memset(&sh->cmd_hash, 0, sizeof(sh->cmd_hash));
+}
 
-        // Save default terminal attributes for shell
-        tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
+static const int job_control_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+
+/**
+ * Where a launched process goes and what it reads and writes. A pgid of 0
+ * puts the child in a new process group that it leads, -1 descriptors are
+ * inherited from the shell.
+ */
+struct launch_opts {
+    pid_t pgid;
+    int stdin_fd;
+    int stdout_fd;
+    bool foreground;
+    const struct redir *redirs;
+    int nredirs;
+    int *redir_fds;
+};
+
+//move a descriptor the shell opened above 0-9, the ones a command line can name
+static int fd_above_user(int fd) {
+    if (fd < 0 || fd >= 10) {
+        return fd;
     }
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    int e = errno;
+    close(fd);
+    errno = e;
+    return moved;
+}
 
-    sh->bg_job_count = 0;
-    sh->next_job_id = 1; // Initialize next_job_id
-    sh->prompt = get_prompt("MY_PROMPT");
+static int shell_devnull(struct shell *sh) {
+    //opened on first use and shared by every redirection to /dev/null
+    if (sh->devnull_fd < 0) {
+        sh->devnull_fd = fd_above_user(open("/dev/null", O_RDWR | O_CLOEXEC));
+    }
+    return sh->devnull_fd;
 }
 
-void sh_destroy(struct shell *sh) {
-    if (sh->prompt) {
-        free(sh->prompt);
+static bool redir_owns_fd(struct shell *sh, const struct redir *r, int fd) {
+    return r->kind != REDIR_DUP && fd >= 0 && fd != sh->devnull_fd;
+}
+
+//open the file or find the descriptor a redirection reads from or writes to
+static int open_redir(struct shell *sh, const struct redir *r) {
+    int fd;
+    if (r->kind == REDIR_DUP) {
+        char *end;
+        long src = strtol(r->target, &end, 10);
+        if (*r->target == '\0' || *end != '\0' || src < 0 || src > INT_MAX) {
+            fprintf(stderr, "%s: ambiguous redirect\n", r->target);
+            return -1;
+        }
+        return (int)src;
     }
-    //free command strings for each background job
-    for (int i = 0; i < sh->bg_job_count; i++) {
-        if (sh->bg_jobs[i].command) {
-            free(sh->bg_jobs[i].command);
+    if (strcmp(r->target, "/dev/null") == 0) {
+        return shell_devnull(sh);
+    }
+    int flags = O_CLOEXEC;
+    if (r->kind == REDIR_IN) {
+        flags |= O_RDONLY;
+    } else if (r->kind == REDIR_APPEND) {
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        flags |= O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    //a source must not sit on an fd a later redirection of the same command replaces
+    fd = fd_above_user(open(r->target, flags, 0666));
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", r->target, strerror(errno));
+    }
+    return fd;
+}
+
+static int open_redirs(struct shell *sh, const struct launch_opts *o) {
+    for (int i = 0; i < o->nredirs; i++) {
+        int fd = open_redir(sh, &o->redirs[i]);
+        if (fd < 0) {
+            for (int j = 0; j < i; j++) {
+                if (redir_owns_fd(sh, &o->redirs[j], o->redir_fds[j])) close(o->redir_fds[j]);
+            }
+            return -1;
         }
+        o->redir_fds[i] = fd;
     }
+    return 0;
 }
 
-void print_jobs(struct shell *sh) {
-    for (int i = 0; i < sh->bg_job_count; i++) {
-        struct bg_job *job = &sh->bg_jobs[i];
-        //determine status
-        const char *status = (job->status == 0) ? "Running" : "Done   ";
-        printf("[%d] %d %s %s\n", job->job_id, job->pid, status, job->command);
+int redirect_push(struct shell *sh, const struct redir *redirs, int nredirs, int *saved) {
+    //stdio must not carry output across the swap
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < nredirs; i++) {
+        const struct redir *r = &redirs[i];
+        //keep the old descriptor above the ones a command line can name
+        saved[i] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+        if (saved[i] == -1 && errno != EBADF) {
+            perror("fcntl failed");
+            redirect_pop(redirs, i, saved);
+            return -1;
+        }
+        int fd = open_redir(sh, r);
+        if (fd < 0 || (fd != r->fd && dup2(fd, r->fd) == -1)) {
+            if (fd >= 0) {
+                fprintf(stderr, "%d: %s\n", fd, strerror(errno));
+                if (redir_owns_fd(sh, r, fd)) close(fd);
+            }
+            redirect_pop(redirs, i + 1, saved);
+            return -1;
+        }
+        if (fd != r->fd && redir_owns_fd(sh, r, fd)) close(fd);
+    }
+    return 0;
+}
+
+void redirect_pop(const struct redir *redirs, int nredirs, const int *saved) {
+    fflush(stdout);
+    fflush(stderr);
+    //undo in reverse so a descriptor redirected twice gets its first value back
+    for (int i = nredirs - 1; i >= 0; i--) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], redirs[i].fd);
+            close(saved[i]);
+        } else {
+            close(redirs[i].fd);
+        }
+    }
+}
+
+static void close_redirs(struct shell *sh, const struct launch_opts *o) {
+    for (int i = 0; i < o->nredirs; i++) {
+        if (redir_owns_fd(sh, &o->redirs[i], o->redir_fds[i])) close(o->redir_fds[i]);
+    }
+}
+
+static int redirs_max_fd(const struct launch_opts *o) {
+    int max = STDERR_FILENO;
+    for (int i = 0; i < o->nredirs; i++) {
+        if (o->redirs[i].fd > max) max = o->redirs[i].fd;
+    }
+    return max;
+}
+
+//argv for running path with /bin/sh, which is what execvp does when exec fails with ENOEXEC
+static void script_argv(char **out, const char *path, char **argv) {
+    out[0] = "/bin/sh";
+    out[1] = (char *)path;
+    int i = 1;
+    for (; argv[i] != NULL; i++) {
+        out[i + 1] = argv[i];
     }
-}
\ No newline at end of file
+    out[i + 1] = NULL;
+}
+
+static int argv_count(char **argv) {
+    int n = 0;
+    while (argv[n] != NULL) n++;
+    return n;
+}
+
+static pid_t launch_fork(struct shell *sh, const char *path, char **argv,
+                         const struct launch_opts *o, int *err) {
+    //the child reports a failed exec through a close-on-exec pipe
+    int errpipe[2];
+    if (pipe2(errpipe, O_CLOEXEC) == -1) {
+        *err = errno;
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        *err = errno;
+        close(errpipe[0]);
+        close(errpipe[1]);
+        return -1;
+    } else if (pid == 0) {
+        // Child process
+        close(errpipe[0]);
+        setpgid(0, o->pgid);
+        if (o->foreground && sh->shell_is_interactive) {
+            tcsetpgrp(sh->shell_terminal, getpgrp());
+        }
+
+        // Reset signal handlers and the mask the shell runs with
+        for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(int); i++) {
+            signal(job_control_signals[i], SIG_DFL);
+        }
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+
+        // Pipe ends are close-on-exec, only the dup'd copies survive exec
+        if (o->stdin_fd >= 0) dup2(o->stdin_fd, STDIN_FILENO);
+        if (o->stdout_fd >= 0) dup2(o->stdout_fd, STDOUT_FILENO);
+        // Redirections come after the pipes so they can override them
+        for (int i = 0; i < o->nredirs; i++) {
+            int src = o->redir_fds[i];
+            int dst = o->redirs[i].fd;
+            if (src == dst) {
+                fcntl(src, F_SETFD, 0);
+            } else if (dup3(src, dst, 0) == -1) {
+                fprintf(stderr, "%d: %s\n", src, strerror(errno));
+                _exit(1);
+            }
+        }
+        // Anything else the shell had open must not leak into the command
+        close_range((unsigned)redirs_max_fd(o) + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+
+        if (path == NULL) {
+            //a builtin in a pipeline, the parent must not wait on the error pipe
+            close(errpipe[1]);
+            int rc = builtin_lookup(argv[0])->fn(sh, argv);
+            fflush(stdout);
+            _exit(rc);
+        }
+        execv(path, argv);
+        if (errno == ENOEXEC) {
+            char *sh_argv[argv_count(argv) + 2];
+            script_argv(sh_argv, path, argv);
+            execv(sh_argv[0], sh_argv);
+            errno = ENOEXEC;
+        }
+        int e = errno;
+        if (write(errpipe[1], &e, sizeof(e)) != sizeof(e)) {
+            // Nothing else we can do from here
+        }
+        _exit(127);
+    }
+
+    // Parent process, a read of zero bytes means the exec succeeded
+    close(errpipe[1]);
+    int child_err = 0;
+    ssize_t n;
+    do {
+        n = read(errpipe[0], &child_err, sizeof(child_err));
+    } while (n == -1 && errno == EINTR);
+    close(errpipe[0]);
+    if (n == sizeof(child_err)) {
+        waitpid(pid, NULL, 0);
+        *err = child_err;
+        return -1;
+    }
+    return pid;
+}
+
+static pid_t launch_spawn(struct shell *sh, const char *path, char **argv,
+                          const struct launch_opts *o, int *err) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t sigdefault, sigmask;
+    pid_t pid = -1;
+    int rc;
+
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+
+    // Child joins the process group with default job control signals
+    sigemptyset(&sigdefault);
+    for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(int); i++) {
+        sigaddset(&sigdefault, job_control_signals[i]);
+    }
+    sigemptyset(&sigmask);
+    posix_spawnattr_setpgroup(&attr, o->pgid);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                    POSIX_SPAWN_SETSIGMASK);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+    // Hand over the terminal from inside the child, before exec
+    if (o->foreground && sh->shell_is_interactive) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, sh->shell_terminal);
+    }
+#else
+    UNUSED(sh);
+#endif
+    if (o->stdin_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, o->stdin_fd, STDIN_FILENO);
+    }
+    if (o->stdout_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, o->stdout_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < o->nredirs; i++) {
+        posix_spawn_file_actions_adddup2(&actions, o->redir_fds[i], o->redirs[i].fd);
+    }
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+    posix_spawn_file_actions_addclosefrom_np(&actions, redirs_max_fd(o) + 1);
+#endif
+
+    rc = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    if (rc == ENOEXEC) {
+        char *sh_argv[argv_count(argv) + 2];
+        script_argv(sh_argv, path, argv);
+        rc = posix_spawn(&pid, sh_argv[0], &actions, &attr, sh_argv, environ);
+        if (rc != 0) rc = ENOEXEC;
+    }
+    if (rc != 0) {
+        *err = rc;
+        pid = -1;
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return pid;
+}
+
+static pid_t launch_one(struct shell *sh, char **argv, const struct launch_opts *o) {
+    pid_t pid = -1;
+    int err = 0;
+    // Files are opened in the shell so errors are reported against the file
+    if (o->nredirs > 0 && open_redirs(sh, o) != 0) {
+        return -1;
+    }
+    //names with a slash are run as given, everything else goes through the cache
+    bool hashed = strchr(argv[0], '/') == NULL;
+
+    uint64_t t0 = stat_now();
+    //builtins outside the shell run in a forked copy of it, there is nothing to exec
+    if (hashed && builtin_lookup(argv[0]) != NULL) {
+        pid = launch_fork(sh, NULL, argv, o, &err);
+    } else {
+        for (int attempt = 0; attempt < 2; attempt++) {
+            const char *path = argv[0];
+            struct cmd_hash_entry *e = NULL;
+            if (hashed) {
+                e = cmd_hash_resolve(&sh->cmd_hash, argv[0]);
+                if (e == NULL) {
+                    fprintf(stderr, "%s: command not found\n", argv[0]);
+                    close_redirs(sh, o);
+                    return -1;
+                }
+                path = e->path;
+            }
+
+            if (sh->launch_backend == LAUNCH_SPAWN) {
+                pid = launch_spawn(sh, path, argv, o, &err);
+            } else {
+                pid = launch_fork(sh, path, argv, o, &err);
+            }
+
+            if (pid > 0) {
+                if (e != NULL) e->hits++;
+                break;
+            }
+            //the cached path went away, search PATH again once
+            if (e == NULL || err != ENOENT) break;
+            cmd_hash_forget(sh, argv[0]);
+        }
+    }
+    stat_record(sh, STAT_LAUNCH, stat_now() - t0);
+    close_redirs(sh, o);
+
+    if (pid > 0) {
+        // Set the group from the parent too so there is no race with the child
+        setpgid(pid, o->pgid ? o->pgid : pid);
+        if (o->foreground && sh->shell_is_interactive) {
+            t0 = stat_now();
+            tcsetpgrp(sh->shell_terminal, pid);
+            stat_record(sh, STAT_HANDOFF, stat_now() - t0);
+        }
+    } else {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    }
+    return pid;
+}
+
+pid_t launch_process(struct shell *sh, char **argv, bool foreground) {
+    struct launch_opts o = { .pgid = 0, .stdin_fd = -1, .stdout_fd = -1,
+                             .foreground = foreground, .redirs = NULL, .nredirs = 0,
+                             .redir_fds = NULL };
+    return launch_one(sh, argv, &o);
+}
+
+int set_shell_option(struct shell *sh, const char *option, bool on) {
+    if (option == NULL) return -1;
+    if (strcmp(option, "pipefail") == 0) {
+        sh->pipefail = on;
+        return 0;
+    }
+    if (strncmp(option, "pipesize", 8) == 0) {
+        //set +o pipesize goes back to the kernel default
+        if (!on) {
+            sh->pipe_size = 0;
+            return 0;
+        }
+        if (option[8] != '=') return -1;
+        char *end;
+        long size = strtol(option + 9, &end, 10);
+        if (*end != '\0' || size < 0 || size > INT_MAX) return -1;
+        sh->pipe_size = (int)size;
+        return 0;
+    }
+    return -1;
+}
+
+void print_shell_options(struct shell *sh) {
+    printf("pipefail\t%s\n", sh->pipefail ? "on" : "off");
+    if (sh->pipe_size > 0) {
+        printf("pipesize\t%d\n", sh->pipe_size);
+    } else {
+        printf("pipesize\tdefault\n");
+    }
+}
+
+static bool parse_redir_token(const char *tok, int *fd, enum redir_kind *kind) {
+    //matches the operator tokens the tokenizer produces
+    const char *p = tok;
+    int n = -1;
+    if (*p >= '0' && *p <= '9') {
+        n = *p - '0';
+        p++;
+    }
+    if (strcmp(p, "<") == 0) {
+        *kind = REDIR_IN;
+    } else if (strcmp(p, ">") == 0) {
+        *kind = REDIR_OUT;
+    } else if (strcmp(p, ">>") == 0) {
+        *kind = REDIR_APPEND;
+    } else if (strcmp(p, ">&") == 0) {
+        *kind = REDIR_DUP;
+    } else {
+        return false;
+    }
+    *fd = n >= 0 ? n : (*kind == REDIR_IN ? STDIN_FILENO : STDOUT_FILENO);
+    return true;
+}
+
+static int pipeline_add_redir(struct pipeline *pl, const struct redir *r) {
+    if (pl->nredirs == pl->redir_cap) {
+        int new_cap = pl->redir_cap * 2;
+        struct redir *redirs = malloc(new_cap * sizeof(struct redir));
+        if (redirs == NULL) {
+            perror("malloc failed");
+            return -1;
+        }
+        memcpy(redirs, pl->redirs, pl->nredirs * sizeof(struct redir));
+        if (pl->redirs != pl->inline_redirs) free(pl->redirs);
+        pl->redirs = redirs;
+        pl->redir_cap = new_cap;
+    }
+    pl->redirs[pl->nredirs++] = *r;
+    return 0;
+}
+
+static int pipeline_take_redirs(struct pipeline *pl, int stage) {
+    char **argv = pl->stages[stage];
+    int out = 0;
+    for (int i = 0; argv[i] != NULL; i++) {
+        struct redir r = { .stage = stage };
+        if (!parse_redir_token(argv[i], &r.fd, &r.kind)) {
+            argv[out++] = argv[i];
+            continue;
+        }
+        const char *target = argv[i + 1];
+        int tfd;
+        enum redir_kind tkind;
+        if (target == NULL || parse_redir_token(target, &tfd, &tkind)) {
+            fprintf(stderr, "syntax error near unexpected token `%s'\n",
+                    target ? target : "newline");
+            return -1;
+        }
+        r.target = target;
+        if (pipeline_add_redir(pl, &r) != 0) return -1;
+        i++;
+    }
+    argv[out] = NULL;
+    if (out == 0) {
+        fprintf(stderr, "syntax error: missing command\n");
+        return -1;
+    }
+    return 0;
+}
+
+void pipeline_init(struct pipeline *pl) {
+    pl->stages = pl->inline_stages;
+    pl->pids = pl->inline_pids;
+    pl->nstages = 0;
+    pl->cap = PIPELINE_INLINE_STAGES;
+    pl->redirs = pl->inline_redirs;
+    pl->nredirs = 0;
+    pl->redir_cap = PIPELINE_INLINE_REDIRS;
+}
+
+int pipeline_parse(char **argv, struct pipeline *pl) {
+    pipeline_init(pl);
+
+    char **stage = argv;
+    for (int i = 0; ; i++) {
+        bool end = argv[i] == NULL;
+        if (!end && strcmp(argv[i], "|") != 0) continue;
+        //every stage needs a command, "a | | b" and a trailing "|" are errors
+        if (&argv[i] == stage) {
+            fprintf(stderr, "syntax error near unexpected token `|'\n");
+            pipeline_free(pl);
+            return -1;
+        }
+        if (pl->nstages == pl->cap) {
+            int new_cap = pl->cap * 2;
+            char ***stages = malloc(new_cap * sizeof(char **));
+            pid_t *pids = malloc(new_cap * sizeof(pid_t));
+            if (stages == NULL || pids == NULL) {
+                perror("malloc failed");
+                free(stages);
+                free(pids);
+                pipeline_free(pl);
+                return -1;
+            }
+            memcpy(stages, pl->stages, pl->nstages * sizeof(char **));
+            if (pl->stages != pl->inline_stages) {
+                free(pl->stages);
+                free(pl->pids);
+            }
+            pl->stages = stages;
+            pl->pids = pids;
+            pl->cap = new_cap;
+        }
+        pl->stages[pl->nstages] = stage;
+        pl->pids[pl->nstages] = -1;
+        pl->nstages++;
+        if (end) break;
+        //cut the argv at the pipe so each stage is its own NULL terminated argv
+        argv[i] = NULL;
+        stage = &argv[i + 1];
+    }
+
+    for (int i = 0; i < pl->nstages; i++) {
+        if (pipeline_take_redirs(pl, i) != 0) {
+            pipeline_free(pl);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void pipeline_free(struct pipeline *pl) {
+    if (pl->stages != pl->inline_stages) {
+        free(pl->stages);
+        free(pl->pids);
+    }
+    if (pl->redirs != pl->inline_redirs) {
+        free(pl->redirs);
+    }
+    pl->stages = pl->inline_stages;
+    pl->pids = pl->inline_pids;
+    pl->cap = PIPELINE_INLINE_STAGES;
+    pl->redirs = pl->inline_redirs;
+    pl->redir_cap = PIPELINE_INLINE_REDIRS;
+}
+
+pid_t launch_pipeline(struct shell *sh, struct pipeline *pl, bool foreground) {
+    return launch_pipeline_group(sh, pl, 0, foreground);
+}
+
+pid_t launch_pipeline_group(struct shell *sh, struct pipeline *pl, pid_t pgid,
+                            bool foreground) {
+    int prev_read = -1;
+    int next_redir = 0;
+
+    //a buffered stdout (batch mode into a pipe) must not end up behind the children's output
+    fflush(stdout);
+    job_acct_start(&pl->acct);
+
+    for (int i = 0; i < pl->nstages; i++) {
+        int p[2] = { -1, -1 };
+        if (i < pl->nstages - 1) {
+            if (pipe2(p, O_CLOEXEC) == -1) {
+                perror("pipe2 failed");
+                if (prev_read >= 0) close(prev_read);
+                break;
+            }
+            if (sh->pipe_size > 0 && fcntl(p[1], F_SETPIPE_SZ, sh->pipe_size) == -1) {
+                // Over the pipe-max-size limit, keep the default buffer
+            }
+        }
+
+        // Redirections are kept in stage order
+        while (next_redir < pl->nredirs && pl->redirs[next_redir].stage < i) next_redir++;
+        int first_redir = next_redir;
+        while (next_redir < pl->nredirs && pl->redirs[next_redir].stage == i) next_redir++;
+        int nredirs = next_redir - first_redir;
+        int inline_fds[PIPELINE_INLINE_REDIRS];
+        int *redir_fds = nredirs > PIPELINE_INLINE_REDIRS ? malloc(nredirs * sizeof(int)) : inline_fds;
+        if (redir_fds == NULL) {
+            perror("malloc failed");
+            nredirs = 0;
+            redir_fds = inline_fds;
+        }
+
+        //the first stage that starts leads the group and takes the terminal
+        struct launch_opts o = { .pgid = pgid, .stdin_fd = prev_read, .stdout_fd = p[1],
+                                 .foreground = foreground && pgid == 0,
+                                 .redirs = pl->redirs + first_redir, .nredirs = nredirs,
+                                 .redir_fds = redir_fds };
+        pl->pids[i] = launch_one(sh, pl->stages[i], &o);
+        if (redir_fds != inline_fds) free(redir_fds);
+        if (pgid == 0 && pl->pids[i] > 0) {
+            pgid = pl->pids[i];
+        }
+
+        // The children hold their own copies now
+        if (prev_read >= 0) close(prev_read);
+        if (p[1] >= 0) close(p[1]);
+        prev_read = p[0];
+    }
+
+    pl->launched_ns = stat_now();
+    //a group that was joined says nothing about whether any stage started
+    bool started = false;
+    for (int i = 0; i < pl->nstages; i++) {
+        if (pl->pids[i] > 0) started = true;
+    }
+    return started ? pgid : -1;
+}
+
+int exit_code_from_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return 0;
+}
+
+static int pipeline_status(struct shell *sh, const int *codes, int n) {
+    //the last stage decides, with pipefail the rightmost failure does
+    if (sh->pipefail) {
+        for (int i = n - 1; i >= 0; i--) {
+            if (codes[i] != 0) return codes[i];
+        }
+        return 0;
+    }
+    return codes[n - 1];
+}
+
+int wait_pipeline(struct shell *sh, struct pipeline *pl) {
+    int inline_codes[PIPELINE_INLINE_STAGES];
+    int *codes = inline_codes;
+    if (pl->nstages > PIPELINE_INLINE_STAGES) {
+        codes = malloc(pl->nstages * sizeof(int));
+        if (codes == NULL) {
+            perror("malloc failed");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < pl->nstages; i++) {
+        // A stage that could not be started counts as command not found
+        codes[i] = 127;
+        if (pl->pids[i] <= 0) continue;
+        int status;
+        struct rusage ru;
+        pid_t r;
+        do {
+            r = wait4(pl->pids[i], &status, WUNTRACED, &ru);
+        } while (r == -1 && errno == EINTR);
+        if (r == -1) {
+            perror("wait4 failed");
+            continue;
+        }
+        codes[i] = exit_code_from_status(status);
+        job_acct_add(&pl->acct, &ru);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pl->acct.end);
+    stat_record(sh, STAT_EXEC, stat_now() - pl->launched_ns);
+
+    int rval = pipeline_status(sh, codes, pl->nstages);
+    if (codes != inline_codes) free(codes);
+    return rval;
+}
+
+#define JOB_EVENT_SIGCHLD (-1)
+
+static int sys_pidfd_open(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+int job_events_init(struct shell *sh) {
+    sh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (sh->epoll_fd == -1) {
+        perror("epoll_create1 failed");
+        return -1;
+    }
+
+    //probe for pidfd support on our own pid
+    int probe = sys_pidfd_open(getpid());
+    sh->use_pidfd = probe >= 0;
+    if (probe >= 0) {
+        close(probe);
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    //SIGCHLD has to be blocked for the signalfd to receive it
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+        perror("sigprocmask failed");
+        close(sh->epoll_fd);
+        return -1;
+    }
+    sh->sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sh->sigchld_fd == -1) {
+        perror("signalfd failed");
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        close(sh->epoll_fd);
+        return -1;
+    }
+    //with pidfds every job has its own event, SIGCHLD is only the fallback
+    if (!sh->use_pidfd) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uint64_t)(int64_t)JOB_EVENT_SIGCHLD };
+        if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->sigchld_fd, &ev) != 0) {
+            perror("epoll_ctl failed");
+            close(sh->sigchld_fd);
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+            close(sh->epoll_fd);
+            return -1;
+        }
+    }
+    sh->job_events = true;
+    return 0;
+}
+
+void job_events_destroy(struct shell *sh) {
+    if (!sh->job_events) return;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    close(sh->sigchld_fd);
+    close(sh->epoll_fd);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    sh->job_events = false;
+}
+
+static void job_watch(struct shell *sh, struct job_proc *proc) {
+    if (!sh->job_events || !sh->use_pidfd) return;
+    //our own child stays a zombie until we reap it, so the pid can't be reused here
+    proc->pidfd = sys_pidfd_open(proc->pid);
+    if (proc->pidfd == -1) return;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uint64_t)proc->pid };
+    if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, proc->pidfd, &ev) != 0) {
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+}
+
+static void job_unwatch(struct job_proc *proc) {
+    //closing the pidfd also drops it from the epoll set
+    if (proc->pidfd >= 0) {
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+}
+
+static int wait_status_from_siginfo(const siginfo_t *info) {
+    //rebuild the status word waitpid would have returned
+    switch (info->si_code) {
+        case CLD_EXITED:
+            return (info->si_status & 0xff) << 8;
+        case CLD_DUMPED:
+            return (info->si_status & 0x7f) | 0x80;
+        default:
+            return info->si_status & 0x7f;
+    }
+}
+
+static struct job_proc *job_find_proc(struct bg_job *job, pid_t pid) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].pid == pid) return &job->procs[i];
+    }
+    return NULL;
+}
+
+void job_acct_start(struct job_acct *acct) {
+    memset(acct, 0, sizeof(*acct));
+    clock_gettime(CLOCK_MONOTONIC, &acct->start);
+}
+
+void job_acct_add(struct job_acct *acct, const struct rusage *ru) {
+    timeradd(&acct->utime, &ru->ru_utime, &acct->utime);
+    timeradd(&acct->stime, &ru->ru_stime, &acct->stime);
+    //peak memory is per process, a pipeline's peak is its largest stage
+    if (ru->ru_maxrss > acct->maxrss_kb) {
+        acct->maxrss_kb = ru->ru_maxrss;
+    }
+}
+
+double timespec_seconds(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void job_proc_done(struct shell *sh, struct bg_job *job, struct job_proc *proc, int status,
+                          const struct rusage *ru) {
+    job_unwatch(proc);
+    if (proc->done) return;
+    proc->done = true;
+    proc->wait_status = status;
+    if (ru != NULL) {
+        job_acct_add(&job->acct, ru);
+    }
+    if (--job->nrunning > 0) return;
+    clock_gettime(CLOCK_MONOTONIC, &job->acct.end);
+
+    // Every stage has finished, the job status comes from the pipeline
+    int inline_codes[PIPELINE_INLINE_STAGES];
+    int *codes = job->nprocs > PIPELINE_INLINE_STAGES ?
+                 malloc(job->nprocs * sizeof(int)) : inline_codes;
+    int last = job->nprocs - 1;
+    job->wait_status = job->procs[last].wait_status;
+    if (codes != NULL) {
+        for (int i = 0; i < job->nprocs; i++) {
+            codes[i] = job->procs[i].pid > 0 ?
+                       exit_code_from_status(job->procs[i].wait_status) : 127;
+        }
+        job->exit_code = pipeline_status(sh, codes, job->nprocs);
+        if (codes != inline_codes) free(codes);
+    } else {
+        job->exit_code = exit_code_from_status(job->wait_status);
+    }
+    job->status = 1; // 1 for Done
+}
+
+static int job_index_home(struct shell *sh, pid_t pid) {
+    //multiplicative hash spreads sequential pids across the table
+    return (int)(((uint32_t)pid * 2654435761u) & (uint32_t)(sh->job_index_cap - 1));
+}
+
+static int job_index_resize(struct shell *sh, int new_cap);
+
+//make room for n more pids while keeping the index at most half full
+static int job_index_reserve(struct shell *sh, int n) {
+    int cap = sh->job_index_cap ? sh->job_index_cap : BG_JOBS_INITIAL_CAP * 2;
+    while ((sh->job_index_used + n) * 2 > cap) cap *= 2;
+    return cap == sh->job_index_cap ? 0 : job_index_resize(sh, cap);
+}
+
+static int job_index_put(struct shell *sh, pid_t pid, int slot) {
+    if (job_index_reserve(sh, 1) != 0) {
+        return -1;
+    }
+    int i = job_index_home(sh, pid);
+    while (sh->job_index[i].pid != 0 && sh->job_index[i].pid != pid) {
+        i = (i + 1) & (sh->job_index_cap - 1);
+    }
+    if (sh->job_index[i].pid == 0) sh->job_index_used++;
+    sh->job_index[i].pid = pid;
+    sh->job_index[i].slot = slot;
+    return 0;
+}
+
+static int job_index_find(struct shell *sh, pid_t pid) {
+    if (sh->job_index == NULL) return -1;
+    int i = job_index_home(sh, pid);
+    while (sh->job_index[i].pid != 0) {
+        if (sh->job_index[i].pid == pid) return i;
+        i = (i + 1) & (sh->job_index_cap - 1);
+    }
+    return -1;
+}
+
+static void job_index_remove(struct shell *sh, pid_t pid) {
+    int hole = job_index_find(sh, pid);
+    if (hole < 0) return;
+    int mask = sh->job_index_cap - 1;
+    sh->job_index[hole].pid = 0;
+    sh->job_index_used--;
+    //shift later entries of the probe run back so lookups never stop early
+    int i = (hole + 1) & mask;
+    while (sh->job_index[i].pid != 0) {
+        int home = job_index_home(sh, sh->job_index[i].pid);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            sh->job_index[hole] = sh->job_index[i];
+            sh->job_index[i].pid = 0;
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+static int job_index_resize(struct shell *sh, int new_cap) {
+    struct job_index_entry *old = sh->job_index;
+    int old_cap = sh->job_index_cap;
+    struct job_index_entry *index = calloc(new_cap, sizeof(struct job_index_entry));
+    if (index == NULL) {
+        perror("calloc failed");
+        return -1;
+    }
+    sh->job_index = index;
+    sh->job_index_cap = new_cap;
+    sh->job_index_used = 0;
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i].pid != 0) {
+            job_index_put(sh, old[i].pid, old[i].slot);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static int job_table_grow(struct shell *sh) {
+    int new_cap = sh->bg_job_cap ? sh->bg_job_cap * 2 : BG_JOBS_INITIAL_CAP;
+    struct bg_job *jobs = realloc(sh->bg_jobs, new_cap * sizeof(struct bg_job));
+    if (jobs == NULL) {
+        perror("realloc failed");
+        return -1;
+    }
+    sh->bg_jobs = jobs;
+    sh->bg_job_cap = new_cap;
+    return 0;
+}
+
+static struct bg_job *job_alloc(struct shell *sh) {
+    int slot;
+    if (sh->bg_job_free >= 0 && sh->bg_job_free < sh->bg_job_slots &&
+        !sh->bg_jobs[sh->bg_job_free].in_use) {
+        //reuse a reclaimed slot
+        slot = sh->bg_job_free;
+        sh->bg_job_free = sh->bg_jobs[slot].next_free;
+    } else {
+        if (sh->bg_job_slots == sh->bg_job_cap && job_table_grow(sh) != 0) {
+            return NULL;
+        }
+        slot = sh->bg_job_slots++;
+    }
+    struct bg_job *job = &sh->bg_jobs[slot];
+    memset(job, 0, sizeof(*job));
+    job->in_use = true;
+    sh->bg_job_count++;
+    return job;
+}
+
+static void job_release(struct shell *sh, struct bg_job *job) {
+    int slot = (int)(job - sh->bg_jobs);
+    for (int i = 0; i < job->nprocs; i++) {
+        job_unwatch(&job->procs[i]);
+        if (job->procs[i].pid > 0) {
+            job_index_remove(sh, job->procs[i].pid);
+        }
+    }
+    free(job->procs);
+    job->procs = NULL;
+    job->nprocs = 0;
+    free(job->command);
+    job->command = NULL;
+    job->in_use = false;
+    sh->bg_job_count--;
+    if (sh->bg_job_count == 0) {
+        //the table is empty, start over from the first slot and job 1
+        sh->bg_job_slots = 0;
+        sh->bg_job_free = -1;
+        sh->next_job_id = 1;
+        return;
+    }
+    job->next_free = sh->bg_job_free;
+    sh->bg_job_free = slot;
+}
+
+struct bg_job *find_job_by_pid(struct shell *sh, pid_t pid) {
+    int i = job_index_find(sh, pid);
+    return i < 0 ? NULL : &sh->bg_jobs[sh->job_index[i].slot];
+}
+
+struct bg_job *find_job_by_id(struct shell *sh, int job_id) {
+    for (int i = 0; i < sh->bg_job_slots; i++) {
+        if (sh->bg_jobs[i].in_use && sh->bg_jobs[i].job_id == job_id) {
+            return &sh->bg_jobs[i];
+        }
+    }
+    return NULL;
+}
+
+void set_max_jobs(struct shell *sh, int max) {
+    sh->bg_job_max = max > 0 ? max : MAX_BG_JOBS;
+}
+
+static void report_finished_jobs(struct shell *sh);
+
+int start_background_process(struct shell *sh, char **args, char *full_command) {
+    int max = sh->bg_job_max > 0 ? sh->bg_job_max : MAX_BG_JOBS;
+    if (sh->bg_job_count >= max) {
+        // Make room with finished jobs, the user is told about them first
+        report_finished_jobs(sh);
+    }
+    if (sh->bg_job_count >= max) {
+        fprintf(stderr, "Maximum number of background jobs reached\n");
+        return -1;
+    }
+
+    struct pipeline pl;
+    if (pipeline_parse(args, &pl) != 0) {
+        return -1;
+    }
+
+    char *command = strdup(full_command);
+    struct job_proc *procs = calloc(pl.nstages, sizeof(struct job_proc));
+    if (command == NULL || procs == NULL) {
+        perror("allocation failed");
+        free(command);
+        free(procs);
+        pipeline_free(&pl);
+        return -1;
+    }
+    //every pid must be indexed or the job is never reaped, so make room before starting any
+    struct bg_job *job = job_index_reserve(sh, pl.nstages) == 0 ? job_alloc(sh) : NULL;
+    if (job == NULL) {
+        free(command);
+        free(procs);
+        pipeline_free(&pl);
+        return -1;
+    }
+    job->command = command;
+    job->procs = procs;
+    job->nprocs = pl.nstages;
+    for (int i = 0; i < pl.nstages; i++) {
+        procs[i].pidfd = -1;
+    }
+
+    pid_t pgid = launch_pipeline(sh, &pl, false);
+    job->acct = pl.acct;
+
+    if (pgid == -1) {
+        job_release(sh, job);
+        pipeline_free(&pl);
+        return -1;
+    }
+
+    // Parent process
+    if (sh->next_job_id < 1) sh->next_job_id = 1;
+    job->job_id = sh->next_job_id++;
+    job->pid = pgid;
+    job->status = 0; // 0 for Running
+    int slot = (int)(job - sh->bg_jobs);
+    for (int i = 0; i < pl.nstages; i++) {
+        struct job_proc *proc = &job->procs[i];
+        proc->pid = pl.pids[i];
+        if (proc->pid <= 0) {
+            // This stage never started, it is done already
+            proc->done = true;
+            proc->wait_status = 127 << 8;
+            continue;
+        }
+        job->nrunning++;
+        if (job_index_put(sh, proc->pid, slot) != 0) {
+            //a job the shell can't track is stopped rather than left behind
+            kill(-pgid, SIGKILL);
+            for (int j = 0; j < pl.nstages; j++) {
+                if (pl.pids[j] > 0) waitpid(pl.pids[j], NULL, 0);
+            }
+            job_release(sh, job);
+            pipeline_free(&pl);
+            return -1;
+        }
+        job_watch(sh, proc);
+    }
+    pipeline_free(&pl);
+
+    printf("[%d] %d\n", job->job_id, pgid);
+
+    return 0;
+}
+
+static void report_finished_jobs(struct shell *sh) {
+    for (int i = 0; i < sh->bg_job_slots; i++) {
+        struct bg_job *job = &sh->bg_jobs[i];
+        if (job->in_use && job->status != 0) {
+            printf("[%d] Done    %s\n", job->job_id, job->command);
+            job_release(sh, job);
+        }
+    }
+}
+
+static int reap_children(struct shell *sh) {
+    // Signals coalesce, so reap every child that is ready
+    int finished = 0;
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        struct bg_job *job = find_job_by_pid(sh, pid);
+        struct job_proc *proc = job ? job_find_proc(job, pid) : NULL;
+        if (proc != NULL) {
+            job_proc_done(sh, job, proc, status, &ru);
+            finished += job->status != 0;
+        }
+    }
+    return finished;
+}
+
+int wait_for_jobs(struct shell *sh, int timeout_ms) {
+    if (!sh->job_events) return -1;
+
+    struct epoll_event events[32];
+    int n;
+    do {
+        n = epoll_wait(sh->epoll_fd, events, 32, timeout_ms);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) {
+        perror("epoll_wait failed");
+        return -1;
+    }
+
+    int finished = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t tag = (int64_t)events[i].data.u64;
+        if (tag == JOB_EVENT_SIGCHLD) {
+            // Drain the signalfd, then fall back to waitpid
+            struct signalfd_siginfo info[16];
+            while (read(sh->sigchld_fd, info, sizeof(info)) > 0)
+                ;
+            finished += reap_children(sh);
+            continue;
+        }
+        struct bg_job *job = find_job_by_pid(sh, (pid_t)tag);
+        struct job_proc *proc = job ? job_find_proc(job, (pid_t)tag) : NULL;
+        if (proc == NULL || proc->pidfd < 0) continue;
+        siginfo_t info = {0};
+        struct rusage ru;
+        //the raw waitid takes a rusage like wait4, the libc wrapper drops it
+        if (syscall(SYS_waitid, P_PIDFD, proc->pidfd, &info, WEXITED | WNOHANG, &ru) == 0 &&
+            info.si_pid != 0) {
+            job_proc_done(sh, job, proc, wait_status_from_siginfo(&info), &ru);
+            finished += job->status != 0;
+        }
+    }
+    return finished;
+}
+
+void check_background_processes(struct shell *sh) {
+    if (!sh->job_events) {
+        // No event set, poll the jobs that are still running
+        for (int i = 0; i < sh->bg_job_slots; i++) {
+            struct bg_job *job = &sh->bg_jobs[i];
+            if (!job->in_use || job->status != 0) continue;
+            for (int j = 0; j < job->nprocs; j++) {
+                struct job_proc *proc = &job->procs[j];
+                if (proc->done) continue;
+                int status;
+                struct rusage ru;
+                pid_t result = wait4(proc->pid, &status, WNOHANG, &ru);
+
+                if (result > 0) {
+                    // Process has finished
+                    job_proc_done(sh, job, proc, status, &ru);
+                }
+            }
+        }
+    } else {
+        // Only jobs that actually finished show up in the event set
+        wait_for_jobs(sh, 0);
+    }
+
+    if (sh->shell_is_interactive) {
+        report_finished_jobs(sh);
+    }
+}
+
+static char *readline_result;
+static bool readline_done;
+
+static void readline_handler(char *line) {
+    readline_result = line;
+    readline_done = true;
+    //remove the handler so readline doesn't print the prompt again
+    rl_callback_handler_remove();
+}
+
+char *sh_readline(struct shell *sh, const char *prompt) {
+    if (!sh->job_events && sh->prompt_fd < 0) {
+        return readline(prompt);
+    }
+
+    readline_result = NULL;
+    readline_done = false;
+    rl_callback_handler_install(prompt, readline_handler);
+
+    //poll skips negative descriptors, so missing event sources just drop out
+    struct pollfd fds[3] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = sh->job_events ? sh->epoll_fd : -1, .events = POLLIN },
+        { .fd = sh->prompt_fd, .events = POLLIN },
+    };
+    while (!readline_done) {
+        if (poll(fds, 3, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            rl_callback_handler_remove();
+            return NULL;
+        }
+        if (fds[1].revents & POLLIN) {
+            // Jobs are reaped as they finish and reported at the next prompt
+            wait_for_jobs(sh, 0);
+        }
+        if ((fds[2].revents & POLLIN) && sh_prompt_refresh(sh)) {
+            // A slow prompt segment is ready, redraw the prompt in place
+            rl_clear_visible_line();
+            rl_set_prompt(sh_prompt(sh));
+            rl_forced_update_display();
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            rl_callback_read_char();
+        }
+    }
+    return readline_result;
+}
+
+static int line_reader_map(struct line_reader *lr, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        lseek(fd, 0, SEEK_CUR) != 0) {
+        return -1;
+    }
+    //private pages so lines can be split in place without touching the file
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    lr->buf = map;
+    lr->len = st.st_size;
+    lr->mapped = true;
+    lr->eof = true;
+    return 0;
+}
+
+int line_reader_open_fd(struct line_reader *lr, int fd) {
+    memset(lr, 0, sizeof(*lr));
+    lr->fd = -1;
+    if (line_reader_map(lr, fd) == 0) {
+        return 0;
+    }
+
+    lr->buf = malloc(LINE_READER_CHUNK);
+    if (lr->buf == NULL) {
+        return -1;
+    }
+    lr->cap = LINE_READER_CHUNK;
+    lr->fd = fd;
+    return 0;
+}
+
+int line_reader_open_file(struct line_reader *lr, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (line_reader_open_fd(lr, fd) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    if (lr->mapped) {
+        //the mapping stays valid after the descriptor is gone
+        close(fd);
+    } else {
+        lr->own_fd = true;
+    }
+    return 0;
+}
+
+int line_reader_open_string(struct line_reader *lr, const char *str) {
+    memset(lr, 0, sizeof(*lr));
+    lr->fd = -1;
+    size_t n = strlen(str);
+    lr->buf = malloc(n + 1);
+    if (lr->buf == NULL) {
+        return -1;
+    }
+    memcpy(lr->buf, str, n + 1);
+    lr->len = n;
+    lr->cap = n + 1;
+    lr->eof = true;
+    return 0;
+}
+
+char *line_reader_next(struct line_reader *lr) {
+    for (;;) {
+        char *start = lr->buf + lr->pos;
+        size_t avail = lr->len - lr->pos;
+        char *nl = avail > 0 ? memchr(start, '\n', avail) : NULL;
+        if (nl != NULL) {
+            *nl = '\0';
+            lr->pos = nl - lr->buf + 1;
+            return start;
+        }
+
+        if (lr->eof) {
+            if (avail == 0) {
+                return NULL;
+            }
+            lr->pos = lr->len;
+            if (lr->len < lr->cap) {
+                start[avail] = '\0';
+                return start;
+            }
+            //a mapping has no room after its last byte, copy the unterminated line out
+            free(lr->tail);
+            lr->tail = strndup(start, avail);
+            return lr->tail;
+        }
+
+        //keep the partial line at the front and read behind it
+        if (lr->pos > 0) {
+            memmove(lr->buf, start, avail);
+            lr->len = avail;
+            lr->pos = 0;
+        }
+        if (lr->len == lr->cap) {
+            char *grown = realloc(lr->buf, lr->cap * 2);
+            if (grown == NULL) {
+                perror("realloc failed");
+                lr->eof = true;
+                continue;
+            }
+            lr->buf = grown;
+            lr->cap *= 2;
+        }
+
+        ssize_t n = read(lr->fd, lr->buf + lr->len, lr->cap - lr->len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("read failed");
+            lr->eof = true;
+        } else if (n == 0) {
+            lr->eof = true;
+        } else {
+            lr->len += n;
+        }
+    }
+}
+
+void line_reader_close(struct line_reader *lr) {
+    if (lr->mapped) {
+        munmap(lr->buf, lr->len);
+    } else {
+        free(lr->buf);
+    }
+    free(lr->tail);
+    if (lr->own_fd) {
+        close(lr->fd);
+    }
+    memset(lr, 0, sizeof(*lr));
+    lr->fd = -1;
+}
+
+void sh_init(struct shell *sh) {
+    sh->shell_terminal = STDIN_FILENO;
+    //batch mode never takes the terminal, even when stdin is one
+    sh->shell_is_interactive = !sh->batch && isatty(sh->shell_terminal);
+
+    if (sh->shell_is_interactive) {
+        // Loop until we are in the foreground
+        while (tcgetpgrp(sh->shell_terminal) != (sh->shell_pgid = getpgrp()))
+            kill(-sh->shell_pgid, SIGTTIN);
+
+        // Ignore interactive and job-control signals
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        // Put ourselves in our own process group
+        sh->shell_pgid = getpid();
+        if (setpgid(sh->shell_pgid, sh->shell_pgid) < 0) {
+            perror("Couldn't put the shell in its own process group");
+            exit(1);
+        }
+
+        // Grab control of the terminal
+        tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+
+        // Save default terminal attributes for shell
+        tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
+    }
+
+    sh->bg_jobs = NULL;
+    sh->bg_job_cap = 0;
+    sh->bg_job_slots = 0;
+    sh->bg_job_count = 0;
+    sh->bg_job_free = -1;
+    sh->job_index = NULL;
+    sh->job_index_cap = 0;
+    sh->job_index_used = 0;
+    sh->next_job_id = 1; // Initialize next_job_id
+    // The job limit can be raised or lowered with MY_MAX_JOBS
+    const char *max_jobs = getenv("MY_MAX_JOBS");
+    set_max_jobs(sh, max_jobs ? atoi(max_jobs) : 0);
+    job_events_init(sh);
+    // Pick the launch backend, posix_spawn unless MY_LAUNCH asks for fork
+    sh->launch_backend = LAUNCH_SPAWN;
+    const char *backend = getenv("MY_LAUNCH");
+    if (backend != NULL && set_launch_backend(sh, backend) != 0) {
+        fprintf(stderr, "Unknown launch backend %s, using spawn\n", backend);
+    }
+    arena_init(&sh->arena);
+    //rendered on first use, batch mode never needs it
+    sh->prompt = NULL;
+    sh->devnull_fd = -1;
+    sh->prompt_fd = -1;
+}
+
+void sh_destroy(struct shell *sh) {
+    if (sh->prompt_fd >= 0) {
+        prompt_async_destroy(sh);
+    }
+    if (sh->prompt) {
+        free(sh->prompt);
+    }
+    arena_destroy(&sh->arena);
+    cmd_hash_destroy(sh);
+    if (sh->devnull_fd >= 0) {
+        close(sh->devnull_fd);
+        sh->devnull_fd = -1;
+    }
+    job_events_destroy(sh);
+    //free command strings for each background job
+    for (int i = 0; i < sh->bg_job_slots; i++) {
+        if (sh->bg_jobs[i].in_use) {
+            for (int j = 0; j < sh->bg_jobs[i].nprocs; j++) {
+                job_unwatch(&sh->bg_jobs[i].procs[j]);
+            }
+            free(sh->bg_jobs[i].procs);
+            free(sh->bg_jobs[i].command);
+        }
+    }
+    free(sh->bg_jobs);
+    free(sh->job_index);
+    sh->bg_jobs = NULL;
+    sh->job_index = NULL;
+    sh->bg_job_cap = sh->bg_job_slots = sh->bg_job_count = 0;
+    sh->job_index_cap = sh->job_index_used = 0;
+}
+
+static int compare_job_id(const void *a, const void *b) {
+    const struct bg_job *ja = *(const struct bg_job *const *)a;
+    const struct bg_job *jb = *(const struct bg_job *const *)b;
+    return (ja->job_id > jb->job_id) - (ja->job_id < jb->job_id);
+}
+
+static void jobs_print(struct shell *sh, bool long_format) {
+    if (sh->bg_job_count == 0) return;
+    //recycled slots are not in job order, sort before printing
+    struct bg_job **order = malloc(sh->bg_job_count * sizeof(struct bg_job *));
+    if (order == NULL) {
+        perror("malloc failed");
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < sh->bg_job_slots; i++) {
+        if (sh->bg_jobs[i].in_use) {
+            order[n++] = &sh->bg_jobs[i];
+        }
+    }
+    qsort(order, n, sizeof(struct bg_job *), compare_job_id);
+
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    for (int i = 0; i < n; i++) {
+        struct bg_job *job = order[i];
+        //determine status
+        const char *status = (job->status == 0) ? "Running" : "Done   ";
+        if (!long_format) {
+            outbuf_printf(&ob, "[%d] %d %s %s\n", job->job_id, job->pid, status, job->command);
+            continue;
+        }
+        //a running job has used no CPU we know of yet, only time
+        const struct job_acct *a = &job->acct;
+        if (job->status == 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            outbuf_printf(&ob, "[%d] %d %s real %.3fs user - sys - rss - %s\n", job->job_id,
+                          job->pid, status, timespec_seconds(&a->start, &now), job->command);
+        } else {
+            outbuf_printf(&ob, "[%d] %d %s real %.3fs user %ld.%03lds sys %ld.%03lds rss %ldk %s\n",
+                          job->job_id, job->pid, status, timespec_seconds(&a->start, &a->end),
+                          (long)a->utime.tv_sec, (long)a->utime.tv_usec / 1000,
+                          (long)a->stime.tv_sec, (long)a->stime.tv_usec / 1000,
+                          a->maxrss_kb, job->command);
+        }
+    }
+    outbuf_flush(&ob);
+    //done jobs have now been reported and their slots can be reused
+    for (int i = 0; i < n; i++) {
+        if (order[i]->status != 0) {
+            job_release(sh, order[i]);
+        }
+    }
+    free(order);
+}
+
+void print_jobs(struct shell *sh) {
+    jobs_print(sh, false);
+}
+
+void print_jobs_long(struct shell *sh) {
+    jobs_print(sh, true);
+}
@@ -2,8 +2,11 @@
 #define LAB_H
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <linux/limits.h>
@@ -11,33 +14,371 @@
 #define lab_VERSION_MAJOR 1
 #define lab_VERSION_MINOR 0
 #define UNUSED(x) (void)x;
-#define MAX_BG_JOBS 100
+#define MAX_BG_JOBS 1024
+#define BG_JOBS_INITIAL_CAP 16
+#define ARGV_BUILDER_INITIAL_CAP 8
+#define ARGV_BUILDER_FALLBACK_LIMIT (128 * 1024)
+#define ARENA_BLOCK_SIZE 4096
+#define CMD_HASH_INITIAL_BUCKETS 64
+#define PIPELINE_INLINE_STAGES 8
+#define PIPELINE_INLINE_REDIRS 4
+#define LINE_READER_CHUNK (64 * 1024)
+#define HISTORY_LOAD_RECENT 1000
+#define SUGGEST_HALF_LIFE 200
+#define OUTBUF_CHUNK (64 * 1024)
+#define PROMPT_VCS_CACHE 32
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+  /**
+   * @brief What a job or command cost. start and end come from
+   * CLOCK_MONOTONIC, end being when the shell reaped the last process. The
+   * CPU times and peak memory come from wait4 and are summed (CPU) or
+   * maximized (memory) over every process of a pipeline.
+   */
+  struct job_acct {
+    struct timespec start;
+    struct timespec end;
+    struct timeval utime;
+    struct timeval stime;
+    long maxrss_kb;
+  };
+
+  /**
+   * @brief The stages of handling a command line that the shell times.
+   */
+  enum stat_stage {
+    STAT_PROMPT,
+    STAT_READLINE,
+    STAT_TRIM,
+    STAT_PARSE,
+    STAT_BUILTIN,
+    STAT_LAUNCH,
+    STAT_EXEC,
+    STAT_HANDOFF,
+    STAT_COUNT
+  };
+
+#define STAT_SUB_BITS 4
+#define STAT_BUCKETS ((64 - STAT_SUB_BITS + 1) << STAT_SUB_BITS)
+
+  /**
+   * @brief A log-linear latency histogram in nanoseconds. Each power of two
+   * is split into 2^STAT_SUB_BITS buckets, so any value is counted to
+   * within about 6% and every 64 bit duration has a bucket.
+   */
+  struct stat_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint32_t buckets[STAT_BUCKETS];
+  };
+
+  struct job_proc {
+    pid_t pid;
+    int pidfd;
+    int wait_status;
+    bool done;
+  };
+
   struct bg_job {
     int job_id;
     pid_t pid;
     char *command;
     int status;
+    int wait_status;
+    int exit_code;
+    bool in_use;
+    int next_free;
+    struct job_proc *procs;
+    int nprocs;
+    int nrunning;
+    struct job_acct acct;
+  };
+
+  struct job_index_entry {
+    pid_t pid;
+    int slot;
+  };
+
+  /**
+   * @brief How the shell starts external commands. LAUNCH_SPAWN uses
+   * posix_spawn, which glibc implements with clone(CLONE_VM|CLONE_VFORK) so
+   * the shell's page tables are never copied. LAUNCH_FORK is the classic
+   * fork and exec path and is kept as a fallback.
+   */
+  enum launch_backend {
+    LAUNCH_SPAWN,
+    LAUNCH_FORK
+  };
+
+  struct cmd_hash_entry {
+    char *name;
+    char *path;
+    unsigned hits;
+    bool pinned;
+    struct cmd_hash_entry *next;
+  };
+
+  /**
+   * @brief Cache of command names resolved against PATH. The table is keyed
+   * by command name and remembers the PATH it was built from so it can be
+   * dropped as soon as PATH changes.
+   */
+  struct cmd_hash {
+    struct cmd_hash_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    char *path_env;
+  };
+
+  enum redir_kind {
+    REDIR_IN,
+    REDIR_OUT,
+    REDIR_APPEND,
+    REDIR_DUP
+  };
+
+  /**
+   * @brief One redirection of a pipeline stage, such as "2>>log" or "2>&1".
+   * For REDIR_DUP the target is the number of the descriptor to copy.
+   */
+  struct redir {
+    int stage;
+    int fd;
+    enum redir_kind kind;
+    const char *target;
+  };
+
+  /**
+   * @brief A command line split at its pipes. Each stage is a NULL
+   * terminated argv pointing into the parsed line, with its redirections
+   * moved out into redirs in stage order. Short pipelines use the inline
+   * arrays so they need no allocation, which also means a pipeline must not
+   * be copied by value.
+   */
+  struct pipeline {
+    char ***stages;
+    pid_t *pids;
+    int nstages;
+    int cap;
+    struct redir *redirs;
+    int nredirs;
+    int redir_cap;
+    char **inline_stages[PIPELINE_INLINE_STAGES];
+    pid_t inline_pids[PIPELINE_INLINE_STAGES];
+    struct redir inline_redirs[PIPELINE_INLINE_REDIRS];
+    struct job_acct acct;
+    uint64_t launched_ns;
+  };
+
+  struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+  };
+
+  /**
+   * @brief Bump pointer allocator for memory that only lives as long as one
+   * command line. Allocations are never freed individually, arena_reset
+   * rewinds the whole arena and keeps its blocks for the next line so the
+   * steady state does no malloc calls at all.
+   */
+  struct arena {
+    struct arena_block *head;
+    struct arena_block *current;
+  };
+
+  /**
+   * @brief Growable argv array. Starts with room for a handful of arguments
+   * and doubles only when a line actually has more tokens. The ARG_MAX
+   * limit is enforced on the total byte size of the arguments (strings plus
+   * pointer slots) the same way the kernel counts it for execve.
+   */
+  struct argv_builder {
+    char **argv;
+    size_t argc;
+    size_t cap;
+    size_t bytes;
+    size_t byte_limit;
+    struct arena *arena;
   };
 
+  /**
+   * @brief Line source for batch mode. Script files are mapped whole,
+   * anything else is read in LINE_READER_CHUNK sized blocks, and lines are
+   * split in place so reading a line costs no copy and no syscall beyond
+   * the occasional read.
+   */
+  struct line_reader {
+    char *buf;
+    size_t len;
+    size_t pos;
+    size_t cap;
+    int fd;
+    bool own_fd;
+    bool mapped;
+    bool eof;
+    char *tail;
+  };
+
+  /**
+   * @brief A script tokenized into a flat image, either mapped from the
+   * script cache or built in memory. body holds nlines records of argc, a
+   * flags byte, the command text for background lines and then the tokens,
+   * all NUL terminated.
+   */
+  struct script_image {
+    char *data;
+    size_t size;
+    size_t cap;
+    const char *body;
+    size_t body_size;
+    uint32_t nlines;
+    uint32_t line;
+    size_t pos;
+    bool mapped;
+    bool from_cache;
+  };
+
+  /**
+   * @brief Output buffer for builtins that print many lines. Lines are
+   * formatted into buf and written OUTBUF_CHUNK bytes at a time, so a long
+   * listing costs one write per chunk instead of one per line.
+   */
+  struct outbuf {
+    int fd;
+    int error;
+    size_t len;
+    char buf[OUTBUF_CHUNK];
+  };
+
+  /**
+   * @brief Initializer for a shell that has not been through sh_init: no
+   * descriptors open and every other field zero.
+   */
+#define SHELL_INITIALIZER { .devnull_fd = -1, .prompt_fd = -1 }
+
   struct shell
   {
     int shell_is_interactive;
+    bool batch;
     pid_t shell_pgid;
     struct termios shell_tmodes;
     int shell_terminal;
     char *prompt;
-    struct bg_job bg_jobs[MAX_BG_JOBS];
+    unsigned prompt_uses;
+    int prompt_status;
+    int prompt_jobs;
+    int prompt_fd;
+    enum launch_backend launch_backend;
+    struct cmd_hash cmd_hash;
+    bool pipefail;
+    int pipe_size;
+    int devnull_fd;
+    int last_status;
+    bool exit_requested;
+    struct arena arena;
+    struct bg_job *bg_jobs;
+    int bg_job_cap;
+    int bg_job_slots;
     int bg_job_count;
+    int bg_job_max;
+    int bg_job_free;
+    struct job_index_entry *job_index;
+    int job_index_cap;
+    int job_index_used;
     int next_job_id;
+    bool job_events;
+    bool use_pidfd;
+    int sigchld_fd;
+    int epoll_fd;
+    struct stat_hist stats[STAT_COUNT];
   };
 
 
+  /**
+   * @brief Initialize an empty arena. No memory is allocated until the first
+   * call to arena_alloc.
+   *
+   * @param a The arena
+   */
+  void arena_init(struct arena *a);
+
+  /**
+   * @brief Allocate memory from the arena. The memory is suitably aligned for
+   * any type and is valid until the next arena_reset or arena_destroy.
+   *
+   * @param a The arena
+   * @param size The number of bytes to allocate
+   * @return void* The memory, or NULL on failure
+   */
+  void *arena_alloc(struct arena *a, size_t size);
+
+  /**
+   * @brief Copy a string into the arena.
+   *
+   * @param a The arena
+   * @param str The string to copy
+   * @return char* The copy, or NULL on failure
+   */
+  char *arena_strdup(struct arena *a, const char *str);
+
+  /**
+   * @brief Release every allocation made from the arena at once. The blocks
+   * are kept for reuse.
+   *
+   * @param a The arena
+   */
+  void arena_reset(struct arena *a);
+
+  /**
+   * @brief Free all blocks owned by the arena.
+   *
+   * @param a The arena
+   */
+  void arena_destroy(struct arena *a);
+
+  /**
+   * @brief Start buffered output to a file descriptor. stdout is flushed so
+   * the buffered output comes after anything already printed.
+   *
+   * @param ob The buffer
+   * @param fd Where the output goes
+   */
+  void outbuf_init(struct outbuf *ob, int fd);
+
+  /**
+   * @brief Append formatted text, writing out the buffer when it is full.
+   *
+   * @param ob The buffer
+   * @param fmt printf style format
+   */
+  void outbuf_printf(struct outbuf *ob, const char *fmt, ...)
+      __attribute__((format(printf, 2, 3)));
+
+  /**
+   * @brief Append raw bytes, writing out the buffer when it is full.
+   *
+   * @param ob The buffer
+   * @param data The bytes
+   * @param len Number of bytes
+   */
+  void outbuf_write(struct outbuf *ob, const char *data, size_t len);
+
+  /**
+   * @brief Write out whatever is buffered. After a write error (for example
+   * EPIPE when the reader has gone) further output is dropped.
+   *
+   * @param ob The buffer
+   * @return int 0 on success, -1 once a write has failed
+   */
+  int outbuf_flush(struct outbuf *ob);
+
   /**
    * @brief Set the shell prompt. This function will attempt to load a prompt
    * from the requested environment variable, if the environment variable is
@@ -49,6 +390,16 @@ extern "C"
    */
   char *get_prompt(const char *env);
 
+  /**
+   * @brief Same as get_prompt but the prompt is allocated from the arena
+   * instead of with malloc, so the caller does not free it.
+   *
+   * @param a The arena to allocate from
+   * @param env The environment variable
+   * @return char* The prompt
+   */
+  char *get_prompt_arena(struct arena *a, const char *env);
+
 
  /**
    * @brief Set a new shell prompt. This function updates the MY_PROMPT
@@ -60,6 +411,62 @@ extern "C"
    */
   int set_prompt(const char *new_prompt);
 
+  /**
+   * @brief Get the prompt to show, rendered from MY_PROMPT with its escapes
+   * expanded: \w \W \u \h \? \j \$ \n \e \\ \[ \] and \g for the VCS
+   * branch. The prompt is cached in sh->prompt and rendered again only when
+   * the last status or job count it shows has changed, after
+   * sh_prompt_invalidate, or when a new VCS result arrived.
+   *
+   * @param sh The shell
+   * @return const char* The prompt, owned by the shell
+   */
+  const char *sh_prompt(struct shell *sh);
+
+  /**
+   * @brief Drop the rendered prompt after something it depends on changed,
+   * such as MY_PROMPT or the working directory. The next sh_prompt call
+   * renders it again.
+   *
+   * @param sh The shell
+   */
+  void sh_prompt_invalidate(struct shell *sh);
+
+  /**
+   * @brief Start the worker thread that finds VCS branches for \g. Until
+   * it runs the branch is looked up inline while rendering. Results show up
+   * on sh->prompt_fd.
+   *
+   * @param sh The shell
+   * @return int 0 on success, -1 if the worker could not be started
+   */
+  int prompt_async_init(struct shell *sh);
+
+  /**
+   * @brief Stop the VCS worker and drop its cached results.
+   *
+   * @param sh The shell
+   */
+  void prompt_async_destroy(struct shell *sh);
+
+  /**
+   * @brief Take a result from the VCS worker after sh->prompt_fd became
+   * readable.
+   *
+   * @param sh The shell
+   * @return bool true when the prompt changed and has to be redrawn
+   */
+  bool sh_prompt_refresh(struct shell *sh);
+
+  /**
+   * @brief Find the branch checked out in the git repository containing dir.
+   *
+   * @param dir An absolute directory
+   * @return char* The branch, or a short commit when detached, allocated
+   * with malloc. NULL outside a repository.
+   */
+  char *prompt_vcs_branch(const char *dir);
+
   /**
    * Changes the current working directory of the shell. Uses the linux system
    * call chdir. With no arguments the users home directory is used as the
@@ -71,11 +478,58 @@ extern "C"
    */
   int change_dir(char **dir);
 
+  /**
+   * @brief Initialize an empty argv builder. The byte limit is loaded from
+   * sysconf(_SC_ARG_MAX).
+   *
+   * @param ab The builder to initialize
+   * @return int Returns 0 on success, -1 on failure
+   */
+  int argv_builder_init(struct argv_builder *ab);
+
+  /**
+   * @brief Initialize an argv builder that takes its memory from an arena.
+   * The array does not need to be freed, it is reclaimed with the arena.
+   *
+   * @param ab The builder to initialize
+   * @param a The arena to allocate from
+   * @return int Returns 0 on success, -1 on failure
+   */
+  int argv_builder_init_arena(struct argv_builder *ab, struct arena *a);
+
+  /**
+   * @brief Append an argument to the builder, growing the array as needed.
+   * The builder does not copy the string, it only stores the pointer.
+   *
+   * @param ab The builder
+   * @param arg The argument to append
+   * @return int Returns 0 on success, -1 on failure. errno is set to E2BIG
+   * if adding the argument would exceed ARG_MAX
+   */
+  int argv_builder_push(struct argv_builder *ab, char *arg);
+
+  /**
+   * @brief Hand the NULL terminated argv array over to the caller. The
+   * builder is left empty and the caller owns the returned array.
+   *
+   * @param ab The builder
+   * @return char** The argv array
+   */
+  char **argv_builder_finish(struct argv_builder *ab);
+
+  /**
+   * @brief Release the array held by the builder. The argument strings are
+   * not freed.
+   *
+   * @param ab The builder
+   */
+  void argv_builder_destroy(struct argv_builder *ab);
+
   /**
    * @brief Convert line read from the user into to format that will work with
-   * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
-   * This function allocates memory that must be reclaimed with the cmd_free
-   * function.
+   * execvp. The total size of the arguments is limited to ARG_MAX loaded from
+   * sysconf. This function allocates memory that must be reclaimed with the
+   * cmd_free function.
    *
    * @param line The line to process
    *
@@ -90,6 +544,36 @@ extern "C"
    */
   void cmd_free(char ** line);
 
+  /**
+   * @brief Tokenize a line in place. Whitespace in the line is overwritten
+   * with terminators and the returned argv points into the line, so the only
+   * allocation is the argv array itself. The line must stay alive and
+   * unmodified for as long as the result is used. Free the result with
+   * cmd_free_inplace.
+   *
+   * @param line The line to tokenize, modified by this call
+   * @return char** The NULL terminated argv, or NULL on failure
+   */
+  char **cmd_parse_inplace(char *line);
+
+  /**
+   * @brief Free an argv constructed with cmd_parse_inplace. The line the
+   * tokens point into is not freed.
+   *
+   * @param argv The argv to free
+   */
+  void cmd_free_inplace(char **argv);
+
+  /**
+   * @brief Tokenize a line in place like cmd_parse_inplace, with the argv
+   * array allocated from the arena. Nothing needs to be freed.
+   *
+   * @param a The arena to allocate from
+   * @param line The line to tokenize, modified by this call
+   * @return char** The NULL terminated argv, or NULL on failure
+   */
+  char **cmd_parse_arena(struct arena *a, char *line);
+
   /**
    * @brief Trim the whitespace from the start and end of a string.
    * For example "   ls -a   " becomes "ls -a". This function modifies
@@ -102,12 +586,52 @@ extern "C"
   char *trim_white(char *line);
 
 
+  /**
+   * @brief A built in command. It runs inside the shell process with the
+   * full argument list, argv[0] included.
+   *
+   * @return The exit status of the command
+   */
+  typedef int (*builtin_fn)(struct shell *sh, char **argv);
+
+  /**
+   * @brief A prefix builtin such as time takes the rest of the line as its
+   * command, pipes and redirections included.
+   */
+  struct builtin
+  {
+    const char *name;
+    builtin_fn fn;
+    bool prefix;
+  };
+
+  /**
+   * @brief Find the built in command called name. Assignments such as
+   * MY_PROMPT=value are found by the name up to and including the '='.
+   * The lookup is a switch on the length and first character of the name
+   * and one string compare, so it costs the same for any number of
+   * builtins.
+   *
+   * @param name The command name
+   * @return The builtin, or NULL if name is not one
+   */
+  const struct builtin *builtin_lookup(const char *name);
+
+  /**
+   * @brief Get the table of every built in command.
+   *
+   * @param count Set to the number of entries
+   * @return The first entry of the table
+   */
+  const struct builtin *builtin_list(size_t *count);
+
   /**
    * @brief Takes an argument list and checks if the first argument is a
    * built in command such as exit, cd, jobs, etc. If the command is a
-   * built in command this function will handle the command and then return
-   * true. If the first argument is NOT a built in command this function will
-   * return false.
+   * built in command this function will handle the command, store its
+   * status in sh->last_status and then return true. The exit builtin sets
+   * sh->exit_requested instead of exiting. If the first argument is NOT a
+   * built in command this function will return false.
    *
    * @param sh The shell
    * @param argv The command to check
@@ -115,6 +639,78 @@ extern "C"
    */
   bool do_builtin(struct shell *sh, char **argv);
 
+  /**
+   * @brief The parallel builtin: parallel [-j N] [-k] [-a FILE] COMMAND
+   * [ARG...] [::: INPUT...]. Runs COMMAND once per input with at most N
+   * children at a time, N defaulting to the number of online CPUs. In the
+   * command, {} is replaced by the input and {#} by the task number; with
+   * no {} the input is added as the last argument. Inputs are the words
+   * after :::, the lines of FILE, or the lines of stdin. Each task's output
+   * is collected and written when it finishes, in input order with -k.
+   *
+   * @param sh The shell
+   * @param argv The builtin's arguments, argv[0] included
+   * @return int The number of tasks that failed, at most 101
+   */
+  int builtin_parallel(struct shell *sh, char **argv);
+
+  /**
+   * @brief The current CLOCK_MONOTONIC time in nanoseconds, the clock every
+   * stage timing uses.
+   *
+   * @return uint64_t The time
+   */
+  uint64_t stat_now(void);
+
+  /**
+   * @brief Count one duration of a stage in the shell's histogram for it.
+   *
+   * @param sh The shell
+   * @param stage The stage
+   * @param ns How long it took in nanoseconds
+   */
+  void stat_record(struct shell *sh, enum stat_stage stage, uint64_t ns);
+
+  /**
+   * @brief The histogram bucket a duration is counted in.
+   *
+   * @param ns The duration in nanoseconds
+   * @return int The bucket, less than STAT_BUCKETS
+   */
+  int stat_bucket(uint64_t ns);
+
+  /**
+   * @brief The largest duration counted in a bucket.
+   *
+   * @param bucket The bucket
+   * @return uint64_t The duration in nanoseconds
+   */
+  uint64_t stat_bucket_max(int bucket);
+
+  /**
+   * @brief The duration that p percent of a histogram's samples are at or
+   * below, to the precision of its buckets and never above the maximum.
+   *
+   * @param h The histogram
+   * @param p The percentile, 0 to 100
+   * @return uint64_t The duration in nanoseconds, 0 for an empty histogram
+   */
+  uint64_t stat_percentile(const struct stat_hist *h, double p);
+
+  /**
+   * @brief Clear every stage histogram.
+   *
+   * @param sh The shell
+   */
+  void stat_reset(struct shell *sh);
+
+  /**
+   * @brief Print the count, mean, p50, p99 and maximum of every stage.
+   *
+   * @param sh The shell
+   */
+  void print_stats(struct shell *sh);
+
   /**
    * @brief Initialize the shell for use. Allocate all data structures
    * Grab control of the terminal and put the shell in its own
@@ -144,7 +740,9 @@ extern "C"
   void parse_args(int argc, char **argv);
 
   /**
-  * @brief Print the command history
+  * @brief Print the command history. With a history file the entries come
+  * from the file, so commands from other shells show up too, and a limit
+  * only touches the tail of the file.
   *
   * @param limit The maximum number of history entries to print. If 0, print all entries.
   * @return int Returns 0 on success, -1 on failure
@@ -152,29 +750,522 @@ extern "C"
   int print_history(int limit);
 
   /**
- * @brief Start a process in the background
+  * @brief Open the persistent history file and load the most recent entries
+  * into readline. The file is mapped rather than read, so startup cost does
+  * not grow with the size of the history.
+  *
+  * @param path The history file, or NULL for $MY_HISTFILE or
+  * ~/.myprogram_history. An empty MY_HISTFILE disables the file.
+  * @param recent How many of the newest entries to give readline
+  * @return int Returns 0 on success, -1 if history stays in memory only
+  */
+  int history_open(const char *path, int recent);
+
+  /**
+  * @brief Add a command to readline's history and append it to the history
+  * file with a single write.
+  *
+  * @param line The command
+  * @return int Returns 0 on success, -1 if the write failed
+  */
+  int history_append(const char *line);
+
+  /**
+  * @brief Close the history file.
+  */
+  void history_close(void);
+
+  /**
+  * @brief Print every history entry containing pattern, numbered like
+  * print_history. Candidates come from a trigram index over the history
+  * file that is built on first use and extended as entries are added.
+  *
+  * @param pattern The substring to look for
+  * @return int Returns 0 on success, -1 without a history file
+  */
+  int history_find(const char *pattern);
+
+  /**
+  * @brief Find the newest history entry containing pattern that is older
+  * than before.
+  *
+  * @param pattern The substring to look for
+  * @param before Entry index to search below, SIZE_MAX for the whole history
+  * @return long The entry index, or -1 when nothing matches
+  */
+  long history_find_prev(const char *pattern, size_t before);
+
+  /**
+  * @brief Bind C-r to a search through the history index. The text on the
+  * line is the pattern, and pressing C-r again steps to older matches. On
+  * an empty line C-r is readline's own incremental search.
+  */
+  void history_bind_search(void);
+
+  /**
+  * @brief Call fn for every history entry, oldest first. Without a history
+  * file readline's list is used.
+  *
+  * @param fn Called with each entry, which is not NUL terminated
+  * @param ctx Passed through to fn
+  * @return int Returns 0 on success, -1 on failure
+  */
+  int history_each_entry(void (*fn)(const char *line, size_t len, void *ctx), void *ctx);
+
+  /**
+  * @brief Record a use of a command for autosuggestions.
+  *
+  * @param line The command
+  */
+  void suggest_add(const char *line);
+
+  /**
+  * @brief Find the most frecent history entry that starts with a prefix.
+  * The first call builds the suggestion trie from the history, after that
+  * a lookup only walks the prefix.
+  *
+  * @param prefix The text typed so far
+  * @param len Length of prefix
+  * @return const char* The whole entry, or NULL when none matches
+  */
+  const char *suggest_lookup(const char *prefix, size_t len);
+
+  /**
+  * @brief Drop every suggestion. The trie is rebuilt on the next lookup.
+  */
+  void suggest_clear(void);
+
+  /**
+  * @brief Show suggestions dimmed after the cursor while typing. Right
+  * arrow, C-f or C-e at the end of the line accept the suggestion.
+  */
+  void suggest_bind(void);
+
+  /**
+   * @brief Select the backend used to launch commands by name, either
+   * "spawn" or "fork".
+   *
+   * @param sh The shell
+   * @param name The backend name
+   * @return int Returns 0 on success, -1 if the name is unknown
+   */
+  int set_launch_backend(struct shell *sh, const char *name);
+
+  /**
+   * @brief Get the name of the backend currently used to launch commands.
+   *
+   * @param sh The shell
+   * @return const char* "spawn" or "fork"
+   */
+  const char *get_launch_backend(struct shell *sh);
+
+  /**
+   * @brief Resolve a command name to an absolute path using the shell's
+   * command hash. On a miss PATH is searched once and the result is cached.
+   * The cache is invalidated when PATH changes.
+   *
+   * @param sh The shell
+   * @param name The command name, must not contain a slash
+   * @return const char* The path owned by the cache, or NULL if not found
+   */
+  const char *cmd_hash_lookup(struct shell *sh, const char *name);
+
+  /**
+   * @brief Add a command to the hash with an explicit path. Pinned entries
+   * survive PATH changes and hash -r is needed to drop them.
+   *
+   * @param sh The shell
+   * @param name The command name
+   * @param path The path to run for name
+   * @return int Returns 0 on success, -1 on failure
+   */
+  int cmd_hash_pin(struct shell *sh, const char *name, const char *path);
+
+  /**
+   * @brief Remove one command from the hash.
+   *
+   * @param sh The shell
+   * @param name The command name
+   */
+  void cmd_hash_forget(struct shell *sh, const char *name);
+
+  /**
+   * @brief Remove every command from the hash.
+   *
+   * @param sh The shell
+   */
+  void cmd_hash_clear(struct shell *sh);
+
+  /**
+   * @brief Print the hashed commands and how often each one was used.
+   *
+   * @param sh The shell
+   */
+  void cmd_hash_print(struct shell *sh);
+
+  /**
+   * @brief Free the command hash.
+   *
+   * @param sh The shell
+   */
+  void cmd_hash_destroy(struct shell *sh);
+
+  /**
+   * @brief Launch an external command in its own process group using the
+   * shell's launch backend. The child gets default dispositions for the job
+   * control signals. If foreground is true and the shell is interactive the
+   * new process group is also given the terminal. Commands without a slash
+   * are resolved through the command hash and exec'd by absolute path. The
+   * caller is responsible for waiting on the child.
+   *
+   * @param sh The shell
+   * @param argv The command to run
+   * @param foreground True if the command should own the terminal
+   * @return pid_t The pid of the child, or -1 on failure
+   */
+  pid_t launch_process(struct shell *sh, char **argv, bool foreground);
+
+  /**
+   * @brief Turn a shell option on or off. Known options are "pipefail" and
+   * "pipesize=BYTES", the pipe buffer size used between pipeline stages.
+   *
+   * @param sh The shell
+   * @param option The option name
+   * @param on True to turn it on, false to turn it off
+   * @return int Returns 0 on success, -1 if the option is unknown or invalid
+   */
+  int set_shell_option(struct shell *sh, const char *option, bool on);
+
+  /**
+   * @brief Print the current value of every shell option.
+   *
+   * @param sh The shell
+   */
+  void print_shell_options(struct shell *sh);
+
+  /**
+   * @brief Make an empty pipeline that uses its inline arrays, for callers
+   * that build the stages and redirections themselves instead of parsing
+   * them. Free it with pipeline_free like a parsed one.
+   *
+   * @param pl The pipeline to initialize
+   */
+  void pipeline_init(struct pipeline *pl);
+
+  /**
+   * @brief Split an argv at its "|" tokens into pipeline stages. The "|"
+   * entries in argv are replaced with NULL. Redirections (<, >, >> and >&
+   * with an optional descriptor number) are removed from each stage and
+   * collected in pl->redirs. Free the result with pipeline_free.
+   *
+   * @param argv The parsed command line, modified by this call
+   * @param pl The pipeline to fill in
+   * @return int Returns 0 on success, -1 on a syntax error or failure
+   */
+  int pipeline_parse(char **argv, struct pipeline *pl);
+
+  /**
+   * @brief Free any memory held by a pipeline.
+   *
+   * @param pl The pipeline
+   */
+  void pipeline_free(struct pipeline *pl);
+
+  /**
+   * @brief Apply redirections to the shell itself, for a builtin that runs
+   * without a child. Each target descriptor is saved with a dup before it
+   * is replaced, and stdio is flushed first. On failure the redirections
+   * applied so far are undone.
+   *
+   * @param sh The shell
+   * @param redirs The redirections in command line order
+   * @param nredirs The number of redirections
+   * @param saved Space for nredirs saved descriptors
+   * @return int 0 on success, -1 on failure
+   */
+  int redirect_push(struct shell *sh, const struct redir *redirs, int nredirs, int *saved);
+
+  /**
+   * @brief Undo redirect_push, restoring the saved descriptors in reverse
+   * order and closing the ones that were not open before.
+   *
+   * @param redirs The redirections that were applied
+   * @param nredirs The number of redirections
+   * @param saved The descriptors redirect_push saved
+   */
+  void redirect_pop(const struct redir *redirs, int nredirs, const int *saved);
+
+  /**
+   * @brief Launch every stage of a pipeline into one process group. Stages
+   * are connected with close-on-exec pipes, enlarged to sh->pipe_size with
+   * F_SETPIPE_SZ when it is set. Redirections are applied in the child after
+   * the pipes, files are opened close-on-exec and /dev/null is served from
+   * one descriptor the shell keeps open. The pids are stored in pl->pids, -1 for a
+   * stage that could not be started.
+   *
+   * @param sh The shell
+   * @param pl The pipeline to launch
+   * @param foreground True if the process group should own the terminal
+   * @return pid_t The process group id, or -1 if no stage started
+   */
+  pid_t launch_pipeline(struct shell *sh, struct pipeline *pl, bool foreground);
+
+  /**
+   * @brief Launch a pipeline like launch_pipeline, into the existing
+   * process group pgid. With pgid 0 a new group is made and, when
+   * foreground is true, given the terminal; joining a group never moves
+   * the terminal.
+   *
+   * @param sh The shell
+   * @param pl The pipeline to launch
+   * @param pgid The group to join, or 0 for a new one
+   * @param foreground True if a new process group should own the terminal
+   * @return pid_t The process group id, or -1 if no stage started
+   */
+  pid_t launch_pipeline_group(struct shell *sh, struct pipeline *pl, pid_t pgid,
+                              bool foreground);
+
+  /**
+   * @brief Wait for every stage of a launched pipeline. The status is the
+   * exit code of the last stage, or of the rightmost failing stage when
+   * sh->pipefail is set. Signals are reported as 128 plus the signal number.
+   * The stages are reaped with wait4, and pl->acct holds what they cost
+   * from launch_pipeline until the last one was reaped.
+   *
+   * @param sh The shell
+   * @param pl The launched pipeline
+   * @return int The pipeline's exit status, or -1 on failure
+   */
+  int wait_pipeline(struct shell *sh, struct pipeline *pl);
+
+  /**
+   * @brief Turn a wait status into a shell exit code, 128 plus the signal
+   * number for a child that was killed or stopped.
+   *
+   * @param status The status from waitpid
+   * @return int The exit code
+   */
+  int exit_code_from_status(int status);
+
+  /**
+ * @brief Start a process or pipeline in the background. All stages of a
+ * pipeline are one job.
  *
  * @param sh The shell structure
- * @param args The command arguments
+ * @param args The command arguments, modified if they contain pipes
  * @param full_command The full command string
  * @return int Returns 0 on success, -1 on failure
  */
 int start_background_process(struct shell *sh, char **args, char *full_command);
 
 /**
- * @brief Check and report finished background processes
+ * @brief Set up delivery of child exits to the shell. Every background job
+ * holds a pidfd and all of them sit in one epoll set, so finished jobs are
+ * reaped with waitid(P_PIDFD) without any pid reuse hazard. On kernels
+ * without pidfds SIGCHLD is read from a signalfd in the same epoll set and
+ * children are reaped with waitpid. If neither can be set up the shell falls
+ * back to polling the running jobs.
+ *
+ * @param sh The shell structure
+ * @return int Returns 0 on success, -1 on failure
+ */
+int job_events_init(struct shell *sh);
+
+/**
+ * @brief Close the job event descriptors and unblock SIGCHLD again.
+ *
+ * @param sh The shell structure
+ */
+void job_events_destroy(struct shell *sh);
+
+/**
+ * @brief Wait until at least one background job finishes or the timeout
+ * expires. Finished jobs are reaped and marked Done.
+ *
+ * @param sh The shell structure
+ * @param timeout_ms How long to wait, 0 to return immediately, -1 to wait
+ * without a timeout
+ * @return int The number of jobs that finished, or -1 on failure
+ */
+int wait_for_jobs(struct shell *sh, int timeout_ms);
+
+/**
+ * @brief Read a line like readline, but keep reaping background jobs while
+ * waiting for input. stdin and the job event set are watched together with
+ * readline's callback interface so no polling is involved. Falls back to a
+ * plain readline call when job events are not available.
+ *
+ * @param sh The shell structure
+ * @param prompt The prompt to show
+ * @return char* The line, allocated with malloc, or NULL on EOF
+ */
+char *sh_readline(struct shell *sh, const char *prompt);
+
+/**
+ * @brief Read lines from a file descriptor in large chunks. If the
+ * descriptor is a regular file positioned at its start it is mapped instead.
+ *
+ * @param lr The reader
+ * @param fd The descriptor, owned by the caller
+ * @return int 0 on success, -1 on failure
+ */
+int line_reader_open_fd(struct line_reader *lr, int fd);
+
+/**
+ * @brief Read lines from a script file, mapping it when possible.
+ *
+ * @param lr The reader
+ * @param path The script to open
+ * @return int 0 on success, -1 on failure with errno set
+ */
+int line_reader_open_file(struct line_reader *lr, const char *path);
+
+/**
+ * @brief Read lines from a string, as given to -c.
+ *
+ * @param lr The reader
+ * @param str The commands, copied by the reader
+ * @return int 0 on success, -1 on failure
+ */
+int line_reader_open_string(struct line_reader *lr, const char *str);
+
+/**
+ * @brief Get the next line without its newline. The line may be modified
+ * in place and stays valid until the next call.
+ *
+ * @param lr The reader
+ * @return char* The line, or NULL at end of input
+ */
+char *line_reader_next(struct line_reader *lr);
+
+/**
+ * @brief Release the buffer or mapping of a reader. The descriptor passed
+ * to line_reader_open_fd is left open.
+ *
+ * @param lr The reader
+ */
+void line_reader_close(struct line_reader *lr);
+
+/**
+ * @brief Load the compiled image of a script. The cached image is used when
+ * it was built by this shell version from the script as it is now, otherwise
+ * the script is tokenized and the new image stored for next time. The cache
+ * lives in $MY_SCRIPT_CACHE, $XDG_CACHE_HOME/myprogram or
+ * ~/.cache/myprogram, and an empty MY_SCRIPT_CACHE turns it off.
+ *
+ * @param img The image to fill in
+ * @param script Path of the script
+ * @return int 0 on success, -1 on failure with errno set
+ */
+int script_image_open(struct script_image *img, const char *script);
+
+/**
+ * @brief Get the next command of a script image. The argv array comes from
+ * the arena while the strings point into the image.
+ *
+ * @param img The image
+ * @param a The arena for the argv array
+ * @param background Set when the line ended in '&'
+ * @param command Set to the command text for background lines, else NULL
+ * @return char** The argv, or NULL after the last command
+ */
+char **script_image_next(struct script_image *img, struct arena *a, bool *background,
+                         char **command);
+
+/**
+ * @brief Release a script image.
+ *
+ * @param img The image
+ */
+void script_image_close(struct script_image *img);
+
+/**
+ * @brief Path of the cache entry for a script.
+ *
+ * @param script Path of the script
+ * @return char* The path, allocated with malloc, or NULL when caching is off
+ */
+char *script_cache_path(const char *script);
+
+/**
+ * @brief Find the background job that owns a pid. The lookup goes through
+ * a hash index so it does not depend on the number of jobs.
+ *
+ * @param sh The shell structure
+ * @param pid The pid to look up
+ * @return struct bg_job* The job, or NULL if no job has that pid
+ */
+struct bg_job *find_job_by_pid(struct shell *sh, pid_t pid);
+
+/**
+ * @brief Find the background job with a job number, as in %1.
+ *
+ * @param sh The shell structure
+ * @param job_id The job number
+ * @return struct bg_job* The job, or NULL if there is no such job
+ */
+struct bg_job *find_job_by_id(struct shell *sh, int job_id);
+
+/**
+ * @brief Set the maximum number of jobs the job table will hold. Jobs that
+ * are Done but not yet reported count against the limit until they are
+ * reclaimed.
+ *
+ * @param sh The shell structure
+ * @param max The new limit, values below 1 restore the default of MAX_BG_JOBS
+ */
+void set_max_jobs(struct shell *sh, int max);
+
+/**
+ * @brief Check and report finished background processes. In an interactive
+ * shell finished jobs are reported before the next prompt and their slot in
+ * the job table is reclaimed.
  *
  * @param sh The shell structure
  */
 void check_background_processes(struct shell *sh);
 
 /**
- * @brief Print all background jobs
+ * @brief Print all background jobs. Jobs that are reported as Done are
+ * removed from the job table.
  *
  * @param sh The shell structure
  */
 void print_jobs(struct shell *sh);
 
+/**
+ * @brief Print all background jobs like print_jobs, with the wall clock
+ * time, user and system CPU time and peak resident memory of each. Running
+ * jobs show the time since they started and no CPU time yet.
+ *
+ * @param sh The shell structure
+ */
+void print_jobs_long(struct shell *sh);
+
+/**
+ * @brief Start accounting for a job: clear it and record the start time.
+ *
+ * @param acct The record
+ */
+void job_acct_start(struct job_acct *acct);
+
+/**
+ * @brief Add what one reaped process used to a job's record.
+ *
+ * @param acct The record
+ * @param ru The usage from wait4
+ */
+void job_acct_add(struct job_acct *acct, const struct rusage *ru);
+
+/**
+ * @brief Seconds between two CLOCK_MONOTONIC times.
+ *
+ * @param start The earlier time
+ * @param end The later time
+ * @return double The difference in seconds
+ */
+double timespec_seconds(const struct timespec *start, const struct timespec *end);
+
 
 #ifdef __cplusplus
 }  extern "C"
@@ -0,0 +1,431 @@
+/**
+ * @file parallel.c
+ * @brief The parallel builtin, a native xargs -P
+ *
+ * parallel runs a command template once per input with at most N children
+ * at a time. Inputs come from the words after :::, from a file given with
+ * -a, or from stdin one line each. Every task is one pipeline stage built
+ * from the template and launched like a background job, so an input is
+ * always an argument and never an operator. Tasks are not entered in the
+ * job table so a large fan out never runs into its limit.
+ *
+ * A task's stdout and stderr go to memfds, so a task never blocks on a full
+ * pipe and outputs never interleave. The shell sleeps in waitpid on the
+ * tasks' process group and starts the next input as soon as one exits,
+ * looking only at the tasks that are still running. Output is
+ * copied out as tasks finish, or in input order with -k, where at most
+ * PARALLEL_MAX_PENDING finished tasks wait to be printed before no more are
+ * started.
+ *
+ * All running tasks share one process group. In an interactive shell that
+ * group owns the terminal for the length of the run like a foreground job,
+ * so Ctrl-C reaches the tasks and stops the run. A task that is stopped
+ * (Ctrl-Z, or a read from the terminal) is killed and counted as failed,
+ * since a builtin can't be suspended.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+//GNU parallel caps the failure count it returns the same way
+#define PARALLEL_MAX_STATUS 101
+//with -k every finished task keeps two memfds open until it is printed
+#define PARALLEL_MAX_PENDING 256
+
+#if PIPELINE_INLINE_REDIRS < 3
+#error "parallel_start stores three redirections in a pipeline's inline array"
+#endif
+
+struct parallel_task {
+    size_t seq;
+    pid_t pid;
+    int out_fd;
+    int err_fd;
+    int status;
+    bool done;
+};
+
+struct parallel_run {
+    struct shell *sh;
+    char **template;
+    bool has_placeholder;
+    bool keep_order;
+    int jobs;
+    //inputs are the words after ::: or the lines of reader
+    char **inputs;
+    struct line_reader reader;
+    bool use_reader;
+    bool from_stdin;
+    struct arena arena;
+    struct parallel_task *tasks;
+    size_t ntasks;
+    size_t cap;
+    size_t next_emit;
+    size_t pending;
+    //indices into tasks of the ones not yet reaped, in no particular order
+    size_t *running_tasks;
+    int running;
+    int running_cap;
+    int failed;
+    pid_t pgid;
+    bool foreground;
+    int stop_signal;
+};
+
+static const char *parallel_next_input(struct parallel_run *run) {
+    if (!run->use_reader) {
+        return *run->inputs != NULL ? *run->inputs++ : NULL;
+    }
+    char *line;
+    while ((line = line_reader_next(&run->reader)) != NULL) {
+        if (*line != '\0') return line;
+    }
+    return NULL;
+}
+
+//copy a finished task's output to fd, sendfile keeps it out of our memory
+static void parallel_copy(int from, int to) {
+    off_t off = 0;
+    struct stat st;
+    if (fstat(from, &st) == -1) {
+        return;
+    }
+    while (off < st.st_size) {
+        ssize_t n = sendfile(to, from, &off, st.st_size - off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (n <= 0) return;
+    }
+
+    //some outputs refuse sendfile, copy the rest by hand
+    char buf[8192];
+    while (off < st.st_size) {
+        ssize_t n = pread(from, buf, sizeof(buf), off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = write(to, buf + done, n - done);
+            if (w == -1 && errno == EINTR) continue;
+            if (w <= 0) return;
+            done += w;
+        }
+        off += n;
+    }
+}
+
+static void parallel_emit(struct parallel_task *t) {
+    if (t->out_fd >= 0) {
+        parallel_copy(t->out_fd, STDOUT_FILENO);
+        close(t->out_fd);
+    }
+    if (t->err_fd >= 0) {
+        parallel_copy(t->err_fd, STDERR_FILENO);
+        close(t->err_fd);
+    }
+    t->out_fd = t->err_fd = -1;
+}
+
+static void parallel_finish(struct parallel_run *run, struct parallel_task *t, int status) {
+    t->status = status;
+    t->done = true;
+    t->pid = 0;
+    if (status != 0) {
+        run->failed++;
+    }
+    if (!run->keep_order) {
+        parallel_emit(t);
+        return;
+    }
+    //with -k a task waits for every task before it
+    run->pending++;
+    while (run->next_emit < run->ntasks && run->tasks[run->next_emit].done) {
+        parallel_emit(&run->tasks[run->next_emit++]);
+        run->pending--;
+    }
+}
+
+//expand {} to the input and {#} to the task number inside one word
+static char *parallel_expand(struct parallel_run *run, const char *word, const char *input,
+                             size_t seq) {
+    char num[24];
+    snprintf(num, sizeof(num), "%zu", seq);
+    size_t len = 0;
+    for (const char *p = word; *p; ) {
+        if (strncmp(p, "{}", 2) == 0) {
+            len += strlen(input);
+            p += 2;
+        } else if (strncmp(p, "{#}", 3) == 0) {
+            len += strlen(num);
+            p += 3;
+        } else {
+            len++;
+            p++;
+        }
+    }
+    char *out = arena_alloc(&run->arena, len + 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    char *o = out;
+    for (const char *p = word; *p; ) {
+        if (strncmp(p, "{}", 2) == 0) {
+            o = stpcpy(o, input);
+            p += 2;
+        } else if (strncmp(p, "{#}", 3) == 0) {
+            o = stpcpy(o, num);
+            p += 3;
+        } else {
+            *o++ = *p++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+static struct parallel_task *parallel_new_task(struct parallel_run *run) {
+    if (run->ntasks == run->cap) {
+        size_t cap = run->cap ? run->cap * 2 : 64;
+        struct parallel_task *tasks = realloc(run->tasks, cap * sizeof(*tasks));
+        if (tasks == NULL) {
+            perror("realloc failed");
+            return NULL;
+        }
+        run->tasks = tasks;
+        run->cap = cap;
+    }
+    struct parallel_task *t = &run->tasks[run->ntasks++];
+    *t = (struct parallel_task){ .seq = run->ntasks, .pid = 0, .out_fd = -1, .err_fd = -1 };
+    return t;
+}
+
+static int parallel_start(struct parallel_run *run, const char *input) {
+    if (run->running == run->running_cap) {
+        int cap = run->running_cap ? run->running_cap * 2 : 16;
+        size_t *running = realloc(run->running_tasks, cap * sizeof(*running));
+        if (running == NULL) {
+            perror("realloc failed");
+            return -1;
+        }
+        run->running_tasks = running;
+        run->running_cap = cap;
+    }
+    struct parallel_task *t = parallel_new_task(run);
+    if (t == NULL) {
+        return -1;
+    }
+    arena_reset(&run->arena);
+    t->out_fd = memfd_create("parallel-out", MFD_CLOEXEC);
+    t->err_fd = memfd_create("parallel-err", MFD_CLOEXEC);
+    if (t->out_fd == -1 || t->err_fd == -1) {
+        perror("memfd_create failed");
+        parallel_finish(run, t, 127);
+        return -1;
+    }
+
+    //the template and the input when no word took it, all of it data and never shell syntax
+    int nwords = 0;
+    while (run->template[nwords] != NULL) nwords++;
+    char **argv = arena_alloc(&run->arena, (nwords + 2) * sizeof(char *));
+    if (argv == NULL) {
+        parallel_finish(run, t, 127);
+        return -1;
+    }
+    int argc = 0;
+    for (int i = 0; i < nwords; i++) {
+        argv[argc] = parallel_expand(run, run->template[i], input, run->ntasks);
+        if (argv[argc++] == NULL) {
+            parallel_finish(run, t, 127);
+            return -1;
+        }
+    }
+    if (!run->has_placeholder) {
+        argv[argc++] = (char *)input;
+    }
+    argv[argc] = NULL;
+
+    //one stage built by hand, its at most three redirs fit in the inline array
+    struct pipeline pl;
+    pipeline_init(&pl);
+    pl.stages[0] = argv;
+    pl.pids[0] = -1;
+    pl.nstages = 1;
+    char fds[2][16];
+    snprintf(fds[0], sizeof(fds[0]), "%d", t->out_fd);
+    snprintf(fds[1], sizeof(fds[1]), "%d", t->err_fd);
+    pl.redirs[pl.nredirs++] =
+        (struct redir){ .fd = STDOUT_FILENO, .kind = REDIR_DUP, .target = fds[0] };
+    pl.redirs[pl.nredirs++] =
+        (struct redir){ .fd = STDERR_FILENO, .kind = REDIR_DUP, .target = fds[1] };
+    //tasks must not eat the inputs we are still reading
+    if (run->from_stdin) {
+        pl.redirs[pl.nredirs++] =
+            (struct redir){ .fd = STDIN_FILENO, .kind = REDIR_IN, .target = "/dev/null" };
+    }
+    //the group lives as long as one of its tasks is unreaped, after that start a new one
+    if (run->running == 0) {
+        run->pgid = 0;
+    }
+    pid_t pgid = launch_pipeline_group(run->sh, &pl, run->pgid, run->foreground);
+    pid_t pid = pl.pids[0];
+    pipeline_free(&pl);
+    if (pgid == -1 || pid <= 0) {
+        parallel_finish(run, t, 127);
+        return 0;
+    }
+    run->pgid = pgid;
+    t->pid = pid;
+    run->running_tasks[run->running++] = run->ntasks - 1;
+    return 0;
+}
+
+//a task that exited or stopped: record it, a stopped one is killed first
+static void parallel_reap(struct parallel_run *run, struct parallel_task *t, int status) {
+    if (WIFSTOPPED(status)) {
+        fprintf(stderr, "parallel: task %zu stopped, killing it\n", t->seq);
+        kill(t->pid, SIGKILL);
+        int dead;
+        while (waitpid(t->pid, &dead, 0) == -1 && errno == EINTR) {}
+        run->stop_signal = WSTOPSIG(status);
+    } else if (WIFSIGNALED(status) &&
+               (WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGQUIT)) {
+        //Ctrl-C went to every task, don't start any more
+        run->stop_signal = WTERMSIG(status);
+    }
+    parallel_finish(run, t, exit_code_from_status(status));
+}
+
+//sleep until a running task exits or stops and reap it, every task is in run->pgid
+static void parallel_wait(struct parallel_run *run) {
+    int status;
+    pid_t pid;
+    do {
+        pid = waitpid(-run->pgid, &status, WUNTRACED);
+    } while (pid == -1 && errno == EINTR);
+    if (pid == -1) {
+        //nothing left to wait for, don't wait on the tasks forever
+        perror("waitpid failed");
+        for (int i = 0; i < run->running; i++) {
+            parallel_finish(run, &run->tasks[run->running_tasks[i]], 127);
+        }
+        run->running = 0;
+        return;
+    }
+    for (int i = 0; i < run->running; i++) {
+        struct parallel_task *t = &run->tasks[run->running_tasks[i]];
+        if (t->pid != pid) continue;
+        run->running_tasks[i] = run->running_tasks[--run->running];
+        parallel_reap(run, t, status);
+        return;
+    }
+}
+
+static int parallel_usage(void) {
+    fprintf(stderr, "USAGE: parallel [-j N] [-k] [-a FILE] COMMAND [ARG...] [::: INPUT...]\n");
+    return 2;
+}
+
+int builtin_parallel(struct shell *sh, char **argv) {
+    struct parallel_run run = { .sh = sh };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    run.jobs = cpus > 0 ? (int)cpus : 1;
+    const char *input_file = NULL;
+
+    int i = 1;
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            run.keep_order = true;
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *n = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+            char *end;
+            long jobs = n != NULL ? strtol(n, &end, 10) : 0;
+            if (n == NULL || *end != '\0' || jobs < 1 || jobs > INT_MAX) {
+                return parallel_usage();
+            }
+            run.jobs = (int)jobs;
+        } else if (strcmp(argv[i], "-a") == 0 && argv[i + 1] != NULL) {
+            input_file = argv[++i];
+        } else {
+            return parallel_usage();
+        }
+    }
+
+    //the template ends at ::: when the inputs are on the command line
+    run.template = &argv[i];
+    int end = i;
+    while (argv[end] != NULL && strcmp(argv[end], ":::") != 0) end++;
+    if (end == i) {
+        return parallel_usage();
+    }
+    if (argv[end] != NULL) {
+        argv[end] = NULL;
+        run.inputs = &argv[end + 1];
+    } else if (input_file != NULL) {
+        if (line_reader_open_file(&run.reader, input_file) != 0) {
+            perror(input_file);
+            return 1;
+        }
+        run.use_reader = true;
+    } else {
+        if (line_reader_open_fd(&run.reader, STDIN_FILENO) != 0) {
+            return 1;
+        }
+        run.use_reader = true;
+        run.from_stdin = true;
+    }
+    for (char **w = run.template; *w != NULL; w++) {
+        if (strstr(*w, "{}") != NULL) run.has_placeholder = true;
+    }
+
+    arena_init(&run.arena);
+    fflush(stdout);
+    //the tasks get the terminal only when the shell has it to give
+    run.foreground = sh->shell_is_interactive &&
+                     tcgetpgrp(sh->shell_terminal) == getpgrp();
+    const char *input = NULL;
+    for (;;) {
+        while (run.stop_signal == 0 && run.running < run.jobs &&
+               run.pending < PARALLEL_MAX_PENDING &&
+               (input = parallel_next_input(&run)) != NULL) {
+            if (parallel_start(&run, input) != 0) break;
+        }
+        if (run.running == 0) {
+            if (input == NULL || run.stop_signal != 0) break;
+            continue;
+        }
+        parallel_wait(&run);
+    }
+    if (run.foreground) {
+        tcsetpgrp(sh->shell_terminal, getpgrp());
+    }
+    //with -k, what the interrupted tasks printed still comes out in order
+    for (; run.next_emit < run.ntasks; run.next_emit++) {
+        parallel_emit(&run.tasks[run.next_emit]);
+    }
+
+    if (run.use_reader) {
+        line_reader_close(&run.reader);
+    }
+    arena_destroy(&run.arena);
+    free(run.tasks);
+    free(run.running_tasks);
+    if (run.stop_signal != 0) {
+        return 128 + run.stop_signal;
+    }
+    return run.failed < PARALLEL_MAX_STATUS ? run.failed : PARALLEL_MAX_STATUS;
+}
@@ -0,0 +1,401 @@
+/**
+ * @file prompt.c
+ * @brief Prompt rendering with escapes and asynchronous segments
+ *
+ * MY_PROMPT may contain bash style escapes: \w, \W, \u, \h, \?, \j, \$,
+ * \n, \e, \\, \[ and \], plus \g for the VCS branch of the current
+ * directory. The rendered prompt is cached in sh->prompt and rendered again
+ * only when something it uses has changed: the template, the directory,
+ * the last status, the job count or a VCS result.
+ *
+ * The VCS branch can be slow on big repositories or network file systems,
+ * so once prompt_async_init has run it is found on a worker thread. The
+ * prompt shows whatever is cached for the directory right away (nothing the
+ * first time) and the worker reports new results through an eventfd that
+ * sh_readline watches, which redraws the prompt in place.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <readline/readline.h>
+
+#define PROMPT_USES_CWD 0x1
+#define PROMPT_USES_STATUS 0x2
+#define PROMPT_USES_JOBS 0x4
+#define PROMPT_USES_VCS 0x8
+
+struct vcs_entry {
+    char *cwd;
+    char *branch;
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool started;
+    bool stop;
+    int event_fd;
+    char *request;
+    struct vcs_entry cache[PROMPT_VCS_CACHE];
+    int next_slot;
+} vcs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .event_fd = -1,
+};
+
+//the directory of the last render, where VCS lookups are aimed
+static char *prompt_cwd;
+
+static int read_small_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    //one line is all any of these files hold that we care about
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+char *prompt_vcs_branch(const char *dir) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) {
+        return NULL;
+    }
+
+    //walk up until a .git directory, or a .git file of a worktree, turns up
+    for (;;) {
+        char git[PATH_MAX + 8];
+        snprintf(git, sizeof(git), "%s/.git", strcmp(path, "/") == 0 ? "" : path);
+        struct stat st;
+        if (stat(git, &st) == 0) {
+            char head[PATH_MAX + 16];
+            int len;
+            if (S_ISDIR(st.st_mode)) {
+                len = snprintf(head, sizeof(head), "%s/HEAD", git);
+            } else {
+                char link[PATH_MAX];
+                if (read_small_file(git, link, sizeof(link)) != 0 ||
+                    strncmp(link, "gitdir: ", 8) != 0) {
+                    return NULL;
+                }
+                if (link[8] == '/') {
+                    len = snprintf(head, sizeof(head), "%s/HEAD", link + 8);
+                } else {
+                    len = snprintf(head, sizeof(head), "%s/%s/HEAD", path, link + 8);
+                }
+            }
+            if (len < 0 || len >= (int)sizeof(head)) {
+                return NULL;
+            }
+
+            char ref[256];
+            if (read_small_file(head, ref, sizeof(ref)) != 0) {
+                return NULL;
+            }
+            if (strncmp(ref, "ref: refs/heads/", 16) == 0) {
+                return strdup(ref + 16);
+            }
+            //detached head, show the abbreviated commit
+            return strndup(ref, 7);
+        }
+
+        char *slash = strrchr(path, '/');
+        if (slash == NULL || strcmp(path, "/") == 0) {
+            return NULL;
+        }
+        if (slash == path) {
+            slash[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+//the cached branch for a directory, NULL when it was never looked up
+static struct vcs_entry *vcs_cached(const char *cwd) {
+    for (int i = 0; i < PROMPT_VCS_CACHE; i++) {
+        if (vcs.cache[i].cwd != NULL && strcmp(vcs.cache[i].cwd, cwd) == 0) {
+            return &vcs.cache[i];
+        }
+    }
+    return NULL;
+}
+
+//store a result, returns true when it differs from what was cached
+static bool vcs_store(char *cwd, char *branch) {
+    struct vcs_entry *e = vcs_cached(cwd);
+    if (e != NULL) {
+        bool changed = (e->branch == NULL) != (branch == NULL) ||
+                       (branch != NULL && strcmp(e->branch, branch) != 0);
+        free(cwd);
+        free(e->branch);
+        e->branch = branch;
+        return changed;
+    }
+    e = &vcs.cache[vcs.next_slot];
+    vcs.next_slot = (vcs.next_slot + 1) % PROMPT_VCS_CACHE;
+    free(e->cwd);
+    free(e->branch);
+    e->cwd = cwd;
+    e->branch = branch;
+    //the prompt showed nothing for a directory it had not seen
+    return branch != NULL;
+}
+
+static void *vcs_worker(void *arg) {
+    UNUSED(arg)
+    pthread_mutex_lock(&vcs.lock);
+    while (!vcs.stop) {
+        if (vcs.request == NULL) {
+            pthread_cond_wait(&vcs.cond, &vcs.lock);
+            continue;
+        }
+        char *cwd = vcs.request;
+        vcs.request = NULL;
+
+        //the slow part runs without the lock
+        pthread_mutex_unlock(&vcs.lock);
+        char *branch = prompt_vcs_branch(cwd);
+        pthread_mutex_lock(&vcs.lock);
+
+        if (vcs_store(cwd, branch)) {
+            uint64_t one = 1;
+            if (write(vcs.event_fd, &one, sizeof(one)) == -1) {
+                //the counter can only overflow, a wakeup is pending anyway
+            }
+        }
+    }
+    pthread_mutex_unlock(&vcs.lock);
+    return NULL;
+}
+
+int prompt_async_init(struct shell *sh) {
+    if (vcs.started) {
+        sh->prompt_fd = vcs.event_fd;
+        return 0;
+    }
+    vcs.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vcs.event_fd == -1) {
+        return -1;
+    }
+    vcs.stop = false;
+    if (pthread_create(&vcs.thread, NULL, vcs_worker, NULL) != 0) {
+        close(vcs.event_fd);
+        vcs.event_fd = -1;
+        return -1;
+    }
+    vcs.started = true;
+    sh->prompt_fd = vcs.event_fd;
+    return 0;
+}
+
+void prompt_async_destroy(struct shell *sh) {
+    if (vcs.started) {
+        pthread_mutex_lock(&vcs.lock);
+        vcs.stop = true;
+        pthread_cond_signal(&vcs.cond);
+        pthread_mutex_unlock(&vcs.lock);
+        pthread_join(vcs.thread, NULL);
+        close(vcs.event_fd);
+        vcs.event_fd = -1;
+        vcs.started = false;
+    }
+    free(vcs.request);
+    vcs.request = NULL;
+    for (int i = 0; i < PROMPT_VCS_CACHE; i++) {
+        free(vcs.cache[i].cwd);
+        free(vcs.cache[i].branch);
+        vcs.cache[i] = (struct vcs_entry){0};
+    }
+    free(prompt_cwd);
+    prompt_cwd = NULL;
+    sh->prompt_fd = -1;
+}
+
+//ask the worker to look at cwd again, the last request wins
+static void vcs_request(const char *cwd) {
+    char *copy = strdup(cwd);
+    if (copy == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&vcs.lock);
+    free(vcs.request);
+    vcs.request = copy;
+    pthread_cond_signal(&vcs.cond);
+    pthread_mutex_unlock(&vcs.lock);
+}
+
+//append the branch for cwd, from the cache when a worker is running
+static void render_vcs(struct shell *sh, FILE *out, const char *cwd) {
+    if (sh->prompt_fd < 0) {
+        char *branch = prompt_vcs_branch(cwd);
+        if (branch != NULL) {
+            fputs(branch, out);
+            free(branch);
+        }
+        return;
+    }
+    pthread_mutex_lock(&vcs.lock);
+    struct vcs_entry *e = vcs_cached(cwd);
+    if (e != NULL && e->branch != NULL) {
+        fputs(e->branch, out);
+    }
+    pthread_mutex_unlock(&vcs.lock);
+}
+
+static char *render_prompt(struct shell *sh, const char *tmpl, unsigned *uses) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "?");
+    }
+    *uses = 0;
+    for (const char *p = tmpl; *p; p++) {
+        if (*p != '\\' || p[1] == '\0') {
+            fputc(*p, out);
+            continue;
+        }
+        p++;
+        switch (*p) {
+        case 'w': {
+            *uses |= PROMPT_USES_CWD;
+            const char *home = getenv("HOME");
+            size_t hlen = home != NULL ? strlen(home) : 0;
+            if (hlen > 1 && strncmp(cwd, home, hlen) == 0 &&
+                (cwd[hlen] == '\0' || cwd[hlen] == '/')) {
+                fprintf(out, "~%s", cwd + hlen);
+            } else {
+                fputs(cwd, out);
+            }
+            break;
+        }
+        case 'W': {
+            *uses |= PROMPT_USES_CWD;
+            const char *base = strrchr(cwd, '/');
+            fputs(base != NULL && base[1] != '\0' ? base + 1 : cwd, out);
+            break;
+        }
+        case 'u': {
+            struct passwd *pw = getpwuid(getuid());
+            fputs(pw != NULL ? pw->pw_name : "?", out);
+            break;
+        }
+        case 'h': {
+            char host[256];
+            if (gethostname(host, sizeof(host)) == 0) {
+                host[sizeof(host) - 1] = '\0';
+                host[strcspn(host, ".")] = '\0';
+                fputs(host, out);
+            }
+            break;
+        }
+        case '?':
+            *uses |= PROMPT_USES_STATUS;
+            fprintf(out, "%d", sh->last_status);
+            break;
+        case 'j':
+            *uses |= PROMPT_USES_JOBS;
+            fprintf(out, "%d", sh->bg_job_count);
+            break;
+        case 'g':
+            *uses |= PROMPT_USES_VCS | PROMPT_USES_CWD;
+            render_vcs(sh, out, cwd);
+            break;
+        case '$':
+            fputc(getuid() == 0 ? '#' : '$', out);
+            break;
+        case 'n':
+            fputc('\n', out);
+            break;
+        case 'e':
+            fputc('\033', out);
+            break;
+        case '[':
+            fputc(RL_PROMPT_START_IGNORE, out);
+            break;
+        case ']':
+            fputc(RL_PROMPT_END_IGNORE, out);
+            break;
+        case '\\':
+            fputc('\\', out);
+            break;
+        default:
+            fputc('\\', out);
+            fputc(*p, out);
+            break;
+        }
+    }
+    fclose(out);
+
+    if (*uses & PROMPT_USES_VCS) {
+        free(prompt_cwd);
+        prompt_cwd = strdup(cwd);
+    }
+    return buf;
+}
+
+const char *sh_prompt(struct shell *sh) {
+    //only rendered again after something it depends on has changed
+    if (sh->prompt != NULL &&
+        (((sh->prompt_uses & PROMPT_USES_STATUS) && sh->prompt_status != sh->last_status) ||
+         ((sh->prompt_uses & PROMPT_USES_JOBS) && sh->prompt_jobs != sh->bg_job_count))) {
+        sh_prompt_invalidate(sh);
+    }
+    if (sh->prompt == NULL) {
+        const char *tmpl = getenv("MY_PROMPT");
+        if (tmpl == NULL || *tmpl == '\0') {
+            tmpl = "shell$ ";
+        }
+        sh->prompt = render_prompt(sh, tmpl, &sh->prompt_uses);
+        sh->prompt_status = sh->last_status;
+        sh->prompt_jobs = sh->bg_job_count;
+    }
+
+    //the branch may have moved since the last line, have it checked again
+    if ((sh->prompt_uses & PROMPT_USES_VCS) && sh->prompt_fd >= 0 && prompt_cwd != NULL) {
+        vcs_request(prompt_cwd);
+    }
+    return sh->prompt != NULL ? sh->prompt : "shell$ ";
+}
+
+void sh_prompt_invalidate(struct shell *sh) {
+    free(sh->prompt);
+    sh->prompt = NULL;
+}
+
+bool sh_prompt_refresh(struct shell *sh) {
+    uint64_t count;
+    if (sh->prompt_fd < 0 || read(sh->prompt_fd, &count, sizeof(count)) != sizeof(count)) {
+        return false;
+    }
+    if (!(sh->prompt_uses & PROMPT_USES_VCS)) {
+        return false;
+    }
+    sh_prompt_invalidate(sh);
+    return true;
+}
@@ -0,0 +1,369 @@
+/**
+ * @file script.c
+ * @brief Compiled script images and their on-disk cache
+ *
+ * A script is tokenized once into a flat image: for every command line its
+ * argc, a background flag and the NUL terminated tokens back to back. The
+ * image is written to the cache directory keyed by the script's path, and
+ * later runs map it and walk the tokens instead of lexing the script again.
+ * A cached image is only used when the shell version, the image format and
+ * the script's size, mtime, inode and device all still match.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define SCRIPT_CACHE_MAGIC "LSHC"
+//bump whenever the tokenizer or the image layout changes
+#define SCRIPT_CACHE_FORMAT 1
+#define SCRIPT_LINE_BACKGROUND 0x1
+
+struct script_cache_header {
+    char magic[4];
+    uint32_t format;
+    uint32_t shell_version;
+    uint32_t nlines;
+    uint32_t path_len;
+    uint32_t reserved;
+    uint64_t src_size;
+    uint64_t src_ino;
+    uint64_t src_dev;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint64_t body_size;
+};
+
+static uint32_t script_shell_version(void) {
+    return (uint32_t)lab_VERSION_MAJOR << 16 | (uint32_t)lab_VERSION_MINOR;
+}
+
+static void script_header_fill(struct script_cache_header *h, const struct stat *st,
+                               size_t path_len) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SCRIPT_CACHE_MAGIC, 4);
+    h->format = SCRIPT_CACHE_FORMAT;
+    h->shell_version = script_shell_version();
+    h->path_len = path_len;
+    h->src_size = st->st_size;
+    h->src_ino = st->st_ino;
+    h->src_dev = st->st_dev;
+    h->src_mtime_sec = st->st_mtim.tv_sec;
+    h->src_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static char *script_cache_dir(void) {
+    const char *dir = getenv("MY_SCRIPT_CACHE");
+    if (dir != NULL) {
+        //an empty value turns the cache off
+        return *dir != '\0' ? strdup(dir) : NULL;
+    }
+
+    char *path = NULL;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg != NULL && *xdg != '\0') {
+        if (asprintf(&path, "%s/myprogram", xdg) == -1) return NULL;
+        mkdir(xdg, 0700);
+    } else if (home != NULL && *home != '\0') {
+        if (asprintf(&path, "%s/.cache/myprogram", home) == -1) return NULL;
+        //make sure ~/.cache exists before creating our directory in it
+        char *parent = strndup(path, strlen(path) - strlen("/myprogram"));
+        if (parent != NULL) {
+            mkdir(parent, 0700);
+            free(parent);
+        }
+    }
+    return path;
+}
+
+char *script_cache_path(const char *script) {
+    char *real = realpath(script, NULL);
+    if (real == NULL) {
+        return NULL;
+    }
+    char *dir = script_cache_dir();
+    if (dir == NULL) {
+        free(real);
+        return NULL;
+    }
+
+    //FNV-1a of the absolute path names the image, the header holds the path itself
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)real; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    char *path = NULL;
+    if (asprintf(&path, "%s/%016llx.lshc", dir, (unsigned long long)h) == -1) {
+        path = NULL;
+    }
+    free(real);
+    free(dir);
+    return path;
+}
+
+//make sure every line of an image stays inside the body before it is used
+static bool script_body_valid(const char *body, size_t size, uint32_t nlines) {
+    size_t pos = 0;
+    for (uint32_t i = 0; i < nlines; i++) {
+        uint32_t argc;
+        if (size - pos < sizeof(argc) + 1) return false;
+        memcpy(&argc, body + pos, sizeof(argc));
+        uint8_t flags = body[pos + sizeof(argc)];
+        pos += sizeof(argc) + 1;
+        if (argc == 0) return false;
+
+        uint32_t nstrings = argc + ((flags & SCRIPT_LINE_BACKGROUND) ? 1 : 0);
+        for (uint32_t j = 0; j < nstrings; j++) {
+            const char *end = memchr(body + pos, '\0', size - pos);
+            if (end == NULL) return false;
+            pos = end - body + 1;
+        }
+    }
+    return pos == size;
+}
+
+static int script_cache_load(struct script_image *img, const char *cache_path,
+                             const char *real, const struct stat *src) {
+    int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct script_cache_header)) {
+        close(fd);
+        return -1;
+    }
+    //private pages because the argv built from the image points straight into it
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    struct script_cache_header h, want;
+    memcpy(&h, map, sizeof(h));
+    size_t path_len = strlen(real);
+    script_header_fill(&want, src, path_len);
+    want.nlines = h.nlines;
+    want.body_size = h.body_size;
+    size_t body_off = sizeof(h) + path_len;
+    if (memcmp(&h, &want, sizeof(h)) != 0 ||
+        (size_t)st.st_size != body_off + h.body_size ||
+        memcmp(map + sizeof(h), real, path_len) != 0 ||
+        !script_body_valid(map + body_off, h.body_size, h.nlines)) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    img->data = map;
+    img->size = st.st_size;
+    img->body = map + body_off;
+    img->body_size = h.body_size;
+    img->nlines = h.nlines;
+    img->mapped = true;
+    img->from_cache = true;
+    return 0;
+}
+
+//append to the image under construction, growing it as needed
+static int script_emit(struct script_image *img, const void *src, size_t n) {
+    if (img->size + n > img->cap) {
+        size_t cap = img->cap ? img->cap : 4096;
+        while (cap < img->size + n) cap *= 2;
+        char *grown = realloc(img->data, cap);
+        if (grown == NULL) {
+            perror("realloc failed");
+            return -1;
+        }
+        img->data = grown;
+        img->cap = cap;
+    }
+    memcpy(img->data + img->size, src, n);
+    img->size += n;
+    return 0;
+}
+
+static int script_compile(struct script_image *img, const char *script,
+                          const char *real, const struct stat *src) {
+    struct line_reader lr;
+    if (line_reader_open_file(&lr, script) != 0) {
+        return -1;
+    }
+
+    //the header and path go first so the buffer can be written out as is
+    struct script_cache_header h;
+    size_t path_len = strlen(real);
+    script_header_fill(&h, src, path_len);
+    int rc = script_emit(img, &h, sizeof(h));
+    if (rc == 0) rc = script_emit(img, real, path_len);
+    size_t body_off = img->size;
+
+    struct arena a;
+    arena_init(&a);
+    char *line;
+    while (rc == 0 && (line = line_reader_next(&lr)) != NULL) {
+        arena_reset(&a);
+        line = trim_white(line);
+        // Blank lines, comments and the #! line never reach the image
+        if (*line == '\0' || *line == '#') {
+            continue;
+        }
+
+        uint8_t flags = 0;
+        size_t len = strlen(line);
+        if (line[len - 1] == '&') {
+            flags |= SCRIPT_LINE_BACKGROUND;
+            line[len - 1] = '\0';
+            line = trim_white(line);
+        }
+        char *command = (flags & SCRIPT_LINE_BACKGROUND) ? arena_strdup(&a, line) : NULL;
+        char **args = cmd_parse_arena(&a, line);
+        if (args == NULL || args[0] == NULL ||
+            ((flags & SCRIPT_LINE_BACKGROUND) && command == NULL)) {
+            continue;
+        }
+
+        uint32_t argc = 0;
+        while (args[argc] != NULL) argc++;
+        rc = script_emit(img, &argc, sizeof(argc));
+        if (rc == 0) rc = script_emit(img, &flags, 1);
+        if (rc == 0 && command != NULL) rc = script_emit(img, command, strlen(command) + 1);
+        for (uint32_t i = 0; rc == 0 && i < argc; i++) {
+            rc = script_emit(img, args[i], strlen(args[i]) + 1);
+        }
+        img->nlines++;
+    }
+    arena_destroy(&a);
+    line_reader_close(&lr);
+    if (rc != 0) {
+        return -1;
+    }
+
+    //patch the totals into the header now that they are known
+    struct script_cache_header *hp = (struct script_cache_header *)img->data;
+    hp->nlines = img->nlines;
+    hp->body_size = img->size - body_off;
+    img->body = img->data + body_off;
+    img->body_size = hp->body_size;
+    return 0;
+}
+
+//write through a temporary file so readers never see half an image
+static void script_cache_store(const struct script_image *img, const char *cache_path) {
+    char *dir = strdup(cache_path);
+    char *slash = dir ? strrchr(dir, '/') : NULL;
+    if (slash != NULL) {
+        *slash = '\0';
+        mkdir(dir, 0700);
+    }
+    free(dir);
+
+    char *tmp = NULL;
+    if (asprintf(&tmp, "%s.%d", cache_path, (int)getpid()) == -1) {
+        return;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        free(tmp);
+        return;
+    }
+    size_t off = 0;
+    while (off < img->size) {
+        ssize_t n = write(fd, img->data + off, img->size - off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        off += n;
+    }
+    if (close(fd) == 0 && off == img->size) {
+        rename(tmp, cache_path);
+    } else {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+int script_image_open(struct script_image *img, const char *script) {
+    memset(img, 0, sizeof(*img));
+    struct stat st;
+    if (stat(script, &st) == -1) {
+        return -1;
+    }
+
+    char *real = realpath(script, NULL);
+    char *cache_path = script_cache_path(script);
+    if (real != NULL && cache_path != NULL &&
+        script_cache_load(img, cache_path, real, &st) == 0) {
+        free(real);
+        free(cache_path);
+        return 0;
+    }
+
+    int rc = script_compile(img, script, real != NULL ? real : script, &st);
+    if (rc == 0 && cache_path != NULL) {
+        script_cache_store(img, cache_path);
+    } else if (rc != 0) {
+        int saved = errno;
+        script_image_close(img);
+        errno = saved;
+    }
+    free(real);
+    free(cache_path);
+    return rc;
+}
+
+char **script_image_next(struct script_image *img, struct arena *a, bool *background,
+                         char **command) {
+    if (img->line >= img->nlines) {
+        return NULL;
+    }
+
+    const char *p = img->body + img->pos;
+    uint32_t argc;
+    memcpy(&argc, p, sizeof(argc));
+    uint8_t flags = p[sizeof(argc)];
+    p += sizeof(argc) + 1;
+
+    *background = (flags & SCRIPT_LINE_BACKGROUND) != 0;
+    *command = NULL;
+    if (*background) {
+        *command = (char *)p;
+        p += strlen(p) + 1;
+    }
+
+    //the argv array is fresh per run since pipeline_parse splits it in place
+    char **argv = arena_alloc(a, (argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < argc; i++) {
+        argv[i] = (char *)p;
+        p += strlen(p) + 1;
+    }
+    argv[argc] = NULL;
+
+    img->pos = p - img->body;
+    img->line++;
+    return argv;
+}
+
+void script_image_close(struct script_image *img) {
+    if (img->mapped) {
+        munmap(img->data, img->size);
+    } else {
+        free(img->data);
+    }
+    memset(img, 0, sizeof(*img));
+}
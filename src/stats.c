@@ -0,0 +1,121 @@
+/**
+ * @file stats.c
+ * @brief Latency histograms for each stage of running a command line
+ *
+ * Every stage the shell goes through for a line (prompt, readline, trim,
+ * parse, builtin dispatch, launch, exec to exit and terminal handoff) is
+ * timed with CLOCK_MONOTONIC and counted in a log-linear histogram in the
+ * HDR style: each power of two is split into 2^STAT_SUB_BITS equal
+ * buckets, so a bucket is never wider than 1/16 of the values in it. One
+ * histogram covers a nanosecond to centuries in a fixed array, recording
+ * is a count leading zeros and an increment, and percentiles are a walk
+ * over the buckets.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const char *const stat_names[STAT_COUNT] = {
+    [STAT_PROMPT] = "prompt",
+    [STAT_READLINE] = "readline",
+    [STAT_TRIM] = "trim",
+    [STAT_PARSE] = "parse",
+    [STAT_BUILTIN] = "builtin",
+    [STAT_LAUNCH] = "launch",
+    [STAT_EXEC] = "exec-exit",
+    [STAT_HANDOFF] = "handoff",
+};
+
+uint64_t stat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int stat_bucket(uint64_t ns) {
+    //values below two sub ranges are their own bucket
+    if (ns < (2u << STAT_SUB_BITS)) {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - STAT_SUB_BITS;
+    return ((shift + 1) << STAT_SUB_BITS) + (int)((ns >> shift) - (1u << STAT_SUB_BITS));
+}
+
+uint64_t stat_bucket_max(int bucket) {
+    if (bucket < (2 << STAT_SUB_BITS)) {
+        return (uint64_t)bucket;
+    }
+    int shift = (bucket >> STAT_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(bucket & ((1 << STAT_SUB_BITS) - 1)) + (1u << STAT_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void stat_record(struct shell *sh, enum stat_stage stage, uint64_t ns) {
+    struct stat_hist *h = &sh->stats[stage];
+    h->buckets[stat_bucket(ns)]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+}
+
+uint64_t stat_percentile(const struct stat_hist *h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+    //the smallest value with at least p percent of the samples at or below it
+    uint64_t want = (uint64_t)(p / 100.0 * (double)h->count + 0.5);
+    if (want < 1) want = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            uint64_t v = stat_bucket_max(i);
+            return v < h->max_ns ? v : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+void stat_reset(struct shell *sh) {
+    memset(sh->stats, 0, sizeof(sh->stats));
+}
+
+//durations with three significant digits and a unit that fits them
+static void stat_format(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.3gus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.3gms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.3gs", ns / 1e9);
+    }
+}
+
+void print_stats(struct shell *sh) {
+    struct outbuf ob;
+    outbuf_init(&ob, STDOUT_FILENO);
+    outbuf_printf(&ob, "%-10s %10s %10s %10s %10s %10s\n",
+                  "stage", "count", "mean", "p50", "p99", "max");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        const struct stat_hist *h = &sh->stats[i];
+        char mean[16], p50[16], p99[16], max[16];
+        stat_format(mean, sizeof(mean), h->count ? h->sum_ns / h->count : 0);
+        stat_format(p50, sizeof(p50), stat_percentile(h, 50));
+        stat_format(p99, sizeof(p99), stat_percentile(h, 99));
+        stat_format(max, sizeof(max), h->max_ns);
+        outbuf_printf(&ob, "%-10s %10llu %10s %10s %10s %10s\n", stat_names[i],
+                      (unsigned long long)h->count, mean, p50, p99, max);
+    }
+    outbuf_flush(&ob);
+}
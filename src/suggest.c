@@ -0,0 +1,298 @@
+/**
+ * @file suggest.c
+ * @brief Inline autosuggestions from history
+ *
+ * Every distinct history entry lives in a radix trie. Each node remembers
+ * the most frecent entry below it, so the suggestion for a prefix is found
+ * by walking the prefix alone, however large the history is. Frecency is
+ * the log of a sum of exponentially decayed uses, kept with log-sum-exp so
+ * it only ever grows and needs no rescaling: an entry used n commands ago
+ * counts half as much as one used now once n reaches SUGGEST_HALF_LIFE.
+ *
+ * Nodes and strings come from an arena that lives as long as the trie. The
+ * trie is built from the history on the first lookup and every command
+ * added afterwards goes straight in.
+ *
+ * @author nolanstetz
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "lab.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <readline/readline.h>
+
+struct suggest_entry {
+    const char *text;
+    size_t len;
+    double score;
+};
+
+struct suggest_node {
+    const char *label;
+    size_t label_len;
+    struct suggest_node *child;
+    struct suggest_node *next;
+    struct suggest_entry *entry;
+    struct suggest_entry *best;
+};
+
+static struct {
+    struct arena arena;
+    struct suggest_node root;
+    uint64_t seq;
+    bool loaded;
+    bool ghost_shown;
+} trie;
+
+static double log_add_exp(double a, double b) {
+    double hi = a > b ? a : b;
+    return hi + log1p(exp(-fabs(a - b)));
+}
+
+static struct suggest_node *suggest_child(struct suggest_node *node, char c) {
+    for (struct suggest_node *n = node->child; n != NULL; n = n->next) {
+        if (n->label[0] == c) return n;
+    }
+    return NULL;
+}
+
+static struct suggest_node *suggest_new_node(const char *label, size_t len) {
+    struct suggest_node *n = arena_alloc(&trie.arena, sizeof(*n));
+    if (n != NULL) {
+        memset(n, 0, sizeof(*n));
+        n->label = label;
+        n->label_len = len;
+    }
+    return n;
+}
+
+//find or create the node where text ends, splitting edges on the way
+static struct suggest_node *suggest_insert(const char *text, size_t len) {
+    struct suggest_node *node = &trie.root;
+    size_t i = 0;
+    while (i < len) {
+        struct suggest_node *child = suggest_child(node, text[i]);
+        if (child == NULL) {
+            child = suggest_new_node(text + i, len - i);
+            if (child == NULL) return NULL;
+            child->next = node->child;
+            node->child = child;
+            return child;
+        }
+
+        size_t common = 0;
+        while (common < child->label_len && i + common < len &&
+               child->label[common] == text[i + common]) {
+            common++;
+        }
+        if (common < child->label_len) {
+            //split the edge, the upper part keeps the subtree's best entry
+            struct suggest_node *mid = suggest_new_node(child->label, common);
+            if (mid == NULL) return NULL;
+            mid->best = child->best;
+            mid->child = child;
+            mid->next = child->next;
+            child->label += common;
+            child->label_len -= common;
+            child->next = NULL;
+
+            struct suggest_node **link = &node->child;
+            while (*link != child) link = &(*link)->next;
+            *link = mid;
+            child = mid;
+        }
+        node = child;
+        i += common;
+    }
+    return node;
+}
+
+//the node where text ends, if the trie has it
+static struct suggest_node *suggest_find(const char *text, size_t len) {
+    struct suggest_node *node = &trie.root;
+    size_t i = 0;
+    while (i < len) {
+        node = suggest_child(node, text[i]);
+        if (node == NULL || node->label_len > len - i ||
+            memcmp(node->label, text + i, node->label_len) != 0) {
+            return NULL;
+        }
+        i += node->label_len;
+    }
+    return node;
+}
+
+static void suggest_use(const char *line, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    struct suggest_node *node = suggest_find(line, len);
+    if (node == NULL || node->entry == NULL) {
+        //edge labels point into the copy, so it has to exist before inserting
+        struct suggest_entry *e = arena_alloc(&trie.arena, sizeof(*e));
+        char *text = arena_alloc(&trie.arena, len + 1);
+        if (e == NULL || text == NULL) {
+            return;
+        }
+        memcpy(text, line, len);
+        text[len] = '\0';
+        node = suggest_insert(text, len);
+        if (node == NULL) {
+            return;
+        }
+        e->text = text;
+        e->len = len;
+        e->score = -INFINITY;
+        node->entry = e;
+    }
+
+    struct suggest_entry *e = node->entry;
+    double now = (double)trie.seq++ * (M_LN2 / SUGGEST_HALF_LIFE);
+    e->score = e->score == -INFINITY ? now : log_add_exp(e->score, now);
+
+    //scores only grow, so the best entry along the path can only become this one
+    node = &trie.root;
+    size_t i = 0;
+    for (;;) {
+        if (node->best == NULL || node->best == e || e->score > node->best->score) {
+            node->best = e;
+        }
+        if (i == len) break;
+        node = suggest_child(node, line[i]);
+        i += node->label_len;
+    }
+}
+
+static void suggest_load_entry(const char *line, size_t len, void *ctx) {
+    UNUSED(ctx)
+    suggest_use(line, len);
+}
+
+static void suggest_load(void) {
+    trie.loaded = true;
+    arena_init(&trie.arena);
+    history_each_entry(suggest_load_entry, NULL);
+}
+
+void suggest_add(const char *line) {
+    //before the first lookup the history itself is the source
+    if (trie.loaded) {
+        suggest_use(line, strlen(line));
+    }
+}
+
+const char *suggest_lookup(const char *prefix, size_t len) {
+    if (!trie.loaded) {
+        suggest_load();
+    }
+    struct suggest_node *node = &trie.root;
+    size_t i = 0;
+    while (i < len) {
+        node = suggest_child(node, prefix[i]);
+        if (node == NULL) {
+            return NULL;
+        }
+        size_t n = node->label_len < len - i ? node->label_len : len - i;
+        if (memcmp(node->label, prefix + i, n) != 0) {
+            return NULL;
+        }
+        i += n;
+    }
+    return node->best != NULL ? node->best->text : NULL;
+}
+
+void suggest_clear(void) {
+    if (trie.loaded) {
+        arena_destroy(&trie.arena);
+    }
+    memset(&trie, 0, sizeof(trie));
+}
+
+//columns taken by the last line of the prompt, skipping escape sequences
+static int prompt_width(void) {
+    const char *p = rl_display_prompt != NULL ? rl_display_prompt : "";
+    int width = 0;
+    bool hidden = false;
+    for (; *p; p++) {
+        if (*p == RL_PROMPT_START_IGNORE) {
+            hidden = true;
+        } else if (*p == RL_PROMPT_END_IGNORE) {
+            hidden = false;
+        } else if (*p == '\n') {
+            width = 0;
+        } else if (*p == '\033' && p[1] == '[') {
+            p += 2;
+            while (*p && !(*p >= '@' && *p <= '~')) p++;
+            if (*p == '\0') break;
+        } else if (!hidden) {
+            width++;
+        }
+    }
+    return width;
+}
+
+//wipe the dimmed text that follows the end of the line
+static void suggest_erase_ghost(void) {
+    if (!trie.ghost_shown) {
+        return;
+    }
+    if (rl_end > rl_point) {
+        fprintf(rl_outstream, "\0337\033[%dC\033[K\0338", rl_end - rl_point);
+    } else {
+        fputs("\033[K", rl_outstream);
+    }
+    trie.ghost_shown = false;
+    fflush(rl_outstream);
+}
+
+//draw the rest of the suggestion dimmed after the cursor, without moving it
+static void suggest_redisplay(void) {
+    rl_redisplay();
+    if (rl_point != rl_end) {
+        suggest_erase_ghost();
+        return;
+    }
+
+    const char *s = rl_end > 0 ? suggest_lookup(rl_line_buffer, rl_end) : NULL;
+    int rows, cols;
+    rl_get_screen_size(&rows, &cols);
+    int room = cols - prompt_width() - rl_end - 1;
+    if (s == NULL || (size_t)rl_end >= strlen(s) || room <= 0) {
+        suggest_erase_ghost();
+        return;
+    }
+    fprintf(rl_outstream, "\033[K\0337\033[2m%.*s\033[0m\0338", room, s + rl_end);
+    trie.ghost_shown = true;
+    fflush(rl_outstream);
+}
+
+//right arrow, C-f and C-e at the end of the line take the suggestion
+static int suggest_accept(int count, int key) {
+    if (rl_point == rl_end && rl_end > 0) {
+        const char *s = suggest_lookup(rl_line_buffer, rl_end);
+        if (s != NULL && strlen(s) > (size_t)rl_end) {
+            rl_insert_text(s + rl_end);
+            return 0;
+        }
+    }
+    return key == CTRL('e') ? rl_end_of_line(count, key) : rl_forward_char(count, key);
+}
+
+static int suggest_newline(int count, int key) {
+    //the accepted line must not keep the dimmed text behind it
+    suggest_erase_ghost();
+    return rl_newline(count, key);
+}
+
+void suggest_bind(void) {
+    rl_redisplay_function = suggest_redisplay;
+    rl_bind_keyseq("\\e[C", suggest_accept);
+    rl_bind_keyseq("\\eOC", suggest_accept);
+    rl_bind_key(CTRL('f'), suggest_accept);
+    rl_bind_key(CTRL('e'), suggest_accept);
+    rl_bind_key('\r', suggest_newline);
+    rl_bind_key('\n', suggest_newline);
+}
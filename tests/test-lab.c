@@ -1,4 +1,10 @@
 #include <string.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <readline/history.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -49,6 +55,1079 @@ void test_cmd_parse(void)
      cmd_free(rval);
 }
 
+void test_cmd_parse_many_tokens(void)
+{
+     //more tokens than the builder starts with so it has to grow
+     char line[256] = {0};
+     for (int i = 0; i < 50; i++) {
+          strcat(line, "a ");
+     }
+     char **rval = cmd_parse(line);
+     TEST_ASSERT_TRUE(rval);
+     for (int i = 0; i < 50; i++) {
+          TEST_ASSERT_EQUAL_STRING("a", rval[i]);
+     }
+     TEST_ASSERT_FALSE(rval[50]);
+     cmd_free(rval);
+}
+
+void test_argv_builder_byte_limit(void)
+{
+     struct argv_builder ab;
+     TEST_ASSERT_EQUAL_INT(0, argv_builder_init(&ab));
+     ab.byte_limit = 2 * (sizeof(char *) + 4);
+     TEST_ASSERT_EQUAL_INT(0, argv_builder_push(&ab, "foo"));
+     TEST_ASSERT_EQUAL_INT(0, argv_builder_push(&ab, "bar"));
+     TEST_ASSERT_EQUAL_INT(-1, argv_builder_push(&ab, "baz"));
+     TEST_ASSERT_EQUAL_INT(2, ab.argc);
+     TEST_ASSERT_FALSE(ab.argv[2]);
+     argv_builder_destroy(&ab);
+}
+
+void test_cmd_parse_inplace(void)
+{
+     char line[] = "  ls\t-a   -l ";
+     char **rval = cmd_parse_inplace(line);
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("ls", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("-a", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("-l", rval[2]);
+     TEST_ASSERT_FALSE(rval[3]);
+     //the tokens point into the original line
+     TEST_ASSERT_TRUE(rval[0] >= line && rval[0] < line + sizeof(line));
+     TEST_ASSERT_TRUE(rval[2] >= line && rval[2] < line + sizeof(line));
+     cmd_free_inplace(rval);
+}
+
+void test_arena_reset_reuses_blocks(void)
+{
+     struct arena a;
+     arena_init(&a);
+     char *first = arena_strdup(&a, "hello");
+     TEST_ASSERT_EQUAL_STRING("hello", first);
+     //larger than a block so the arena has to chain a second one
+     char *big = arena_alloc(&a, ARENA_BLOCK_SIZE * 2);
+     TEST_ASSERT_TRUE(big);
+     memset(big, 'x', ARENA_BLOCK_SIZE * 2);
+     arena_reset(&a);
+     //after a reset the first block is handed out again
+     char *again = arena_strdup(&a, "world");
+     TEST_ASSERT_EQUAL_PTR(first, again);
+     char *big_again = arena_alloc(&a, ARENA_BLOCK_SIZE * 2);
+     TEST_ASSERT_EQUAL_PTR(big, big_again);
+     arena_destroy(&a);
+}
+
+void test_cmd_parse_arena(void)
+{
+     struct arena a;
+     arena_init(&a);
+     char *line = arena_strdup(&a, "a b c d e f g h i j k");
+     char **rval = cmd_parse_arena(&a, line);
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("a", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("k", rval[10]);
+     TEST_ASSERT_FALSE(rval[11]);
+     arena_destroy(&a);
+}
+
+void test_cmd_hash_lookup(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char *old_path = strdup(getenv("PATH"));
+     setenv("PATH", "/nonexistent:/bin:/usr/bin", 1);
+     const char *path = cmd_hash_lookup(&sh, "sh");
+     TEST_ASSERT_EQUAL_STRING("/bin/sh", path);
+     //a second lookup is served from the table
+     TEST_ASSERT_EQUAL_PTR(path, cmd_hash_lookup(&sh, "sh"));
+     TEST_ASSERT_NULL(cmd_hash_lookup(&sh, "no-such-command-here"));
+     cmd_hash_destroy(&sh);
+     setenv("PATH", old_path, 1);
+     free(old_path);
+}
+
+//an executable file called name in dir, with body as its contents
+static void write_executable(const char *dir, const char *name, const char *body,
+                             char *path, size_t size)
+{
+     snprintf(path, size, "%s/%s", dir, name);
+     int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+     TEST_ASSERT_TRUE(fd >= 0);
+     TEST_ASSERT_EQUAL_INT((int)strlen(body), (int)write(fd, body, strlen(body)));
+     close(fd);
+}
+
+void test_cmd_hash_path_change(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char dir_a[] = "/tmp/hash-a-XXXXXX", dir_b[] = "/tmp/hash-b-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir_a));
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir_b));
+     char cmd_a[PATH_MAX], cmd_b[PATH_MAX];
+     write_executable(dir_a, "hashcmd", "exit 0\n", cmd_a, sizeof(cmd_a));
+     write_executable(dir_b, "hashcmd", "exit 0\n", cmd_b, sizeof(cmd_b));
+
+     char *old_path = strdup(getenv("PATH"));
+     setenv("PATH", dir_a, 1);
+     TEST_ASSERT_EQUAL_STRING(cmd_a, cmd_hash_lookup(&sh, "hashcmd"));
+     TEST_ASSERT_EQUAL_INT(0, cmd_hash_pin(&sh, "mine", "/bin/true"));
+     //changing PATH drops searched entries but keeps pinned ones
+     setenv("PATH", dir_b, 1);
+     TEST_ASSERT_EQUAL_STRING(cmd_b, cmd_hash_lookup(&sh, "hashcmd"));
+     TEST_ASSERT_EQUAL_STRING("/bin/true", cmd_hash_lookup(&sh, "mine"));
+     //with no PATH at all the system default is searched, as execvp does
+     unsetenv("PATH");
+     TEST_ASSERT_NOT_NULL(cmd_hash_lookup(&sh, "sh"));
+     cmd_hash_clear(&sh);
+     TEST_ASSERT_NULL(cmd_hash_lookup(&sh, "mine"));
+     cmd_hash_destroy(&sh);
+     setenv("PATH", old_path, 1);
+     free(old_path);
+     unlink(cmd_a);
+     unlink(cmd_b);
+     rmdir(dir_a);
+     rmdir(dir_b);
+}
+
+void test_launch_script_without_shebang(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char dir[] = "/tmp/noexec-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char script[PATH_MAX];
+     write_executable(dir, "script", "exit 7\n", script, sizeof(script));
+     char *argv[] = {script, NULL};
+     //like execvp, a file the kernel can't run is handed to /bin/sh
+     const char *backends[] = {"spawn", "fork"};
+     for (int i = 0; i < 2; i++) {
+          TEST_ASSERT_EQUAL_INT(0, set_launch_backend(&sh, backends[i]));
+          pid_t pid = launch_process(&sh, argv, false);
+          TEST_ASSERT_TRUE(pid > 0);
+          int status;
+          TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+          TEST_ASSERT_TRUE(WIFEXITED(status));
+          TEST_ASSERT_EQUAL_INT(7, WEXITSTATUS(status));
+     }
+     unlink(script);
+     rmdir(dir);
+     sh_destroy(&sh);
+}
+
+void test_background_exit_code(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     sh.next_job_id = 1;
+     TEST_ASSERT_EQUAL_INT(0, job_events_init(&sh));
+     char *args[] = {"sh", "-c", "exit 3", NULL};
+     TEST_ASSERT_EQUAL_INT(0, start_background_process(&sh, args, "sh -c exit 3"));
+     for (int i = 0; i < 500 && sh.bg_jobs[0].status == 0; i++) {
+          usleep(10000);
+          check_background_processes(&sh);
+     }
+     TEST_ASSERT_EQUAL_INT(1, sh.bg_jobs[0].status);
+     TEST_ASSERT_EQUAL_INT(3, sh.bg_jobs[0].exit_code);
+     sh_destroy(&sh);
+}
+
+void test_job_table_recycles_slots(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     sh.next_job_id = 1;
+     set_max_jobs(&sh, 4);
+     char *args[] = {"true", NULL};
+     //more launches than the cap, reaping in between frees the slots
+     for (int round = 0; round < 5; round++) {
+          for (int i = 0; i < 4; i++) {
+               TEST_ASSERT_EQUAL_INT(0, start_background_process(&sh, args, "true"));
+          }
+          for (int i = 0; i < sh.bg_job_slots; i++) {
+               int status;
+               waitpid(sh.bg_jobs[i].pid, &status, 0);
+               sh.bg_jobs[i].status = 1;
+          }
+          TEST_ASSERT_NOT_NULL(find_job_by_pid(&sh, sh.bg_jobs[0].pid));
+     }
+     TEST_ASSERT_TRUE(sh.bg_job_cap <= BG_JOBS_INITIAL_CAP);
+     print_jobs(&sh);
+     TEST_ASSERT_EQUAL_INT(0, sh.bg_job_count);
+     TEST_ASSERT_NULL(find_job_by_pid(&sh, 12345));
+     sh_destroy(&sh);
+}
+
+void test_job_table_full_reports_before_evicting(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     sh.next_job_id = 1;
+     set_max_jobs(&sh, 1);
+     char *done[] = {"true", NULL};
+     char *running[] = {"sleep", "5", NULL};
+     char out[] = "/tmp/jobs-out-XXXXXX";
+     int fd = mkstemp(out);
+     TEST_ASSERT_TRUE(fd >= 0);
+     fflush(stdout);
+     int saved = dup(STDOUT_FILENO);
+     dup2(fd, STDOUT_FILENO);
+
+     TEST_ASSERT_EQUAL_INT(0, start_background_process(&sh, done, "true"));
+     waitpid(sh.bg_jobs[0].pid, NULL, 0);
+     sh.bg_jobs[0].status = 1;
+     //the finished job makes room, but only once it has been reported
+     int first = start_background_process(&sh, running, "sleep 5");
+     //a running job is never evicted
+     int second = start_background_process(&sh, done, "true");
+     fflush(stdout);
+     dup2(saved, STDOUT_FILENO);
+     close(saved);
+
+     char buf[256] = {0};
+     TEST_ASSERT_TRUE(pread(fd, buf, sizeof(buf) - 1, 0) > 0);
+     close(fd);
+     unlink(out);
+     TEST_ASSERT_EQUAL_INT(0, first);
+     TEST_ASSERT_EQUAL_INT(-1, second);
+     TEST_ASSERT_NOT_NULL(strstr(buf, "[1] Done    true"));
+     kill(sh.bg_jobs[0].pid, SIGKILL);
+     waitpid(sh.bg_jobs[0].pid, NULL, 0);
+     sh_destroy(&sh);
+}
+
+void test_wait_for_jobs_timeout(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     sh.next_job_id = 1;
+     TEST_ASSERT_EQUAL_INT(0, job_events_init(&sh));
+     char *args[] = {"sleep", "10", NULL};
+     TEST_ASSERT_EQUAL_INT(0, start_background_process(&sh, args, "sleep 10"));
+     //nothing finishes within the timeout
+     TEST_ASSERT_EQUAL_INT(0, wait_for_jobs(&sh, 10));
+     kill(sh.bg_jobs[0].pid, SIGKILL);
+     int finished = 0;
+     for (int i = 0; i < 10 && finished == 0; i++) {
+          finished = wait_for_jobs(&sh, 1000);
+     }
+     TEST_ASSERT_EQUAL_INT(1, finished);
+     TEST_ASSERT_EQUAL_INT(1, sh.bg_jobs[0].status);
+     TEST_ASSERT_EQUAL_INT(128 + SIGKILL, sh.bg_jobs[0].exit_code);
+     TEST_ASSERT_TRUE(WIFSIGNALED(sh.bg_jobs[0].wait_status));
+     sh_destroy(&sh);
+}
+
+void test_cmd_parse_pipe_tokens(void)
+{
+     char line[] = "ls -l|wc | grep x";
+     char **rval = cmd_parse_inplace(line);
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("ls", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("-l", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("|", rval[2]);
+     TEST_ASSERT_EQUAL_STRING("wc", rval[3]);
+     TEST_ASSERT_EQUAL_STRING("|", rval[4]);
+     TEST_ASSERT_EQUAL_STRING("grep", rval[5]);
+     TEST_ASSERT_EQUAL_STRING("x", rval[6]);
+     TEST_ASSERT_FALSE(rval[7]);
+
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(rval, &pl));
+     TEST_ASSERT_EQUAL_INT(3, pl.nstages);
+     TEST_ASSERT_EQUAL_STRING("ls", pl.stages[0][0]);
+     TEST_ASSERT_FALSE(pl.stages[0][2]);
+     TEST_ASSERT_EQUAL_STRING("wc", pl.stages[1][0]);
+     TEST_ASSERT_EQUAL_STRING("x", pl.stages[2][1]);
+     pipeline_free(&pl);
+     cmd_free_inplace(rval);
+}
+
+void test_pipeline_syntax_error(void)
+{
+     char line[] = "ls | | wc";
+     char **rval = cmd_parse_inplace(line);
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(-1, pipeline_parse(rval, &pl));
+     cmd_free_inplace(rval);
+}
+
+void test_pipeline_status(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     //no quoting in this shell, build the argv by hand
+     char *first[] = {"sh", "-c", "exit 3", "|", "true", NULL};
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(first, &pl));
+     TEST_ASSERT_TRUE(launch_pipeline(&sh, &pl, false) > 0);
+     TEST_ASSERT_EQUAL_INT(0, wait_pipeline(&sh, &pl));
+     pipeline_free(&pl);
+
+     char *second[] = {"sh", "-c", "exit 3", "|", "true", NULL};
+     TEST_ASSERT_EQUAL_INT(0, set_shell_option(&sh, "pipefail", true));
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(second, &pl));
+     TEST_ASSERT_TRUE(launch_pipeline(&sh, &pl, false) > 0);
+     TEST_ASSERT_EQUAL_INT(3, wait_pipeline(&sh, &pl));
+     pipeline_free(&pl);
+     sh_destroy(&sh);
+}
+
+void test_pipeline_redirections(void)
+{
+     char line[] = "sort<in -r 2>>err|wc>out 2>&1";
+     char **rval = cmd_parse_inplace(line);
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(rval, &pl));
+     TEST_ASSERT_EQUAL_INT(2, pl.nstages);
+     TEST_ASSERT_EQUAL_STRING("sort", pl.stages[0][0]);
+     TEST_ASSERT_EQUAL_STRING("-r", pl.stages[0][1]);
+     TEST_ASSERT_FALSE(pl.stages[0][2]);
+     TEST_ASSERT_EQUAL_STRING("wc", pl.stages[1][0]);
+     TEST_ASSERT_FALSE(pl.stages[1][1]);
+     TEST_ASSERT_EQUAL_INT(4, pl.nredirs);
+     TEST_ASSERT_EQUAL_INT(REDIR_IN, pl.redirs[0].kind);
+     TEST_ASSERT_EQUAL_INT(0, pl.redirs[0].fd);
+     TEST_ASSERT_EQUAL_STRING("in", pl.redirs[0].target);
+     TEST_ASSERT_EQUAL_INT(REDIR_APPEND, pl.redirs[1].kind);
+     TEST_ASSERT_EQUAL_INT(2, pl.redirs[1].fd);
+     TEST_ASSERT_EQUAL_INT(1, pl.redirs[2].stage);
+     TEST_ASSERT_EQUAL_INT(REDIR_OUT, pl.redirs[2].kind);
+     TEST_ASSERT_EQUAL_INT(REDIR_DUP, pl.redirs[3].kind);
+     TEST_ASSERT_EQUAL_STRING("1", pl.redirs[3].target);
+     pipeline_free(&pl);
+     cmd_free_inplace(rval);
+}
+
+void test_redirect_output_to_file(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char path[] = "/tmp/test-lab-redirXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+     char *argv[] = {"sh", "-c", "echo out; echo err >&2", ">", path, "2>&", "1", NULL};
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(argv, &pl));
+     TEST_ASSERT_TRUE(launch_pipeline(&sh, &pl, false) > 0);
+     TEST_ASSERT_EQUAL_INT(0, wait_pipeline(&sh, &pl));
+     pipeline_free(&pl);
+
+     char buf[64] = {0};
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+     fclose(f);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING("out\nerr\n", buf);
+     TEST_ASSERT_EQUAL_INT(8, n);
+     sh_destroy(&sh);
+}
+
+void test_redirect_sources_do_not_collide(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char a[] = "/tmp/test-lab-redir-aXXXXXX", b[] = "/tmp/test-lab-redir-bXXXXXX";
+     close(mkstemp(a));
+     close(mkstemp(b));
+     //name the fd the second file would have been opened at, N>a >b
+     int probe = open("/dev/null", O_RDONLY);
+     TEST_ASSERT_TRUE(probe >= 0 && probe < 9);
+     close(probe);
+     char target[4];
+     snprintf(target, sizeof(target), "%d>", probe + 1);
+     char *argv[] = {"sh", "-c", "echo out", target, a, ">", b, NULL};
+     const char *backends[] = {"spawn", "fork"};
+     for (int i = 0; i < 2; i++) {
+          TEST_ASSERT_EQUAL_INT(0, set_launch_backend(&sh, backends[i]));
+          struct pipeline pl;
+          TEST_ASSERT_EQUAL_INT(0, pipeline_parse(argv, &pl));
+          TEST_ASSERT_TRUE(launch_pipeline(&sh, &pl, false) > 0);
+          TEST_ASSERT_EQUAL_INT(0, wait_pipeline(&sh, &pl));
+          pipeline_free(&pl);
+
+          char buf[16] = {0};
+          int fd = open(b, O_RDONLY);
+          TEST_ASSERT_EQUAL_INT(4, read(fd, buf, sizeof(buf)));
+          close(fd);
+          TEST_ASSERT_EQUAL_STRING("out\n", buf);
+          struct stat st;
+          TEST_ASSERT_EQUAL_INT(0, stat(a, &st));
+          TEST_ASSERT_EQUAL_INT(0, st.st_size);
+     }
+     unlink(a);
+     unlink(b);
+     sh_destroy(&sh);
+}
+
+void test_line_reader_string(void)
+{
+     struct line_reader lr;
+     TEST_ASSERT_EQUAL_INT(0, line_reader_open_string(&lr, "echo a\n\nls -l"));
+     TEST_ASSERT_EQUAL_STRING("echo a", line_reader_next(&lr));
+     TEST_ASSERT_EQUAL_STRING("", line_reader_next(&lr));
+     TEST_ASSERT_EQUAL_STRING("ls -l", line_reader_next(&lr));
+     TEST_ASSERT_NULL(line_reader_next(&lr));
+     line_reader_close(&lr);
+}
+
+void test_line_reader_file_and_pipe(void)
+{
+     char path[] = "/tmp/test-lab-scriptXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     //no trailing newline so the last line of the mapping is copied out
+     TEST_ASSERT_EQUAL_INT(13, write(fd, "echo 1\necho 2", 13));
+     close(fd);
+
+     struct line_reader lr;
+     TEST_ASSERT_EQUAL_INT(0, line_reader_open_file(&lr, path));
+     TEST_ASSERT_TRUE(lr.mapped);
+     TEST_ASSERT_EQUAL_STRING("echo 1", line_reader_next(&lr));
+     TEST_ASSERT_EQUAL_STRING("echo 2", line_reader_next(&lr));
+     TEST_ASSERT_NULL(line_reader_next(&lr));
+     line_reader_close(&lr);
+     unlink(path);
+
+     //a line longer than one chunk arriving through a pipe
+     int p[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(p));
+     pid_t pid = fork();
+     TEST_ASSERT_TRUE(pid >= 0);
+     if (pid == 0) {
+          close(p[0]);
+          static char big[LINE_READER_CHUNK + 100];
+          memset(big, 'x', sizeof(big));
+          big[sizeof(big) - 1] = '\n';
+          if (write(p[1], big, sizeof(big)) != (ssize_t)sizeof(big)) _exit(1);
+          if (write(p[1], "tail", 4) != 4) _exit(1);
+          _exit(0);
+     }
+     close(p[1]);
+     TEST_ASSERT_EQUAL_INT(0, line_reader_open_fd(&lr, p[0]));
+     TEST_ASSERT_FALSE(lr.mapped);
+     char *line = line_reader_next(&lr);
+     TEST_ASSERT_NOT_NULL(line);
+     TEST_ASSERT_EQUAL_INT(LINE_READER_CHUNK + 99, strlen(line));
+     TEST_ASSERT_EQUAL_STRING("tail", line_reader_next(&lr));
+     TEST_ASSERT_NULL(line_reader_next(&lr));
+     line_reader_close(&lr);
+     close(p[0]);
+     waitpid(pid, NULL, 0);
+}
+
+void test_script_image_cache(void)
+{
+     char dir[] = "/tmp/test-lab-cacheXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     setenv("MY_SCRIPT_CACHE", dir, 1);
+     char path[] = "/tmp/test-lab-scriptXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     const char *text = "#!/bin/myprogram\nls -l | wc\n\nsleep 1 &\n";
+     TEST_ASSERT_EQUAL_INT(strlen(text), write(fd, text, strlen(text)));
+     close(fd);
+
+     struct arena a;
+     arena_init(&a);
+     struct script_image img;
+     bool bg;
+     char *command;
+     for (int run = 0; run < 2; run++) {
+          //the first run compiles and stores, the second maps the stored image
+          TEST_ASSERT_EQUAL_INT(0, script_image_open(&img, path));
+          TEST_ASSERT_EQUAL(run == 1, img.from_cache);
+          char **argv = script_image_next(&img, &a, &bg, &command);
+          TEST_ASSERT_NOT_NULL(argv);
+          TEST_ASSERT_FALSE(bg);
+          TEST_ASSERT_EQUAL_STRING("ls", argv[0]);
+          TEST_ASSERT_EQUAL_STRING("|", argv[2]);
+          TEST_ASSERT_EQUAL_STRING("wc", argv[3]);
+          TEST_ASSERT_NULL(argv[4]);
+          argv = script_image_next(&img, &a, &bg, &command);
+          TEST_ASSERT_NOT_NULL(argv);
+          TEST_ASSERT_TRUE(bg);
+          TEST_ASSERT_EQUAL_STRING("sleep 1", command);
+          TEST_ASSERT_NULL(script_image_next(&img, &a, &bg, &command));
+          script_image_close(&img);
+     }
+
+     //a changed script is compiled again
+     fd = open(path, O_WRONLY | O_APPEND);
+     TEST_ASSERT_EQUAL_INT(5, write(fd, "true\n", 5));
+     close(fd);
+     TEST_ASSERT_EQUAL_INT(0, script_image_open(&img, path));
+     TEST_ASSERT_FALSE(img.from_cache);
+     TEST_ASSERT_EQUAL_INT(3, img.nlines);
+     script_image_close(&img);
+
+     char *cache = script_cache_path(path);
+     TEST_ASSERT_NOT_NULL(cache);
+     unlink(cache);
+     free(cache);
+     unlink(path);
+     rmdir(dir);
+     unsetenv("MY_SCRIPT_CACHE");
+     arena_destroy(&a);
+}
+
+void test_history_file(void)
+{
+     char path[] = "/tmp/test-lab-historyXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     const char *text = "ls\npwd\necho a\necho b\n";
+     TEST_ASSERT_EQUAL_INT(strlen(text), write(fd, text, strlen(text)));
+     close(fd);
+
+     //only the newest entries reach readline
+     using_history();
+     TEST_ASSERT_EQUAL_INT(0, history_open(path, 2));
+     TEST_ASSERT_EQUAL_INT(2, history_length);
+     TEST_ASSERT_EQUAL_STRING("echo a", history_list()[0]->line);
+     TEST_ASSERT_EQUAL_STRING("echo b", history_list()[1]->line);
+
+     TEST_ASSERT_EQUAL_INT(0, history_append("cd /tmp"));
+     TEST_ASSERT_EQUAL_INT(3, history_length);
+     history_close();
+     clear_history();
+
+     char buf[64] = {0};
+     fd = open(path, O_RDONLY);
+     TEST_ASSERT_TRUE(read(fd, buf, sizeof(buf) - 1) > 0);
+     close(fd);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING("ls\npwd\necho a\necho b\ncd /tmp\n", buf);
+}
+
+void test_history_find(void)
+{
+     char path[] = "/tmp/test-lab-historyXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     const char *text = "make check\ngit status\nmake clean\nls\n";
+     TEST_ASSERT_EQUAL_INT(strlen(text), write(fd, text, strlen(text)));
+     close(fd);
+
+     TEST_ASSERT_EQUAL_INT(0, history_open(path, 0));
+     TEST_ASSERT_EQUAL_INT(2, history_find_prev("make", SIZE_MAX));
+     TEST_ASSERT_EQUAL_INT(0, history_find_prev("make", 2));
+     TEST_ASSERT_EQUAL_INT(-1, history_find_prev("make", 0));
+     TEST_ASSERT_EQUAL_INT(-1, history_find_prev("cargo", SIZE_MAX));
+     //short patterns have no trigram and scan every entry
+     TEST_ASSERT_EQUAL_INT(3, history_find_prev("ls", SIZE_MAX));
+
+     //entries added after the index was built are found too
+     TEST_ASSERT_EQUAL_INT(0, history_append("git push"));
+     TEST_ASSERT_EQUAL_INT(4, history_find_prev("git", SIZE_MAX));
+     TEST_ASSERT_EQUAL_INT(1, history_find_prev("git", 4));
+     history_close();
+     clear_history();
+     unlink(path);
+}
+
+void test_suggest_frecency(void)
+{
+     char path[] = "/tmp/test-lab-historyXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     const char *text = "git status\ngit status\ngit status\ngit stash\nls -l\n";
+     TEST_ASSERT_EQUAL_INT(strlen(text), write(fd, text, strlen(text)));
+     close(fd);
+     TEST_ASSERT_EQUAL_INT(0, history_open(path, 0));
+
+     //frequent beats slightly more recent
+     TEST_ASSERT_EQUAL_STRING("git status", suggest_lookup("g", 1));
+     TEST_ASSERT_EQUAL_STRING("git stash", suggest_lookup("git stas", 8));
+     TEST_ASSERT_EQUAL_STRING("ls -l", suggest_lookup("ls", 2));
+     TEST_ASSERT_NULL(suggest_lookup("make", 4));
+
+     //old uses decay, so a fresh command takes over after enough history
+     for (int i = 0; i < 4 * SUGGEST_HALF_LIFE; i++) {
+          suggest_add("ls");
+     }
+     suggest_add("git stash");
+     TEST_ASSERT_EQUAL_STRING("git stash", suggest_lookup("git", 3));
+     TEST_ASSERT_EQUAL_STRING("ls", suggest_lookup("l", 1));
+     history_close();
+     clear_history();
+     unlink(path);
+}
+
+void test_outbuf_chunks(void)
+{
+     char path[] = "/tmp/test-lab-outbufXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+
+     //enough lines to need several chunks, plus one write bigger than a chunk
+     static struct outbuf ob;
+     outbuf_init(&ob, fd);
+     for (int i = 0; i < 10000; i++) {
+          outbuf_printf(&ob, "%d: entry\n", i);
+     }
+     static char big[OUTBUF_CHUNK + 10];
+     memset(big, 'x', sizeof(big));
+     outbuf_write(&ob, big, sizeof(big));
+     outbuf_printf(&ob, "end\n");
+     TEST_ASSERT_EQUAL_INT(0, outbuf_flush(&ob));
+
+     off_t size = lseek(fd, 0, SEEK_END);
+     char tail[4] = {0};
+     TEST_ASSERT_EQUAL_INT(4, pread(fd, tail, 4, size - 4));
+     char first[9] = {0};
+     TEST_ASSERT_EQUAL_INT(9, pread(fd, first, 9, 0));
+     close(fd);
+     unlink(path);
+
+     size_t lines = 0;
+     for (int i = 0; i < 10000; i++) {
+          char line[32];
+          lines += snprintf(line, sizeof(line), "%d: entry\n", i);
+     }
+     TEST_ASSERT_EQUAL_INT(lines + sizeof(big) + 4, size);
+     TEST_ASSERT_EQUAL_MEMORY("end\n", tail, 4);
+     TEST_ASSERT_EQUAL_MEMORY("0: entry\n", first, 9);
+}
+
+void test_sh_prompt_cached(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     setenv("MY_PROMPT", "a> ", 1);
+     const char *p = sh_prompt(&sh);
+     TEST_ASSERT_EQUAL_STRING("a> ", p);
+
+     //the environment is not looked at again until the prompt is invalidated
+     setenv("MY_PROMPT", "b> ", 1);
+     TEST_ASSERT_EQUAL_PTR(p, sh_prompt(&sh));
+     sh_prompt_invalidate(&sh);
+     TEST_ASSERT_EQUAL_STRING("b> ", sh_prompt(&sh));
+     unsetenv("MY_PROMPT");
+     sh_destroy(&sh);
+}
+
+void test_sh_prompt_escapes(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char cwd[PATH_MAX];
+     TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+     setenv("MY_PROMPT", "\\w \\? \\j\\\\ \\x> ", 1);
+     char *home = getenv("HOME") ? strdup(getenv("HOME")) : NULL;
+     setenv("HOME", "/nonexistent-home", 1);
+
+     char want[PATH_MAX + 32];
+     snprintf(want, sizeof(want), "%s 0 0\\ \\x> ", cwd);
+     TEST_ASSERT_EQUAL_STRING(want, sh_prompt(&sh));
+
+     //a new status is picked up without invalidating by hand
+     sh.last_status = 3;
+     snprintf(want, sizeof(want), "%s 3 0\\ \\x> ", cwd);
+     TEST_ASSERT_EQUAL_STRING(want, sh_prompt(&sh));
+
+     //the home directory is shown as ~
+     setenv("HOME", cwd, 1);
+     sh_prompt_invalidate(&sh);
+     TEST_ASSERT_EQUAL_STRING("~ 3 0\\ \\x> ", sh_prompt(&sh));
+
+     if (home != NULL) {
+          setenv("HOME", home, 1);
+          free(home);
+     }
+     unsetenv("MY_PROMPT");
+     sh_destroy(&sh);
+}
+
+void test_sh_prompt_vcs_async(void)
+{
+     char dir[] = "/tmp/test-lab-repoXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char path[PATH_MAX];
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     FILE *f = fopen(path, "w");
+     TEST_ASSERT_NOT_NULL(f);
+     fputs("ref: refs/heads/topic\n", f);
+     fclose(f);
+     snprintf(path, sizeof(path), "%s/src", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+
+     char *branch = prompt_vcs_branch(path);
+     TEST_ASSERT_EQUAL_STRING("topic", branch);
+     free(branch);
+     TEST_ASSERT_NULL(prompt_vcs_branch("/"));
+
+     char old[PATH_MAX];
+     TEST_ASSERT_NOT_NULL(getcwd(old, sizeof(old)));
+     TEST_ASSERT_EQUAL_INT(0, chdir(path));
+     setenv("MY_PROMPT", "(\\g)$ ", 1);
+     struct shell sh = SHELL_INITIALIZER;
+     TEST_ASSERT_EQUAL_INT(0, prompt_async_init(&sh));
+
+     //the prompt is ready at once, the branch arrives from the worker
+     TEST_ASSERT_EQUAL_STRING("()$ ", sh_prompt(&sh));
+     struct pollfd pfd = { .fd = sh.prompt_fd, .events = POLLIN };
+     TEST_ASSERT_EQUAL_INT(1, poll(&pfd, 1, 5000));
+     TEST_ASSERT_TRUE(sh_prompt_refresh(&sh));
+     TEST_ASSERT_EQUAL_STRING("(topic)$ ", sh_prompt(&sh));
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(old));
+     unsetenv("MY_PROMPT");
+     sh_destroy(&sh);
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     unlink(path);
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     rmdir(path);
+     snprintf(path, sizeof(path), "%s/src", dir);
+     rmdir(path);
+     rmdir(dir);
+}
+
+void test_builtin_lookup(void)
+{
+     size_t n;
+     const struct builtin *table = builtin_list(&n);
+     TEST_ASSERT_TRUE(n > 0);
+     //every entry has to be reachable through the switch
+     for (size_t i = 0; i < n; i++) {
+          TEST_ASSERT_EQUAL_PTR(&table[i], builtin_lookup(table[i].name));
+     }
+     TEST_ASSERT_NOT_NULL(builtin_lookup("MY_PROMPT=foo"));
+     TEST_ASSERT_NULL(builtin_lookup("MY_PROMPT"));
+     TEST_ASSERT_NULL(builtin_lookup("ce"));
+     TEST_ASSERT_NULL(builtin_lookup("hist"));
+     TEST_ASSERT_NULL(builtin_lookup("cd="));
+     TEST_ASSERT_NULL(builtin_lookup(""));
+}
+
+void test_do_builtin(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char *set_argv[] = {"set", "-o", "pipefail", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, set_argv));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     TEST_ASSERT_TRUE(sh.pipefail);
+
+     char *bad_argv[] = {"set", "-x", "pipefail", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, bad_argv));
+     TEST_ASSERT_NOT_EQUAL(0, sh.last_status);
+
+     char *exit_argv[] = {"exit", "3", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, exit_argv));
+     TEST_ASSERT_TRUE(sh.exit_requested);
+     TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+
+     char *ls_argv[] = {"ls", NULL};
+     TEST_ASSERT_FALSE(do_builtin(&sh, ls_argv));
+     sh_destroy(&sh);
+}
+
+void test_builtin_output_redirect(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char path[] = "/tmp/test-lab-builtinXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     char *echo_argv[] = {"echo", "-n", "a", "b", ">", path, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, echo_argv));
+     char *printf_argv[] = {"printf", "[%s=%03d]\\n", "x", "7", "y", ">>", path, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, printf_argv));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     //stdout is the shell's own again once the builtin is done
+     struct stat before, after;
+     TEST_ASSERT_EQUAL_INT(0, fstat(STDOUT_FILENO, &after));
+     TEST_ASSERT_EQUAL_INT(0, stat(path, &before));
+     TEST_ASSERT_FALSE(before.st_ino == after.st_ino && before.st_dev == after.st_dev);
+
+     char buf[64] = {0};
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+     fclose(f);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING("a b[x=007]\n[y=000]\n", buf);
+     TEST_ASSERT_EQUAL_INT(19, n);
+     sh_destroy(&sh);
+}
+
+void test_builtin_test_status(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char *eq[] = {"test", "3", "-eq", "3", NULL};
+     char *and[] = {"[", "1", "-lt", "2", "-a", "(", "x", "!=", "y", ")", "]", NULL};
+     char *not_dir[] = {"[", "!", "-d", "/", "]", NULL};
+     char *empty[] = {"test", "-n", "", NULL};
+     char *bad_int[] = {"test", "x", "-gt", "1", NULL};
+     char *no_close[] = {"[", "a", NULL};
+     char *false_argv[] = {"false", NULL};
+
+     TEST_ASSERT_TRUE(do_builtin(&sh, eq));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, and));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, not_dir));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, empty));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, bad_int));
+     TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, no_close));
+     TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+     TEST_ASSERT_TRUE(do_builtin(&sh, false_argv));
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     sh_destroy(&sh);
+}
+
+void test_builtin_in_pipeline(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char path[] = "/tmp/test-lab-builtinXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     //a builtin stage runs in a child and writes into the pipe
+     char *argv[] = {"echo", "hi", "|", "tr", "a-z", "A-Z", ">", path, NULL};
+     TEST_ASSERT_FALSE(do_builtin(&sh, argv));
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(argv, &pl));
+     TEST_ASSERT_TRUE(launch_pipeline(&sh, &pl, false) > 0);
+     TEST_ASSERT_EQUAL_INT(0, wait_pipeline(&sh, &pl));
+     pipeline_free(&pl);
+
+     char buf[16] = {0};
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     TEST_ASSERT_EQUAL_INT(3, fread(buf, 1, sizeof(buf) - 1, f));
+     fclose(f);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING("HI\n", buf);
+     sh_destroy(&sh);
+}
+
+void test_kill_list_rows(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char path[] = "/tmp/test-lab-killXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     char *argv[] = {"kill", "-l", ">", path, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     //every row ends in a name, never a space, and there are no empty rows
+     char line[256];
+     int rows = 0;
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     while (fgets(line, sizeof(line), f) != NULL) {
+          size_t len = strlen(line);
+          TEST_ASSERT_TRUE(len > 1 && line[len - 1] == '\n');
+          TEST_ASSERT_NOT_EQUAL(' ', line[len - 2]);
+          rows++;
+     }
+     fclose(f);
+     unlink(path);
+     TEST_ASSERT_TRUE(rows > 0);
+     sh_destroy(&sh);
+}
+
+void test_parallel_keep_order(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char path[] = "/tmp/test-lab-parallelXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     //the slowest task is first, -k still prints it first
+     char *argv[] = {"parallel", "-k", "-j", "3", "sh", "-c", "sleep 0.{}; echo {#}:{}",
+                     ":::", "3", "1", "2", ">", path, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     char buf[64] = {0};
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     TEST_ASSERT_EQUAL_INT(12, fread(buf, 1, sizeof(buf) - 1, f));
+     fclose(f);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING("1:3\n2:1\n3:2\n", buf);
+     sh_destroy(&sh);
+}
+
+void test_parallel_failures(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     //the status is the number of tasks that failed
+     char *argv[] = {"parallel", "-j", "2", "sh", "-c", "exit {}", ":::", "0", "3", "0", "1", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+
+     char *usage[] = {"parallel", "-j", "0", "true", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, usage));
+     TEST_ASSERT_EQUAL_INT(2, sh.last_status);
+     sh_destroy(&sh);
+}
+
+void test_parallel_operator_inputs(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char inputs[] = "/tmp/test-lab-parallelXXXXXX";
+     char path[] = "/tmp/test-lab-parallelXXXXXX";
+     int in_fd = mkstemp(inputs);
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(in_fd >= 0 && fd >= 0);
+     TEST_ASSERT_EQUAL_INT(12, write(in_fd, ">\n|\n<\n2>\n>>\n", 12));
+     close(in_fd);
+     close(fd);
+
+     //inputs that look like operators are still only arguments
+     char *argv[] = {"parallel", "-k", "-a", inputs, "echo", ">", path, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     char buf[64] = {0};
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     TEST_ASSERT_EQUAL_INT(12, fread(buf, 1, sizeof(buf) - 1, f));
+     fclose(f);
+     unlink(inputs);
+     unlink(path);
+     TEST_ASSERT_EQUAL_STRING(">\n|\n<\n2>\n>>\n", buf);
+     sh_destroy(&sh);
+}
+
+void test_parallel_stopped_task(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     //a stopped task is killed instead of waited on forever, and no more are started
+     char *argv[] = {"parallel", "-j", "1", "sh", "-c", "[ {} = 1 ] && kill -STOP $$; exit 0",
+                     ":::", "1", "2", "3", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(128 + SIGSTOP, sh.last_status);
+     sh_destroy(&sh);
+}
+
+void test_parallel_one_group(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     char path[] = "/tmp/test-lab-parallelXXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     //tasks that overlap all run in the same process group
+     char *argv[] = {"parallel", "-j", "3", "sh", "-c", "ps -o pgid= -p $$; sleep 0.2",
+                     ":::", "1", "2", "3", ">", path, NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, argv));
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     FILE *f = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(f);
+     long pgids[3] = {0};
+     for (int i = 0; i < 3; i++) {
+          TEST_ASSERT_EQUAL_INT(1, fscanf(f, "%ld", &pgids[i]));
+     }
+     fclose(f);
+     unlink(path);
+     TEST_ASSERT_EQUAL_INT(pgids[0], pgids[1]);
+     TEST_ASSERT_EQUAL_INT(pgids[0], pgids[2]);
+     TEST_ASSERT_NOT_EQUAL(getpgrp(), pgids[0]);
+     sh_destroy(&sh);
+}
+
+void test_job_resource_accounting(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     sh.next_job_id = 1;
+     TEST_ASSERT_EQUAL_INT(0, job_events_init(&sh));
+     //burn a little CPU so the job has something to account for
+     char *args[] = {"sh", "-c", "i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done", NULL};
+     TEST_ASSERT_EQUAL_INT(0, start_background_process(&sh, args, "busy"));
+     int finished = 0;
+     for (int i = 0; i < 20 && finished == 0; i++) {
+          finished = wait_for_jobs(&sh, 1000);
+     }
+     TEST_ASSERT_EQUAL_INT(1, finished);
+
+     const struct job_acct *a = &sh.bg_jobs[0].acct;
+     TEST_ASSERT_TRUE(timespec_seconds(&a->start, &a->end) > 0);
+     TEST_ASSERT_TRUE(a->utime.tv_sec > 0 || a->utime.tv_usec > 0 ||
+                      a->stime.tv_sec > 0 || a->stime.tv_usec > 0);
+     TEST_ASSERT_TRUE(a->maxrss_kb > 0);
+     sh_destroy(&sh);
+}
+
+void test_time_builtin(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     //the report goes to stderr, keep it out of the test output
+     fflush(stderr);
+     int saved = dup(STDERR_FILENO);
+     int devnull = open("/dev/null", O_WRONLY);
+     TEST_ASSERT_TRUE(saved >= 0 && devnull >= 0);
+     dup2(devnull, STDERR_FILENO);
+
+     char *external[] = {"time", "sh", "-c", "exit 3", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, external));
+     int external_status = sh.last_status;
+     char *piped[] = {"time", "false", "|", "true", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, piped));
+     int piped_status = sh.last_status;
+     char *builtin[] = {"time", "false", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, builtin));
+     int builtin_status = sh.last_status;
+
+     dup2(saved, STDERR_FILENO);
+     close(saved);
+     close(devnull);
+     TEST_ASSERT_EQUAL_INT(3, external_status);
+     TEST_ASSERT_EQUAL_INT(0, piped_status);
+     TEST_ASSERT_EQUAL_INT(1, builtin_status);
+     sh_destroy(&sh);
+}
+
+void test_stat_histogram(void)
+{
+     struct shell sh = SHELL_INITIALIZER;
+     //every bucket holds the values between the previous bucket's max and its own
+     for (int b = 1; b < STAT_BUCKETS; b++) {
+          TEST_ASSERT_EQUAL_INT(b, stat_bucket(stat_bucket_max(b - 1) + 1));
+          TEST_ASSERT_EQUAL_INT(b, stat_bucket(stat_bucket_max(b)));
+     }
+     TEST_ASSERT_EQUAL_INT(STAT_BUCKETS - 1, stat_bucket(UINT64_MAX));
+
+     for (uint64_t ns = 1; ns <= 1000; ns++) {
+          stat_record(&sh, STAT_PARSE, ns * 1000);
+     }
+     const struct stat_hist *h = &sh.stats[STAT_PARSE];
+     TEST_ASSERT_EQUAL_UINT64(1000, h->count);
+     TEST_ASSERT_EQUAL_UINT64(1000000, h->max_ns);
+     //within the 1/16 width of a bucket
+     uint64_t p50 = stat_percentile(h, 50);
+     uint64_t p99 = stat_percentile(h, 99);
+     TEST_ASSERT_TRUE(p50 >= 500000 && p50 <= 500000 + 500000 / 16);
+     TEST_ASSERT_TRUE(p99 >= 990000 && p99 <= 1000000);
+     TEST_ASSERT_EQUAL_UINT64(1000000, stat_percentile(h, 100));
+     TEST_ASSERT_EQUAL_UINT64(0, stat_percentile(&sh.stats[STAT_EXEC], 50));
+
+     //running a command times its stages
+     char *cmd[] = {"true", "|", "true", NULL};
+     struct pipeline pl;
+     TEST_ASSERT_EQUAL_INT(0, pipeline_parse(cmd, &pl));
+     TEST_ASSERT_TRUE(launch_pipeline(&sh, &pl, false) > 0);
+     TEST_ASSERT_EQUAL_INT(0, wait_pipeline(&sh, &pl));
+     pipeline_free(&pl);
+     TEST_ASSERT_EQUAL_UINT64(2, sh.stats[STAT_LAUNCH].count);
+     TEST_ASSERT_EQUAL_UINT64(1, sh.stats[STAT_EXEC].count);
+
+     char *reset[] = {"stats", "-r", NULL};
+     TEST_ASSERT_TRUE(do_builtin(&sh, reset));
+     //the dispatch is counted before the builtin clears it
+     TEST_ASSERT_EQUAL_UINT64(0, sh.stats[STAT_PARSE].count);
+     TEST_ASSERT_EQUAL_UINT64(0, sh.stats[STAT_BUILTIN].count);
+     sh_destroy(&sh);
+}
+
 void test_trim_white_no_whitespace(void)
 {
      char *line = (char*) calloc(10, sizeof(char));
@@ -163,6 +1242,48 @@ int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_cmd_parse);
   RUN_TEST(test_cmd_parse2);
+  RUN_TEST(test_cmd_parse_many_tokens);
+  RUN_TEST(test_argv_builder_byte_limit);
+  RUN_TEST(test_cmd_parse_inplace);
+  RUN_TEST(test_arena_reset_reuses_blocks);
+  RUN_TEST(test_cmd_parse_arena);
+  RUN_TEST(test_cmd_hash_lookup);
+  RUN_TEST(test_cmd_hash_path_change);
+  RUN_TEST(test_launch_script_without_shebang);
+  RUN_TEST(test_background_exit_code);
+  RUN_TEST(test_job_table_recycles_slots);
+  RUN_TEST(test_job_table_full_reports_before_evicting);
+  RUN_TEST(test_wait_for_jobs_timeout);
+  RUN_TEST(test_cmd_parse_pipe_tokens);
+  RUN_TEST(test_pipeline_syntax_error);
+  RUN_TEST(test_pipeline_status);
+  RUN_TEST(test_pipeline_redirections);
+  RUN_TEST(test_redirect_output_to_file);
+  RUN_TEST(test_redirect_sources_do_not_collide);
+  RUN_TEST(test_line_reader_string);
+  RUN_TEST(test_line_reader_file_and_pipe);
+  RUN_TEST(test_script_image_cache);
+  RUN_TEST(test_history_file);
+  RUN_TEST(test_history_find);
+  RUN_TEST(test_suggest_frecency);
+  RUN_TEST(test_outbuf_chunks);
+  RUN_TEST(test_sh_prompt_cached);
+  RUN_TEST(test_sh_prompt_escapes);
+  RUN_TEST(test_sh_prompt_vcs_async);
+  RUN_TEST(test_builtin_lookup);
+  RUN_TEST(test_do_builtin);
+  RUN_TEST(test_builtin_output_redirect);
+  RUN_TEST(test_builtin_test_status);
+  RUN_TEST(test_builtin_in_pipeline);
+  RUN_TEST(test_kill_list_rows);
+  RUN_TEST(test_parallel_keep_order);
+  RUN_TEST(test_parallel_failures);
+  RUN_TEST(test_parallel_operator_inputs);
+  RUN_TEST(test_parallel_stopped_task);
+  RUN_TEST(test_parallel_one_group);
+  RUN_TEST(test_job_resource_accounting);
+  RUN_TEST(test_time_builtin);
+  RUN_TEST(test_stat_histogram);
   RUN_TEST(test_trim_white_no_whitespace);
   RUN_TEST(test_trim_white_start_whitespace);
   RUN_TEST(test_trim_white_end_whitespace);